@@ -0,0 +1,141 @@
+#!/bin/sh
+#
+# Benchmark geoloc on a synthetic corpus (see gencorpus.py).
+#
+# For each grid granularity in BENCH_GRANULARITIES this trains a model per
+# variant (nb: default KDE model, nomatrix: --nomatrix, nokde: --nokde,
+# bin: --model-format=bin) and times training, --classify and --eval; the nb
+# model is also evaluated with --kullback-leibler (variant kl).  Training is
+# also split into its phases from --stats: reading the training set
+# (train_read), the per-word KDE (train_kde) and serializing the model
+# (train_write).  Model loading (load) is the model_load_s of the --classify
+# run.  Text models with a word index (.idx) only read the index up front and
+# load words as they are first used, so for them most of the loading cost
+# shows up in classify instead.  Every measurement is one JSON object per
+# line in $BENCH_DIR/results.jsonl, and a summary table goes to stdout.
+#
+# Usage: bench/bench.sh [GEOLOC]      (or: make bench)
+#
+# Environment (defaults in brackets):
+#   BENCH_DIR            work directory for corpus and models [bench/out]
+#   BENCH_DOCS           training documents [50000]
+#   BENCH_TEST           test documents for --classify/--eval [2000]
+#   BENCH_SEED           corpus seed [1]
+#   BENCH_GRANULARITIES  longitude granularities [72 180 360]
+#   BENCH_VARIANTS       variants to run [nb kl nomatrix nokde bin]
+#   BENCH_THREADS        --threads for training and classification [1]
+#   BENCH_THRESHOLD      --threshold for training [2]
+
+GEOLOC=${1:-./geoloc}
+BENCHSRC=$(dirname "$0")
+BENCH_DIR=${BENCH_DIR:-bench/out}
+BENCH_DOCS=${BENCH_DOCS:-50000}
+BENCH_TEST=${BENCH_TEST:-2000}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_GRANULARITIES=${BENCH_GRANULARITIES:-72 180 360}
+BENCH_VARIANTS=${BENCH_VARIANTS:-nb kl nomatrix nokde bin}
+BENCH_THREADS=${BENCH_THREADS:-1}
+BENCH_THRESHOLD=${BENCH_THRESHOLD:-2}
+PYTHON=${PYTHON:-python3}
+
+if [ ! -x "$GEOLOC" ]; then
+    echo "bench: '$GEOLOC' not found, run make first" >&2
+    exit 1
+fi
+
+mkdir -p "$BENCH_DIR" || exit 1
+RESULTS=$BENCH_DIR/results.jsonl
+CORPUS=$BENCH_DIR/corpus-$BENCH_DOCS-$BENCH_TEST-$BENCH_SEED
+: > "$RESULTS"
+
+now() {
+    date +%s.%N
+}
+
+# record VARIANT GRANULARITY PHASE START END DOCS [EXTRA-JSON]
+record() {
+    awk -v v="$1" -v g="$2" -v p="$3" -v s="$4" -v e="$5" -v n="$6" -v x="$7" \
+	-v docs="$BENCH_DOCS" -v threads="$BENCH_THREADS" 'BEGIN {
+	t = e - s
+	printf "{\"variant\": \"%s\", \"granularity\": %d, \"phase\": \"%s\", \"seconds\": %.3f", v, g, p, t
+	if (n > 0)
+	    printf ", \"docs\": %d, \"docs_per_sec\": %.1f", n, (t > 0 ? n / t : 0)
+	printf ", \"train_docs\": %d, \"threads\": %d%s}\n", docs, threads, x
+    }' >> "$RESULTS"
+}
+
+# Field NAME of the last --stats line of MODE in LOG (0 if missing)
+statsfield() {
+    v=$(grep "^{\"mode\": \"$2\"" "$1" | tail -1 | sed -n "s/.*\"$3\": \([0-9.eE+-]*\).*/\1/p")
+    echo "${v:-0}"
+}
+
+# Summary of an --eval run as JSON fields
+evalfields() {
+    awk '/^MEAN DISTANCE/ { mean = $3 } /^MEDIAN DISTANCE/ { median = $3 }
+	END { printf ", \"mean_km\": %s, \"median_km\": %s", mean, median }' "$1"
+}
+
+if [ ! -f "$CORPUS.train.txt" ] || [ ! -f "$CORPUS.test.txt" ]; then
+    echo "Generating corpus: $BENCH_DOCS training and $BENCH_TEST test documents (seed $BENCH_SEED)" >&2
+    "$PYTHON" "$BENCHSRC/gencorpus.py" --docs "$BENCH_DOCS" --test "$BENCH_TEST" \
+	--seed "$BENCH_SEED" --output "$CORPUS" || exit 1
+fi
+cut -d, -f3- "$CORPUS.test.txt" > "$CORPUS.classify.txt"
+
+for g in $BENCH_GRANULARITIES; do
+    for v in $BENCH_VARIANTS; do
+	case $v in
+	    nb|kl)    model=$BENCH_DIR/model-nb-$g-$BENCH_DOCS-$BENCH_SEED.gz; trainopts= ;;
+	    nomatrix) model=$BENCH_DIR/model-nomatrix-$g-$BENCH_DOCS-$BENCH_SEED.gz; trainopts=--nomatrix ;;
+	    nokde)    model=$BENCH_DIR/model-nokde-$g-$BENCH_DOCS-$BENCH_SEED.gz; trainopts=--nokde ;;
+	    bin)      model=$BENCH_DIR/model-bin-$g-$BENCH_DOCS-$BENCH_SEED.bin; trainopts=--model-format=bin ;;
+	    *) echo "bench: unknown variant '$v'" >&2; exit 1 ;;
+	esac
+	testopts=
+	[ "$v" = kl ] && testopts=--kullback-leibler
+	log=$BENCH_DIR/$v-$g.log
+
+	# kl shares the nb model, so train it only once
+	if [ "$v" != kl ] || [ ! -f "$model" ]; then
+	    echo "[$v $g] train" >&2
+	    s=$(now)
+	    "$GEOLOC" --train --stats --longranularity="$g" --threshold="$BENCH_THRESHOLD" --threads="$BENCH_THREADS" \
+		$trainopts --modelfile="$model" "$CORPUS.train.txt" 2> "$log" || { cat "$log" >&2; exit 1; }
+	    e=$(now)
+	    record "$v" "$g" train "$s" "$e" "$BENCH_DOCS" ", \"model_bytes\": $(wc -c < "$model")"
+	    record "$v" "$g" train_read 0 "$(statsfield "$log" train read_s)" "$BENCH_DOCS"
+	    record "$v" "$g" train_kde 0 "$(statsfield "$log" train kde_s)" 0 \
+		", \"words\": $(statsfield "$log" train words), \"kde_per_word_us\": $(statsfield "$log" train kde_per_word_us)"
+	    record "$v" "$g" train_write 0 "$(statsfield "$log" train write_s)" 0 ", \"bytes_written\": $(statsfield "$log" train bytes_written)"
+	fi
+
+	echo "[$v $g] classify" >&2
+	s=$(now)
+	"$GEOLOC" --classify --stats $testopts --threads="$BENCH_THREADS" --modelfile="$model" \
+	    "$CORPUS.classify.txt" > /dev/null 2>> "$log" || exit 1
+	e=$(now)
+	record "$v" "$g" load 0 "$(statsfield "$log" classify model_load_s)" 0
+	record "$v" "$g" classify "$s" "$e" "$BENCH_TEST"
+
+	echo "[$v $g] eval" >&2
+	s=$(now)
+	"$GEOLOC" --eval $testopts --threads="$BENCH_THREADS" --modelfile="$model" \
+	    "$CORPUS.test.txt" > "$BENCH_DIR/$v-$g.eval" 2>> "$log" || exit 1
+	e=$(now)
+	record "$v" "$g" eval "$s" "$e" "$BENCH_TEST" "$(evalfields "$BENCH_DIR/$v-$g.eval")"
+    done
+done
+
+# Human-readable summary of the JSON lines
+awk 'BEGIN { printf "%-10s %6s %-12s %10s %12s %10s\n", "variant", "grid", "phase", "seconds", "docs/s", "median_km" }
+{
+    v = $0; sub(/.*"variant": "/, "", v); sub(/".*/, "", v)
+    g = $0; sub(/.*"granularity": /, "", g); sub(/,.*/, "", g)
+    p = $0; sub(/.*"phase": "/, "", p); sub(/".*/, "", p)
+    t = $0; sub(/.*"seconds": /, "", t); sub(/,.*/, "", t)
+    r = "-"; if ($0 ~ /docs_per_sec/) { r = $0; sub(/.*"docs_per_sec": /, "", r); sub(/,.*/, "", r) }
+    m = "-"; if ($0 ~ /median_km/) { m = $0; sub(/.*"median_km": /, "", m); sub(/[,}].*/, "", m) }
+    printf "%-10s %6s %-12s %10s %12s %10s\n", v, g, p, t, r, m
+}' "$RESULTS"
+echo "Results written to $RESULTS" >&2
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+
+#############################################################################################
+# Synthetic geolocation corpus for benchmarking geoloc                                      #
+#                                                                                           #
+# Documents are drawn from a number of geographic clusters (cities) whose sizes follow a    #
+# Zipf law. Each document's coordinate is Gaussian around its cluster center; its words are #
+# a mix of a global Zipfian vocabulary (function words, shared by all clusters) and a       #
+# cluster-local Zipfian vocabulary (place names, local slang), which is what makes the      #
+# locations learnable. The output is fully determined by the options and --seed.            #
+#                                                                                           #
+# Write bench.train.txt and bench.test.txt (both latitude,longitude,features...):           #
+# ./gencorpus.py --docs 50000 --test 2000 --output bench                                    #
+#                                                                                           #
+# Write only features (for --classify) to stdout:                                           #
+# ./gencorpus.py --docs 1000 --nocoords                                                     #
+#############################################################################################
+
+import argparse
+import bisect
+import random
+import sys
+
+
+def zipf_cdf(n, s):
+    """Cumulative weights of ranks 1..n under a Zipf law with exponent s."""
+    cdf, total = [], 0.0
+    for r in range(1, n + 1):
+        total += 1.0 / r ** s
+        cdf.append(total)
+    return cdf
+
+
+def zipf_draw(rng, cdf):
+    """Draw a 0-based rank from cumulative weights cdf."""
+    return min(bisect.bisect_left(cdf, rng.random() * cdf[-1]), len(cdf) - 1)
+
+
+def make_clusters(rng, n, spread):
+    """Cluster centers, kept off the poles so the Gaussians don't wrap."""
+    clusters = []
+    for _ in range(n):
+        lat = rng.uniform(-55.0, 70.0)
+        lon = rng.uniform(-180.0, 180.0)
+        clusters.append((lat, lon, spread * (0.5 + rng.random())))
+    return clusters
+
+
+def write_docs(out, rng, numdocs, args, clusters, clustercdf, globalcdf, localcdf, coords):
+    for _ in range(numdocs):
+        k = zipf_draw(rng, clustercdf)
+        lat0, lon0, sd = clusters[k]
+        lat = max(-89.9, min(89.9, lat0 + rng.gauss(0.0, sd)))
+        lon = lon0 + rng.gauss(0.0, sd)
+        lon = (lon + 180.0) % 360.0 - 180.0
+        length = rng.randint(args.minlength, args.maxlength)
+        words = []
+        for _ in range(length):
+            if rng.random() < args.local:
+                words.append("c%d_%d" % (k, zipf_draw(rng, localcdf)))
+            else:
+                words.append("w%d" % zipf_draw(rng, globalcdf))
+        if coords:
+            out.write("%.6f,%.6f,%s\n" % (lat, lon, ",".join(words)))
+        else:
+            out.write("%s\n" % ",".join(words))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate a reproducible synthetic corpus for geoloc.")
+    parser.add_argument("--docs", type=int, default=50000, help="number of training documents")
+    parser.add_argument("--test", type=int, default=0, help="number of held-out test documents")
+    parser.add_argument("--vocab", type=int, default=50000, help="size of the global vocabulary")
+    parser.add_argument("--localvocab", type=int, default=200, help="local vocabulary size per cluster")
+    parser.add_argument("--clusters", type=int, default=300, help="number of geographic clusters")
+    parser.add_argument("--spread", type=float, default=1.5, help="typical cluster standard deviation in degrees")
+    parser.add_argument("--zipf", type=float, default=1.1, help="Zipf exponent of word frequencies")
+    parser.add_argument("--clusterzipf", type=float, default=1.0, help="Zipf exponent of cluster sizes")
+    parser.add_argument("--local", type=float, default=0.2, help="fraction of tokens drawn from the local vocabulary")
+    parser.add_argument("--minlength", type=int, default=5, help="minimum document length in tokens")
+    parser.add_argument("--maxlength", type=int, default=20, help="maximum document length in tokens")
+    parser.add_argument("--seed", type=int, default=1, help="random seed")
+    parser.add_argument("--nocoords", action="store_true", help="print features only (--classify input)")
+    parser.add_argument("--output", help="write PREFIX.train.txt (and PREFIX.test.txt) instead of stdout")
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    clusters = make_clusters(rng, args.clusters, args.spread)
+    clustercdf = zipf_cdf(args.clusters, args.clusterzipf)
+    globalcdf = zipf_cdf(args.vocab, args.zipf)
+    localcdf = zipf_cdf(args.localvocab, args.zipf)
+    tables = (clusters, clustercdf, globalcdf, localcdf)
+
+    if args.output is None:
+        write_docs(sys.stdout, rng, args.docs + args.test, args, *tables, coords=not args.nocoords)
+        return
+    with open(args.output + ".train.txt", "w") as out:
+        write_docs(out, rng, args.docs, args, *tables, coords=not args.nocoords)
+    if args.test > 0:
+        with open(args.output + ".test.txt", "w") as out:
+            write_docs(out, rng, args.test, args, *tables, coords=not args.nocoords)
+
+
+if __name__ == "__main__":
+    main()
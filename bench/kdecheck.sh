@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Check the separable KDE kernel against the direct evaluation of the
+# bivariate Gaussian at every cell (--kde-direct).  For each granularity in
+# CHECK_GRANULARITIES this trains a text model both ways on a small synthetic
+# corpus (see gencorpus.py) and compares the two models value by value: the
+# words, cells and sparse structure must be the same, and numbers may differ
+# by at most CHECK_TOLERANCE relative to the larger of the two.
+#
+# Usage: bench/kdecheck.sh [GEOLOC]      (or: make check)
+#
+# Environment (defaults in brackets):
+#   CHECK_DIR            work directory for corpus and models [bench/out/check]
+#   CHECK_DOCS           training documents [5000]
+#   CHECK_GRANULARITIES  longitude granularities [72 180]
+#   CHECK_TOLERANCE      largest relative difference allowed [1e-5]
+
+GEOLOC=${1:-./geoloc}
+BENCHSRC=$(dirname "$0")
+CHECK_DIR=${CHECK_DIR:-bench/out/check}
+CHECK_DOCS=${CHECK_DOCS:-5000}
+CHECK_GRANULARITIES=${CHECK_GRANULARITIES:-72 180}
+CHECK_TOLERANCE=${CHECK_TOLERANCE:-1e-5}
+PYTHON=${PYTHON:-python3}
+
+if [ ! -x "$GEOLOC" ]; then
+    echo "kdecheck: '$GEOLOC' not found, run make first" >&2
+    exit 1
+fi
+
+mkdir -p "$CHECK_DIR" || exit 1
+CORPUS=$CHECK_DIR/corpus-$CHECK_DOCS
+if [ ! -f "$CORPUS.train.txt" ]; then
+    "$PYTHON" "$BENCHSRC/gencorpus.py" --docs "$CHECK_DOCS" --seed 7 --output "$CORPUS" || exit 1
+fi
+
+status=0
+for g in $CHECK_GRANULARITIES; do
+    for k in separable direct; do
+	opts=
+	[ "$k" = direct ] && opts=--kde-direct
+	"$GEOLOC" --train --longranularity="$g" $opts --modelfile="$CHECK_DIR/$k-$g.gz" \
+	    "$CORPUS.train.txt" 2> "$CHECK_DIR/$k-$g.log" || { cat "$CHECK_DIR/$k-$g.log" >&2; exit 1; }
+	gzip -dc "$CHECK_DIR/$k-$g.gz" > "$CHECK_DIR/$k-$g.txt"
+    done
+    awk -v g="$g" -v tol="$CHECK_TOLERANCE" '
+	function isnum(s) { return s ~ /^[-+]?([0-9]+\.?[0-9]*|\.[0-9]+)([eE][-+]?[0-9]+)?$/ }
+	BEGIN { maxdiff = 0 }
+	NR == FNR { a[FNR] = $0; n = FNR; next }
+	{
+	    if (FNR > n) { bad = "extra line " FNR; exit }
+	    k = split(a[FNR], x, /[ \t]+/)
+	    if (split($0, y, /[ \t]+/) != k) { bad = "line " FNR " differs"; exit }
+	    for (i = 1; i <= k; i++) {
+		if (x[i] == y[i])
+		    continue
+		if (!isnum(x[i]) || !isnum(y[i])) { bad = "line " FNR " differs"; exit }
+		d = x[i] - y[i]; d = d < 0 ? -d : d
+		m = x[i] < 0 ? -x[i] : x[i]; m2 = y[i] < 0 ? -y[i] : y[i]; m = m > m2 ? m : m2
+		if (d / m > maxdiff)
+		    maxdiff = d / m
+	    }
+	    values += k
+	}
+	END {
+	    if (bad == "" && FNR < n)
+		bad = "missing line " FNR + 1
+	    if (bad == "" && maxdiff > tol)
+		bad = "relative difference " maxdiff " above " tol
+	    if (bad != "") {
+		printf "FAIL %s: %s\n", g, bad
+		exit 1
+	    }
+	    printf "ok   %s: %d values, largest relative difference %g\n", g, values, maxdiff
+	}' "$CHECK_DIR/separable-$g.txt" "$CHECK_DIR/direct-$g.txt" || status=1
+    rm -f "$CHECK_DIR/separable-$g.txt" "$CHECK_DIR/direct-$g.txt"
+done
+exit $status
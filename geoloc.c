@@ -23,6 +23,23 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <float.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <pthread.h>
+#if defined(__AVX__) || (defined(__GNUC__) && defined(__x86_64__))
+#include <immintrin.h>
+#endif
 
 #include "zlib.h"
 #include "wordhash.h"
@@ -31,8 +48,22 @@
 #define MODE_CLASSIFY   1
 #define MODE_EVAL       2
 #define MODE_TUNE       3
+#define MODE_SERVE      4
+#define MODE_UPDATE     5
+#define MODE_SWEEP      6
+#define MODE_COMPACT    7
 
 #define MAX_LINE_SIZE 1048576
+#define DOCREADER_BUFSIZE 4194304 /* Initial input buffer; grows for longer lines */
+#define WORDSARRAYSIZE 16
+
+#define TWOPI 6.283185307179586477
+
+#define MODEL_FORMAT_TEXT 0
+#define MODEL_FORMAT_BIN  1
+
+#define PRINT_MATRIX_TEXT   1
+#define PRINT_MATRIX_BINARY 2
 
 /* GLOBAL variables */
 int g_longranularity = 360;   // Cellgranularity: default is one degree per tick
@@ -41,8 +72,10 @@ int g_use_centroid = 0;       // Whether to use centroids at classification time
 int g_unk = 0;                // Whether to model unknown words (1) or to skip them (0)
 int g_kullback_leibler = 0;   // Whether to use KL-divergence for classification (default is Naive Bayes)
 int g_nokde = 0;              // Skip KDE and just run a "classic" geodesic grid classifier
+int g_kde_direct = 0;         // Evaluate the bivariate Gaussian at every cell even when it is separable
 int g_nomatrix = 0;           // Don't store matrix at all (for smaller model, matrix is computed at class. time)
-int g_print_matrix = 0;       // Whether to output the whole matrix at classification time
+int g_print_matrix = 0;       // Whether to output the whole matrix at classification time (PRINT_MATRIX_TEXT or _BINARY)
+int g_print_topk = 0;         // Number of most likely cells to output along with the estimate
 int g_total_wordcount = 0;    // Total wordcount (tokens)
 double g_wordprior = 0.01;    // pseudocounts for words (features)
 double g_tweetprior = 1.0;    // pseudocount for tweets (tweets)
@@ -50,35 +83,106 @@ int g_threshold = 1;          // Have to see a word/feature this many times to c
 double g_sigma = 3.0;         // Defines the covariance of the Gaussian for KDE
 unsigned int g_wordtypes = 0; // Number of word types
 int g_complement_nb = 0;      // Whether to do complement naive Bayes
+int g_batch = 32;             // Documents scored together by the batched Naive Bayes kernel (1 = one at a time)
+int g_coarse_to_fine = 0;     // Cells kept per level in coarse-to-fine search (0 = score every cell)
+int g_threads = 1;            // Number of threads classifying documents in --classify/--eval
+int g_model_format = MODEL_FORMAT_TEXT; // Format of model written at training time (gzipped text or binary)
+long g_matrix_cache = 256;    // Budget (MB) for word matrices computed (--nomatrix) or unpacked (--quantize) at classification time
+int g_quantize = 0;           // Whether to keep word matrices packed as half-precision runs
+int g_float32 = 0;            // Whether to score documents in single precision (--float32)
+long g_max_memory = 0;        // Budget (MB) for buffered word coordinates when training in two streaming passes (0 = read all into memory)
+int g_tune_epochs = 10;       // Maximum passes over the tuning set (--tune)
+double g_tune_rate = 0.01;    // Initial feature weight step (--tune), divided by 1 + epoch
+int g_stats = 0;              // Whether to collect counters and timers and report them as JSON (--stats)
+double g_stats_interval = 0;  // Seconds between reports while serving (0 = only at exit)
+int g_compress_level = 6;     // Deflate level of text models written (0 = store, 9 = smallest)
+double g_min_weight = -1.0;   // --compact drops features with weight at or below this (< 0 = keep all)
+double g_max_entropy = 1.0;   // --compact drops features whose mass is more spread out than this (1 = keep all)
+double g_mass_epsilon = 0.0;  // --compact zeroes matrix entries below this fraction of the word's mass
 
 static char *versionstring = "Geoloc v1.1";
 static char *helpstring =
 "\n"
 "Train a geolocator and classify text documents on a geodesic grid.\n\n"
 
-" Usage: geoloc [--train|--eval|--classify] [options] DOCUMENTFILENAME\n\n"
+" Usage: geoloc [--train|--update|--eval|--sweep|--classify] [options] DOCUMENTFILENAME\n"
+"        geoloc --compact [compaction options] --modelfile=MODEL OUTPUTMODEL\n"
+"        geoloc --serve [--socket=PATH|--port=PORT] [options]\n\n"
 
 "Main options:\n\n"
 " -h , --help               Print this help.\n"
 " -r , --train              Train a geolocator.\n"
+" -R , --update             Add the documents in DOCUMENTFILENAME to an existing (text) model.\n"
 " -C , --classify           Classify documents into cells on the earth.\n"
 " -e , --eval               Evaluate performance on dev/test set, with accuracy report.\n"
-" -m , --modelfile=FILE     Output model or read model from FILE (otherwise a default name is used).\n\n"
+" -T , --tune               Learn Naive Bayes feature weights on DOCUMENTFILENAME, stopping on the\n"
+"                           error on an optional second (held-out) file; rewrites the text model.\n"
+" -W , --sweep[=CLS]        Evaluate once per combination of the --prior and --sigma lists and the\n"
+"                           classifiers CLS (default 'nb,kl'), with center and centroid placement.\n"
+" -D , --serve              Load model once and classify documents sent on stdin (or a socket).\n"
+" -O , --compact            Write a smaller copy of a text model to OUTPUTMODEL, dropping features\n"
+"                           and matrix entries (see Compaction options).\n"
+" -m , --modelfile=FILE     Output model or read model from FILE (otherwise a default name is used).\n"
+" -I , --stats[=SECS]       Report counters and phase timings as JSON on stderr at exit (and every\n"
+"                           SECS seconds while serving).\n\n"
 
 "Training options:\n\n"
 " -l , --longranularity=LON Grid size (we divide 360 degrees into LON ticks).\n"
 " -n , --nokde              Train a vanilla geodesic grid classifier without kernel density.\n"
+" -G , --kde-direct         Evaluate the full Gaussian at every cell (slower, same model; this\n"
+"                           checks the separable kernel, see make check).\n"
 " -s , --stopwords=FILE     Read stopwords from FILE (one word per line).\n"
-" -S , --sigma=SIGMA        Standard deviation of Gaussians in kernel density estimation.\n"
+" -S , --sigma=SIGMA        Standard deviation of Gaussians in kernel density estimation\n"
+"                           (with --sweep, a comma-separated list to re-estimate the model for).\n"
 " -x , --threshold=THR      Must see a word/feature THR times to include in model when training.\n\n"
-" -N , --nomatrix           Don't store word matrices = slow classification, but smaller model\n\n"
+" -N , --nomatrix           Don't store word matrices = slow classification, but smaller model\n"
+" -F , --model-format=FMT   Write model as 'text' (gzipped, default) or 'bin' (memory-mappable).\n"
+" -Q , --quantize           Store word matrices as half-precision runs in a binary model (about\n"
+"                           3x smaller); when classifying with a text model, pack them in memory.\n"
+" -X , --max-memory=MB      Train in two streaming passes, buffering at most MB megabytes of\n"
+"                           feature coordinates (spilling sorted runs to temporary files).\n"
+" -z , --compress-level=N   Deflate level of text models (also with --update and --tune), from\n"
+"                           1 (fastest) to 9 (smallest), or 0 for none (default 6).\n\n"
 
 "Test options:\n\n"
 " -k , --kullback-leibler   Use KL-divergence as classification method (instead of Naive Bayes).\n"
-" -M , --print-matrix       Print the whole distribution (the grid) at classification time.\n"
+" -M , --print-matrix[=FMT] Print the whole distribution (the grid) at classification time, as\n"
+"                           'text' (default) or 'binary' (float32 frames, see README).\n"
+" -K , --print-topk=K       Print the K most likely cells and their log-probabilities after\n"
+"                           each estimate (--classify and --serve).\n"
 " -c , --centroid           Use centroid of most likely cell instead of center.\n"
-" -p , --prior              Sets word/feature prior for a cell (default = 0.01).\n"
-" -u , --unk                Model unseen words/features instead of just skipping them.\n\n"
+" -p , --prior              Sets word/feature prior for a cell (default = 0.01; with --sweep, a\n"
+"                           comma-separated list).\n"
+" -u , --unk                Model unseen words/features instead of just skipping them.\n"
+" -H , --coarse-to-fine=K   Search a pyramid of coarser grids, refining the K best cells per level\n"
+"                           (Naive Bayes; much faster at high granularities, approximate).\n"
+" -t , --threads=N          Train or classify with N threads (output stays in input order).\n"
+" -Z , --matrix-cache=MB    With --nomatrix or packed models, keep up to MB megabytes of word\n"
+"                           matrices computed/unpacked for reuse (default 256, 0 = don't keep).\n"
+" -B , --batch=N            Score N documents at a time with Naive Bayes (default 32, 1 = off).\n"
+" -f , --float32[=scalar]   Score in single precision, with AVX2/NEON kernels where the CPU has\n"
+"                           them (or always the 'scalar' ones); not with --coarse-to-fine or --ensemble.\n"
+" -a , --ensemble=M1,M2,... Also load the models M1,M2,... and score every document with all of\n"
+"                           them, coarse to fine (--classify and --eval).\n"
+" -g , --ensemble-rule=R    Combine the models by 'product' (sum of log scores, default) or by\n"
+"                           'cascade' (each coarser model only picks where the finer one looks).\n"
+" -b , --ensemble-beam=K    Cells kept per model of an ensemble (default 16).\n\n"
+
+"Tuning options:\n\n"
+" -E , --epochs=N           At most N passes over the tuning documents (default 10).\n"
+" -L , --tune-rate=R        Weight step of the first epoch, divided by 1 + epoch after (default 0.01).\n\n"
+
+"Compaction options:\n\n"
+" -x , --threshold=THR      Drop features seen fewer than THR times.\n"
+" -w , --min-weight=W       Drop features with a weight of W or less (0 drops those --tune zeroed).\n"
+" -y , --max-entropy=H      Drop features whose mass is spread out more than H, the entropy of their\n"
+"                           matrix as a fraction of that of a uniform grid (0-1).\n"
+" -j , --mass-epsilon=E     Zero matrix entries holding less than E of their feature's mass.\n\n"
+
+"Server options:\n\n"
+" -U , --socket=PATH        Listen on Unix socket PATH instead of stdin/stdout.\n"
+" -P , --port=PORT          Listen on TCP port PORT instead of stdin/stdout.\n"
+" -K , --print-topk=K       Also answer with the K most likely cells and their log-probabilities.\n\n"
 
 "Usage examples:\n\n"
 " geoloc --train --longranularity=72  trainingdata.txt\n"
@@ -100,6 +204,9 @@ static char *helpstring =
 " geoloc --eval --modelfile=model360nokde  testdata.txt\n"
 " (evaluate classifier against testdata.txt; prints mean and median error)\n\n"
 
+" geoloc --serve --centroid --port=7000 --modelfile=model720.bin\n"
+" (keep model720.bin loaded and answer one LAT,LON line per document line sent to port 7000)\n\n"
+
 "File formats:\n\n"
 "Training data (--train) is one document per line: LAT,LON,feature1,...,featureN, e.g.:\n"
 "42.350771,-83.248981,my,features,are,words,in,this,case\n"
@@ -115,6 +222,8 @@ struct centroids {
 };
 
 struct centroids *g_centroids;
+int *g_centroidcounts = NULL; /* Documents per cell behind each centroid (text models, for --update) */
+double g_tweetmass = 0.0;     /* Sum of the p(c) matrix before normalization (text models, for --update) */
 
 /* 
 
@@ -150,11 +259,10 @@ being -180,-90 (lon,lat), and having it's center at -179.5, -89.5
 
 #define LATLONTOCELL(LAT,LON) (LATTOY(LAT) * g_longranularity + LONTOX(LON))
 
-/* Each tweet's and word/feature's coordinates are stored in a linked list of floats */
-struct coordinate_list {
+/* Each tweet's and word/feature's coordinates are stored in flat, growable arrays of floats */
+struct coordinate {
     float lat;
     float lon;
-    struct coordinate_list *next;
 };
 
 /* Simple sparse matrix format as array , -1 sentinel at x and y */
@@ -172,6 +280,26 @@ struct sparsematrix_handle {
     int tail;
 };
 
+/* Compact form of a sparse matrix (--quantize): runs of consecutive cells */
+/* in the sparse matrix order (down a column, x-major), each value a       */
+/* half-precision float scaled by the word's largest value. One block:     */
+/*   struct packedmatrix | struct packedrun[numruns] | uint16_t[nonzeros]  */
+struct packedmatrix {
+    float scale;
+    int32_t numruns;
+    int32_t nonzeros;
+};
+
+struct packedrun {
+    short int x;
+    short int y;              /* First cell of the run */
+    unsigned short length;
+};
+
+#define PACKED_RUNS(PM) ((struct packedrun *)((PM) + 1))
+#define PACKED_VALUES(PM) ((uint16_t *)(PACKED_RUNS(PM) + (PM)->numruns))
+#define PACKED_SIZE(RUNS,N) ((sizeof(struct packedmatrix) + (RUNS) * sizeof(struct packedrun) + (N) * sizeof(uint16_t) + 3) & ~(size_t)3)
+
 struct devtraindata {
     char **words;
     double lat;
@@ -181,38 +309,147 @@ struct devtraindata {
 
 /* The main information we have about a word/feature */
 struct wordinfo {
-    struct coordinate_list *coordinate_list; // List of coordinates where feature occurs
+    struct coordinate *coords;               // Coordinates where feature occurs
+    int numcoords;
+    int coordsize;                           // Allocated size of coords
     struct sparsematrix *sparsematrix;       // a kde matrix with mass in each cell
+    struct packedmatrix *packed;             // or the same in compact form (--quantize)
+    int loaded;                              // Whether the word's section has been read (lazy loading)
+    int loading;                             // Whether a thread is reading it (under the index lock)
     char *word;                              // the word/feature itself
     double weight;
     int count;
 };
 
 /* Training set word/coordinate list */
-struct wordinfo *wc_list; /* Each word index points to a struct with info: (1) coordinate_list (2) kde matrix (3) word */
+struct wordinfo *wc_list; /* Each word index points to a struct with info: (1) coordinates (2) kde matrix (3) word */
 unsigned int wc_list_size ;
 unsigned int wc_list_max = 0;
 
-/* A list of tweet/document's positions of origin is also stored in a plain linked list */
-/* This is used to later generate a matrix of densities                                 */
-struct coordinate_list *g_tweetcoords_head = NULL;
+/* The tweet/document's positions of origin are also stored in a plain array */
+/* This is used to later generate a matrix of densities                     */
 
 /* Word hashes for seen words and the stopword list */
 struct wordhash *global_wh_train, *global_wh_stopwords = NULL;
 
+/* Binary model format (--model-format=bin)                                  */
+/* The file is a header followed by 8-byte aligned sections, laid out so    */
+/* that it can be mmap'd and used in place without parsing:                 */
+/*   header | tweetsmatrix (double[cells]) | centroids (struct centroids[]) */
+/*   | wordmatrix (double[cells]) | word records | hash table (int32[])     */
+/*   | string pool | coordinates (struct coordinate[])                      */
+/*   | sparse matrices (struct sparsematrix[], each with -1 sentinel)       */
+/* Offsets are in bytes from the start of the file, in host byte order      */
+/* Version 2 headers have flags. Models with BINMODEL_PACKED (--quantize)  */
+/* keep struct packedmatrix blocks in the sparse section instead, and word  */
+/* sparse fields are byte offsets into it. Version 1 headers (struct        */
+/* binmodel_header_v1) have no flags and are converted when read            */
+/* Version 3 probes the hash table at wordhash_mix(hash), versions 1 and 2  */
+/* at the raw djb2 hash                                                     */
+
+#define BINMODEL_MAGIC     "GEOLOCBM"
+#define BINMODEL_VERSION   3
+#define BINMODEL_VERSION_2 2
+#define BINMODEL_VERSION_1 1
+#define BINMODEL_BYTEORDER 0x01020304
+#define BINMODEL_PACKED    1
+
+struct binmodel_header {
+    char magic[8];
+    int32_t byteorder;        /* BINMODEL_BYTEORDER as written on the training host */
+    int32_t version;
+    int32_t longranularity;
+    int32_t wordtypes;        /* Number of word records                             */
+    int32_t total_wordcount;  /* Number of word tokens (coordinates)                */
+    uint32_t hashsize;        /* Slots in the hash table, a power of two            */
+    int32_t flags;            /* BINMODEL_PACKED                                    */
+    int64_t tweetsmatrix;
+    int64_t centroids;
+    int64_t wordmatrix;
+    int64_t words;
+    int64_t hash;
+    int64_t strings;
+    int64_t coords;
+    int64_t sparse;
+    int64_t size;             /* Total file size                                    */
+};
+
+struct binmodel_header_v1 {
+    char magic[8];
+    int32_t byteorder;
+    int32_t version;
+    int32_t longranularity;
+    int32_t wordtypes;
+    int32_t total_wordcount;
+    uint32_t hashsize;
+    int64_t tweetsmatrix;
+    int64_t centroids;
+    int64_t wordmatrix;
+    int64_t words;
+    int64_t hash;
+    int64_t strings;
+    int64_t coords;
+    int64_t sparse;
+    int64_t size;
+};
+
+struct binmodel_word {
+    int64_t word;             /* Offset of word in string pool                      */
+    int64_t coords;           /* Index of first coordinate                          */
+    int64_t sparse;           /* Index of first sparse entry (byte offset of packed */
+                              /* matrix), -1 = no stored matrix                     */
+    double weight;
+    uint32_t hash;            /* wordhash_hashf() of word, checked before strcmp    */
+    int32_t coordcount;
+    int32_t count;
+    int32_t nonzeros;
+};
+
+/* A binary model mapped into memory, pointers go straight into the map */
+struct binmodel {
+    void *map;
+    size_t size;
+    struct binmodel_header *header;
+    struct binmodel_header header1; /* Converted header of a version 1 model      */
+    struct binmodel_word *words;
+    int32_t *hash;
+    char *strings;
+    struct coordinate *coords;
+    struct sparsematrix *sparse;
+};
+
+struct binmodel *g_binmodel = NULL; /* Set when classifying with a binary model instead of wc_list */
+
 double *sparsematrix_to_matrix(struct sparsematrix *sm);
 struct sparsematrix *matrix_to_sparsematrix(double *matrix);
 double bivariate_gaussian_pdf(double x1, double x2, double sigma1, double sigma2, double rho, double mu1, double mu2);
 double quick_pdf (double x, double y, double mu1, double mu2);
-void matrix_kde_from_coords(double * restrict matrix, struct coordinate_list *cl, double sigma1, double sigma2, double rho);
+void matrix_kde_from_coords(double * restrict matrix, struct coordinate *pts, int numpoints, double sigma1, double sigma2, double rho);
 double *matrix_init(double prior);
+void matrix_set(double *matrix, double value);
 double *matrix_copy(double *matrix1);
-void matrix_nokde_from_coords(double * restrict matrix, struct coordinate_list *cl);
-void matrix_kde_from_coords(double * restrict matrix, struct coordinate_list *cl, double sigma1, double sigma2, double rho);
+void matrix_add(double *matrix1, double *matrix2);
+void matrix_nokde_from_coords(double * restrict matrix, struct coordinate *pts, int numpoints);
 void matrix_normalize_log(double *matrix);
 double haversine_km(double lat1, double lon1, double lat2, double lon2);
 double *word_get_matrix(int wordindex);
+int geoloc_read_model_bin(char *modelfilename, double **tm, double **wm);
+int binmodel_is_binary(char *modelfilename);
+struct sparsematrix *word_get_sparsematrix(int wordindex, int *tofree);
+void word_release_sparsematrix(int wordindex, struct sparsematrix *sm, int tofree);
+struct modelindex;
+double *modelindex_read_words(struct modelindex *mi);
 void geoloc_write_model(char *modelfilename, double *tweetsmatrix, double *wordmatrix);
+void modelindex_rename(char *from, char *to);
+void print_topk(FILE *out, double *resultmatrix, int k);
+void stats_report(char *mode);
+struct docbatch;
+struct ensemble;
+struct classify_scratch;
+struct ensemble *g_ensemble = NULL; /* Set when classifying with several models (--ensemble) */
+void ensemble_score(struct ensemble *ens, int doc, struct classify_scratch *scratch);
+void ensemble_scored(struct ensemble *ens, int doc, int64_t ns, struct classify_scratch *scratch);
+void ensemble_classify(struct docbatch *batch);
 
 /* Add a sparsematrix to a word */
 void word_coord_add_sparsematrix(char *word, struct sparsematrix *sm) {
@@ -251,12 +488,33 @@ double word_coord_get_weight(char *word) {
     return(wc_list[wordindex].weight);
 }
 
+/* Appends a coordinate to a growable coordinate array */
+void coords_append(struct coordinate **coords, int *numcoords, int *coordsize, double lat, double lon) {
+    if (*numcoords == *coordsize) {
+	*coordsize = *coordsize == 0 ? 2 : *coordsize * 2;
+	*coords = realloc(*coords, sizeof(struct coordinate) * *coordsize);
+	if (*coords == NULL) {
+	    fprintf(stderr, "Out of memory.\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    (*coords)[*numcoords].lat = (float)lat;
+    (*coords)[*numcoords].lon = (float)lon;
+    (*numcoords)++;
+}
+
+/* Adds a coordinate to a word that is already in wc_list */
+void word_coord_append(int wordindex, double lat, double lon) {
+    wc_list[wordindex].count += 1;
+    coords_append(&wc_list[wordindex].coords, &wc_list[wordindex].numcoords, &wc_list[wordindex].coordsize, lat, lon);
+}
+
 /* Adds a word/feature and its coordinates to the collection of training data */
-void word_coord_add_word(char *word, double lat, double lon, int storeword) {
-    struct coordinate_list *cl;
-    int wordindex;
-    if ((wordindex = wordhash_find(global_wh_train, word)) == -1) {
-	wordindex = wordhash_insert(global_wh_train, word);
+/* Returns the word's index                                                   */
+int word_coord_add_word(char *word, double lat, double lon, int storeword) {
+    int wordindex, inserted;
+    wordindex = wordhash_find_or_insert(global_wh_train, word, &inserted);
+    if (inserted) {
 	wc_list_max = wordindex > wc_list_max ? wordindex : wc_list_max;
 	if (wordindex >= wc_list_size) {
 	    wc_list = realloc(wc_list, sizeof(struct wordinfo) * wc_list_size * 2);
@@ -269,922 +527,5027 @@ void word_coord_add_word(char *word, double lat, double lon, int storeword) {
 	    wc_list[wordindex].word = strdup(word);
 	}
     }
-    wc_list[wordindex].count += 1;
     if (lat != 0.0 || lon != 0.0) { /* We can also add entry without coordinates */
-	cl = malloc(sizeof(struct coordinate_list));
-	cl->next = wc_list[wordindex].coordinate_list;
-	wc_list[wordindex].coordinate_list = cl;
-	cl->lat = (float)lat;
-	cl->lon = (float)lon;
+	word_coord_append(wordindex, lat, lon);
+    } else {
+	wc_list[wordindex].count += 1;
     }
+    return(wordindex);
 }
 
-int tweet_classify_naivebayes(char **words, double *tweetsmatrix, double *wordmatrix, double *resultmatrix) {
-    char **w;
-    int maxindex, i, c, wordindex, wordcount;
-    double c_iw, p, p_max, c_min, *tempwordmatrix, *totalmatrix, feature_weight;
-    /* Shortcut to speed up classification: we don't consider cells that have the minimum prior */
-    /* This, unless we want to output the whole distribution  */
-    for (c = 0, c_min = 100000; c < g_longranularity * g_latgranularity; c++) {
-	if (tweetsmatrix[c] < c_min)
-	    c_min = tweetsmatrix[c];
+int binmodel_find(struct binmodel *bm, char *word);
+int binmodel_find_hashed(struct binmodel *bm, char *word, uint32_t hash);
+void modelindex_load_word(int wordindex);
+
+struct modelindex *g_modelindex = NULL; /* Set when words of a text model are read on demand */
+
+/* Word accessors used at classification time: word data lives either in */
+/* wc_list (text models) or in place in a mapped binary model             */
+/* Reads a word of an indexed text model the first time it is used */
+static inline void word_load(int wordindex) {
+    if (wordindex != -1 && g_modelindex != NULL && !__atomic_load_n(&wc_list[wordindex].loaded, __ATOMIC_ACQUIRE))
+	modelindex_load_word(wordindex);
+}
+
+int word_lookup(char *word) {
+    int wordindex;
+    if (g_binmodel != NULL)
+	return(binmodel_find(g_binmodel, word));
+    wordindex = wordhash_find(global_wh_train, word);
+    word_load(wordindex);
+    return(wordindex);
+}
+
+/* Same with wordhash_hashf(word) given, leaving the word to word_load() */
+int word_lookup_hashed(char *word, unsigned int hash) {
+    if (g_binmodel != NULL)
+	return(binmodel_find_hashed(g_binmodel, word, hash));
+    return(wordhash_find_hashed(global_wh_train, word, hash));
+}
+
+double word_get_weight(int wordindex) {
+    return(g_binmodel != NULL ? g_binmodel->words[wordindex].weight : wc_list[wordindex].weight);
+}
+
+int word_get_count(int wordindex) {
+    return(g_binmodel != NULL ? g_binmodel->words[wordindex].count : wc_list[wordindex].count);
+}
+
+/* Matrices of the held-out words re-estimated for the current --sweep sigma */
+struct sparsematrix **g_sweepmatrices = NULL;
+
+/* Returns the word's stored sparse matrix, or NULL if the model has none (--nomatrix) */
+/* or keeps it packed                                                                */
+struct sparsematrix *word_stored_sparsematrix(int wordindex) {
+    if (g_sweepmatrices != NULL && g_sweepmatrices[wordindex] != NULL)
+	return(g_sweepmatrices[wordindex]);
+    if (g_binmodel != NULL) {
+	if (g_binmodel->words[wordindex].sparse == -1 || (g_binmodel->header->flags & BINMODEL_PACKED))
+	    return(NULL);
+	return(g_binmodel->sparse + g_binmodel->words[wordindex].sparse);
     }
+    return(wc_list[wordindex].sparsematrix);
+}
 
-    // Naive Bayes:
-    // p(c_i) * mass(c_i, w_1)/mass(c_i)_w * ... * mass(c_i, w_n)/mass(c_i)_w
-    /* Create matrices for all words used in tweet */
-    totalmatrix = matrix_copy(tweetsmatrix);
-    for (c = 0; c < g_longranularity * g_latgranularity ; c++)
-	totalmatrix[c] = log(totalmatrix[c]); /* Need to get tweetmatrix in logspace */
-
-    for (w = words, i = 0; *w != NULL; w++) {
-	if ((wordindex = wordhash_find(global_wh_train, *w)) != -1) {
-	    tempwordmatrix = word_get_matrix(wordindex);
-	    feature_weight = word_coord_get_weight(*w);
-	    wordcount = word_coord_get_count(*w);
-	    i++;
-	} else if (g_unk) {
-	    /* Unknown word, zero matrix, prior gets added at calc. time below */
-	    tempwordmatrix = matrix_init(0.0);
-	    i++;
-	} else {
-	    continue;
-	}
-	if (feature_weight == 0)
-	    continue;
+/* Returns the word's packed matrix (--quantize), or NULL */
+struct packedmatrix *word_packed_matrix(int wordindex) {
+    if (g_binmodel != NULL) {
+	if (g_binmodel->words[wordindex].sparse == -1 || !(g_binmodel->header->flags & BINMODEL_PACKED))
+	    return(NULL);
+	return((struct packedmatrix *)((char *)g_binmodel->sparse + g_binmodel->words[wordindex].sparse));
+    }
+    return(wc_list[wordindex].packed);
+}
 
-	/* Find argmax c p(c_i) * mass(c_i|w_1)/mass(c_i)_w * ...* mass(c_i|w_n)/mass(c_i)_w */
-	for (c = 0; c < g_longranularity * g_latgranularity ; c++) {
-	    if (tweetsmatrix[c] == c_min && resultmatrix == NULL)
-		continue;
-	    if (!g_complement_nb) {
-		p = tempwordmatrix[c] + g_wordprior;
-		c_iw = log(wordmatrix[c] + g_wordprior * (g_wordtypes + 1.0 + (double)g_unk));  /* p(c)_w + prior (includes UNK) */
-		p = log(p) - c_iw;
-		totalmatrix[c] += p;
-	    } else {
-		p = wordcount - tempwordmatrix[c] + g_wordprior; /* Mass in other classes */
-		c_iw = log(g_total_wordcount - wordmatrix[c] + g_wordprior * (g_wordtypes + 1.0 + (double)g_unk));  /* p(c)_w + prior (includes UNK) */
-		p = log(p) - c_iw;
-		totalmatrix[c] -= p;
-	    }
+/* Adds the (kde or nokde) density of the word's stored coordinates to matrix */
+void word_matrix_from_coords(double *matrix, int wordindex) {
+    struct binmodel_word *bw;
+    if (g_binmodel != NULL) {
+	bw = g_binmodel->words + wordindex;
+	if (g_nokde) {
+	    matrix_nokde_from_coords(matrix, g_binmodel->coords + bw->coords, bw->coordcount);
+	} else {
+	    matrix_kde_from_coords(matrix, g_binmodel->coords + bw->coords, bw->coordcount, g_sigma, g_sigma, 0.0);
 	}
-	free(tempwordmatrix);
-    }
-    for (c = 0, p_max = -DBL_MAX, maxindex = 0; c < g_longranularity * g_latgranularity ; c++) {
-	if (tweetsmatrix[c] == c_min && resultmatrix == NULL)
-	    continue;
-	if (totalmatrix[c] > p_max) {
-	    p_max = totalmatrix[c];
-	    maxindex = c;
+    } else {
+	if (g_nokde) {
+	    matrix_nokde_from_coords(matrix, wc_list[wordindex].coords, wc_list[wordindex].numcoords);
+	} else {
+	    matrix_kde_from_coords(matrix, wc_list[wordindex].coords, wc_list[wordindex].numcoords, g_sigma, g_sigma, 0.0);
 	}
     }
-    if (resultmatrix != NULL) { /* Copy totalmatrix to resultmatrix */
-	for (c = 0; c < g_longranularity * g_latgranularity ; c++)
-	    resultmatrix[c] = totalmatrix[c];
-    }
-    free(totalmatrix);
-    return(maxindex);
-} 
+}
 
-int tweet_classify_kullbackleibler(char **words, double *tweetsmatrix, double *wordmatrix, double *resultmatrix) {
-    char **w, **uniqwords;
-    int minindex, i, c, knownwords, wordindex, *seencounts, *wordindices;
-    double c_iw, p, p_min, c_min, *totalmatrix, *tempwordmatrix;
-    struct wordhash *seenwordhash;
-    // KL divergence:
-    // sum w \in t p(w|t) * log( p(w|t)/p(w_i|c_i) )
-    seenwordhash = wordhash_init(128);
-    for (w = words, i = 0; *w != NULL; w++, i++) { } /* Count num features */
-    uniqwords = malloc(sizeof(char *) * i);
-    wordindices = malloc(sizeof(int) * i);
-    for (w = words, i = 0; *w != NULL; w++) {
-	if ((wordindex = wordhash_find(global_wh_train, *w)) != -1) {
-	    if (wordhash_find(seenwordhash, *w) == -1) {
-		uniqwords[i] = *w;
-		wordindices[i] = wordindex;
-		i++;
-	    }
-	    wordhash_inc_value(seenwordhash, *w);
+/* Float32 scoring (--float32)                                               */
+/* The word matrices are stored as float, so with --float32 the classifiers */
+/* score in single precision: half the memory traffic per cell, and twice   */
+/* the cells per vector. The per-cell terms are kept as float arrays in two */
+/* layouts, the live cells (to find the best cell) and the whole grid (when */
+/* it is output), padded to a multiple of F32_WIDTH with cells that never   */
+/* win. The kernels, log() of the sparse values and the fused add+argmax of */
+/* the baseline, use AVX2 (if the CPU has it) or NEON, and scalar code      */
+/* otherwise. All of them do the same float operations in the same order, */
+/* so the estimates don't depend on the CPU. --float32=scalar forces the    */
+/* scalar kernels.                                                          */
+
+#define F32_WIDTH 8           /* Padding of the float layouts: one AVX2 vector */
+
+#define SIMD_SCALAR 0
+#define SIMD_AVX2   1
+#define SIMD_NEON   2
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define F32_AVX2 1
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define F32_NEON 1
+#include <arm_neon.h>
+#endif
+
+int g_simd = SIMD_SCALAR;     /* Kernels --float32 uses */
+
+struct f32cells {
+    int n;                    /* Positions, cells padded to a multiple of F32_WIDTH     */
+    int *cells;               /* Cell at each position (0 in the padding)               */
+    int *index;               /* Position of each cell, -1 if it isn't in this layout   */
+    float *logtweets;         /* log p(c), -inf in the padding                          */
+    float *nb_baseline;       /* As in the cellcache, 0 in the padding                  */
+    float *kl_baseline;       /* log(p(c)_w + prior) - log(prior), 0 in the padding     */
+    float *empty;             /* 0, -inf in the padding: initial Kullback-Leibler scores */
+};
+
+/* log(x) as in Cephes' logf: exponent and mantissa in [sqrt(1/2), sqrt(2)), */
+/* then a polynomial; no fused multiply-adds, like the vector versions, and  */
+/* integer selects so that the compiler can vectorize loops of it            */
+static inline float f32_log(float x) {
+    union { float f; int32_t i; } b, lt;
+    float m, y, z, e;
+    b.f = x;
+    b.i = b.i < 0x00800000 ? 0x00800000 : b.i;                  /* x >= FLT_MIN */
+    e = (float)(((b.i >> 23) & 0xff) - 126);
+    lt.i = -((b.i & 0x007fffff) < 0x003504f3) & 0x3f800000;     /* 1 if the mantissa < sqrt(1/2), else 0 */
+    b.i = (b.i & 0x007fffff) | 0x3f000000;
+    m = b.f;
+    e = e - lt.f;
+    m = m + m * lt.f - 1.0f;
+    z = m * m;
+    y = 7.0376836292e-2f;
+    y = y * m + -1.1514610310e-1f;
+    y = y * m + 1.1676998740e-1f;
+    y = y * m + -1.2420140846e-1f;
+    y = y * m + 1.4249322787e-1f;
+    y = y * m + -1.6668057665e-1f;
+    y = y * m + 2.0000714765e-1f;
+    y = y * m + -2.4999993993e-1f;
+    y = y * m + 3.3333331174e-1f;
+    y = y * m * z;
+    y = y + -2.12194440e-4f * e;
+    y = y - 0.5f * z;
+    m = m + y;
+    return(m + 0.693359375f * e);
+}
+
+/* total[k] += a * base[k] for n positions; returns the first k of the maximum */
+static inline int f32_axpy_argmax_scalar(float * restrict total, const float * restrict base, float a, int n) {
+    int k, best;
+    float p, pmax;
+    for (k = 0, best = 0, pmax = -INFINITY; k < n; k++) {
+	p = total[k] = total[k] + a * base[k];
+	if (p > pmax) {
+	    pmax = p;
+	    best = k;
 	}
     }
-    knownwords = i;
-    seencounts = malloc(sizeof(int) * knownwords);
-    for (i = 0; i < knownwords; i++) {
-	seencounts[i] = wordhash_find(seenwordhash, uniqwords[i]);
+    return(best);
+}
+
+/* Lane maxima to the first position of the overall maximum */
+static inline int f32_argmax_lanes(const float *best, const int *bestindex, int lanes) {
+    int i, k;
+    for (i = 1, k = 0; i < lanes; i++) {
+	if (best[i] > best[k] || (best[i] == best[k] && bestindex[i] < bestindex[k]))
+	    k = i;
     }
-    /* Shortcut to speed up classification: we don't consider cells that have the minimum prior */    
-    /* This, unless we want to output the whole distribution  */
-    for (c = 0, c_min = DBL_MAX; c < g_longranularity * g_latgranularity; c++) {
-	if (tweetsmatrix[c] < c_min)
-	    c_min = tweetsmatrix[c];
+    return(bestindex[k]);
+}
+
+#ifdef F32_AVX2
+__attribute__((target("avx2")))
+static void f32_logs_avx2(const float *v, float *out, int n, float prior) {
+    int i;
+    __m256 x, e, m, y, z, mask;
+    __m256i bits;
+    const __m256 vprior = _mm256_set1_ps(prior), fmin = _mm256_set1_ps(FLT_MIN), one = _mm256_set1_ps(1.0f);
+    for (i = 0; i + 8 <= n; i += 8) {
+	x = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(v + i), vprior), fmin);
+	bits = _mm256_castps_si256(x);
+	e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(0xff)), _mm256_set1_epi32(126)));
+	m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+	mask = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+	e = _mm256_sub_ps(e, _mm256_and_ps(mask, one));
+	m = _mm256_sub_ps(_mm256_add_ps(m, _mm256_and_ps(mask, m)), one);
+	z = _mm256_mul_ps(m, m);
+	y = _mm256_set1_ps(7.0376836292e-2f);
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.1514610310e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.1676998740e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.2420140846e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.4249322787e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.6668057665e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(2.0000714765e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-2.4999993993e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(3.3333331174e-1f));
+	y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+	y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(-2.12194440e-4f), e));
+	y = _mm256_sub_ps(y, _mm256_mul_ps(_mm256_set1_ps(0.5f), z));
+	m = _mm256_add_ps(m, y);
+	_mm256_storeu_ps(out + i, _mm256_add_ps(m, _mm256_mul_ps(_mm256_set1_ps(0.693359375f), e)));
     }
-    /* p(w|t) ~ 1/knownwords */
+    for (; i < n; i++)
+	out[i] = f32_log(v[i] + prior);
+}
 
-    totalmatrix = matrix_init(0.0);
-    for (i = 0; i < knownwords; i++) {
-	tempwordmatrix = word_get_matrix(wordindices[i]);
-	for (c = 0; c < g_longranularity * g_latgranularity ; c++) {
-	    if (tweetsmatrix[c] == c_min && resultmatrix == NULL)
-		continue;
-	    c_iw = wordmatrix[c] + g_wordprior * (g_wordtypes + 1.0 + (double)g_unk);
-	    p = seencounts[i] * log((c_iw * seencounts[i])/ (knownwords * (tempwordmatrix[c] + g_wordprior)))/knownwords;
-	    totalmatrix[c] += p;
-	}
-	free(tempwordmatrix);
+/* n is a multiple of 8 */
+__attribute__((target("avx2"), always_inline))
+static inline int f32_axpy_argmax_avx2_n(float * restrict total, const float * restrict base, float a, int n) {
+    int k, lanes[8];
+    float best[8];
+    __m256 va, t, gt, vbest;
+    __m256i index, vbestindex;
+    va = _mm256_set1_ps(a);
+    vbest = _mm256_set1_ps(-INFINITY);
+    vbestindex = _mm256_setzero_si256();
+    index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (k = 0; k < n; k += 8) {
+	t = _mm256_add_ps(_mm256_loadu_ps(total + k), _mm256_mul_ps(va, _mm256_loadu_ps(base + k)));
+	_mm256_storeu_ps(total + k, t);
+	gt = _mm256_cmp_ps(t, vbest, _CMP_GT_OQ);
+	vbest = _mm256_blendv_ps(vbest, t, gt);
+	vbestindex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(vbestindex), _mm256_castsi256_ps(index), gt));
+	index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
     }
-    for (c = 0, minindex = 0, p_min = DBL_MAX; c < g_longranularity * g_latgranularity ; c++) {
-	if (tweetsmatrix[c] == c_min && resultmatrix == NULL)
-	    continue;
-	if (totalmatrix[c] < p_min) {
-	    minindex = c;
-	    p_min = totalmatrix[c];
-	}
+    _mm256_storeu_ps(best, vbest);
+    _mm256_storeu_si256((__m256i *)lanes, vbestindex);
+    return(f32_argmax_lanes(best, lanes, 8));
+}
+#endif
+
+#ifdef F32_NEON
+static void f32_logs_neon(const float *v, float *out, int n, float prior) {
+    int i;
+    float32x4_t x, e, m, y, z, one;
+    uint32x4_t bits, mask;
+    one = vdupq_n_f32(1.0f);
+    for (i = 0; i + 4 <= n; i += 4) {
+	x = vmaxq_f32(vaddq_f32(vld1q_f32(v + i), vdupq_n_f32(prior)), vdupq_n_f32(FLT_MIN));
+	bits = vreinterpretq_u32_f32(x);
+	e = vcvtq_f32_s32(vsubq_s32(vreinterpretq_s32_u32(vandq_u32(vshrq_n_u32(bits, 23), vdupq_n_u32(0xff))), vdupq_n_s32(126)));
+	m = vreinterpretq_f32_u32(vorrq_u32(vandq_u32(bits, vdupq_n_u32(0x007fffff)), vdupq_n_u32(0x3f000000)));
+	mask = vcltq_f32(m, vdupq_n_f32(0.707106781186547524f));
+	e = vsubq_f32(e, vreinterpretq_f32_u32(vandq_u32(mask, vreinterpretq_u32_f32(one))));
+	m = vsubq_f32(vaddq_f32(m, vreinterpretq_f32_u32(vandq_u32(mask, vreinterpretq_u32_f32(m)))), one);
+	z = vmulq_f32(m, m);
+	y = vdupq_n_f32(7.0376836292e-2f);
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(-1.1514610310e-1f));
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(1.1676998740e-1f));
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(-1.2420140846e-1f));
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(1.4249322787e-1f));
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(-1.6668057665e-1f));
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(2.0000714765e-1f));
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(-2.4999993993e-1f));
+	y = vaddq_f32(vmulq_f32(y, m), vdupq_n_f32(3.3333331174e-1f));
+	y = vmulq_f32(vmulq_f32(y, m), z);
+	y = vaddq_f32(y, vmulq_f32(vdupq_n_f32(-2.12194440e-4f), e));
+	y = vsubq_f32(y, vmulq_f32(vdupq_n_f32(0.5f), z));
+	m = vaddq_f32(m, y);
+	vst1q_f32(out + i, vaddq_f32(m, vmulq_f32(vdupq_n_f32(0.693359375f), e)));
     }
-    if (resultmatrix != NULL)
-	for (c = 0; c < g_longranularity * g_latgranularity ; c++)
-	    resultmatrix[c] = -totalmatrix[c];
+    for (; i < n; i++)
+	out[i] = f32_log(v[i] + prior);
+}
 
-    wordhash_free(seenwordhash);
-    free(seencounts);
-    free(uniqwords);
-    free(wordindices);
-    return(minindex);
+/* n is a multiple of 4 */
+static inline int f32_axpy_argmax_neon_n(float * restrict total, const float * restrict base, float a, int n) {
+    static const uint32_t first[4] = { 0, 1, 2, 3 };
+    int k, lanes[4];
+    float best[4];
+    float32x4_t va, t, vbest;
+    uint32x4_t gt, index, vbestindex;
+    va = vdupq_n_f32(a);
+    vbest = vdupq_n_f32(-INFINITY);
+    vbestindex = vdupq_n_u32(0);
+    index = vld1q_u32(first);
+    for (k = 0; k < n; k += 4) {
+	t = vaddq_f32(vld1q_f32(total + k), vmulq_f32(va, vld1q_f32(base + k)));
+	vst1q_f32(total + k, t);
+	gt = vcgtq_f32(t, vbest);
+	vbest = vbslq_f32(gt, t, vbest);
+	vbestindex = vbslq_u32(gt, index, vbestindex);
+	index = vaddq_u32(index, vdupq_n_u32(4));
+    }
+    vst1q_f32(best, vbest);
+    vst1q_u32((uint32_t *)lanes, vbestindex);
+    return(f32_argmax_lanes(best, lanes, 4));
 }
+#endif
 
-int compare_double(const void *a, const void *b) {
-       const double *da = (const double *) a;
-       const double *db = (const double *) b;     
-       return (*da > *db) - (*da < *db);
+void simd_init() {
+#ifdef F32_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	g_simd = SIMD_AVX2;
+#endif
+#ifdef F32_NEON
+    g_simd = SIMD_NEON;
+#endif
 }
 
-/* Read stopwords and put each word into hash */
-void read_stopwords(char *filename) {
-    FILE *input_file;
-    char line[16384];
-    fprintf(stderr, "Reading stopwords from '%s'...\n", filename);
-    input_file = fopen(filename, "r");
-    if (input_file == NULL) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+/* out[i] = log(v[i] + prior) */
+void f32_logs(const float * restrict v, float * restrict out, int n, float prior) {
+    int i;
+#ifdef F32_AVX2
+    if (g_simd == SIMD_AVX2) {
+	f32_logs_avx2(v, out, n, prior);
+	return;
     }
-    global_wh_stopwords = wordhash_init(128);
-    while (fgets(line, 16384, input_file)) {
-	strtok(line, "\n");
-	if (strlen(line) > 0) {
-	    wordhash_insert(global_wh_stopwords, line);
-	}
+#endif
+#ifdef F32_NEON
+    if (g_simd == SIMD_NEON) {
+	f32_logs_neon(v, out, n, prior);
+	return;
     }
-    fclose(input_file);
+#endif
+    for (i = 0; i < n; i++)
+	out[i] = f32_log(v[i] + prior);
 }
 
-struct wordhash *geoloc_index_words(char *filename) {
-    FILE *input_file;
-    char *next_field, line[MAX_LINE_SIZE+1];
-    struct wordhash *iwh;
-    input_file = fopen(filename, "r");
-    if (input_file == NULL) {
-        perror(filename);
-        exit(EXIT_FAILURE);
-    }
-    iwh = wordhash_init(128);
-    for (;;) {
-        fgets(line, MAX_LINE_SIZE, input_file);
-        if (feof(input_file))
-            break;
-        next_field = strtok(line, ",\n ");
-        while (next_field != NULL) {
-	    if (wordhash_find(iwh, next_field) == -1) {
-		wordhash_insert(iwh, next_field);
-		//fprintf(stderr, "%s\n", next_field);
-	    }
-	    next_field = strtok(NULL, ",\n ");
-        }
+/* The whole grids of the common granularities (72, 180, 360, 720) get */
+/* loops with constant bounds                                          */
+#define F32_GRIDS(KERNEL)						\
+    switch (n) {							\
+    case 2592:   return(KERNEL(total, base, a, 2592));			\
+    case 16200:  return(KERNEL(total, base, a, 16200));		\
+    case 64800:  return(KERNEL(total, base, a, 64800));		\
+    case 259200: return(KERNEL(total, base, a, 259200));		\
+    default:     return(KERNEL(total, base, a, n));			\
     }
-    fclose(input_file);
-    return(iwh);
+
+#ifdef F32_AVX2
+__attribute__((target("avx2")))
+static int f32_axpy_argmax_avx2(float * restrict total, const float * restrict base, float a, int n) {
+    F32_GRIDS(f32_axpy_argmax_avx2_n);
 }
+#endif
 
-struct devtraindata *geoloc_read_data(char *filename) {
-    FILE *input_file;
-    char *next_field, line[MAX_LINE_SIZE+1];
-    int linecount, i, j, indmax, line_number, field_number;
-    struct devtraindata *data_head, *data;
+#ifdef F32_NEON
+static int f32_axpy_argmax_neon(float * restrict total, const float * restrict base, float a, int n) {
+    F32_GRIDS(f32_axpy_argmax_neon_n);
+}
+#endif
 
-    input_file = fopen(filename, "r");
-    if (input_file == NULL) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+static int f32_axpy_argmax_grids(float * restrict total, const float * restrict base, float a, int n) {
+    F32_GRIDS(f32_axpy_argmax_scalar);
+}
+
+/* total[k] += a * base[k] over a layout (n a multiple of F32_WIDTH); */
+/* returns the first position of the maximum                          */
+int f32_axpy_argmax(float * restrict total, const float * restrict base, float a, int n) {
+#ifdef F32_AVX2
+    if (g_simd == SIMD_AVX2)
+	return(f32_axpy_argmax_avx2(total, base, a, n));
+#endif
+#ifdef F32_NEON
+    if (g_simd == SIMD_NEON)
+	return(f32_axpy_argmax_neon(total, base, a, n));
+#endif
+    return(f32_axpy_argmax_grids(total, base, a, n));
+}
+
+/* Per-cell normalizers that depend only on the model and on --prior/--unk. */
+/* They are computed once after the model is read, kept for the whole run,  */
+/* and only recomputed by cellcache_update() when the prior or unk changes  */
+struct cellcache {
+    double *logtweets;    /* log p(c)                                                  */
+    double *nb_baseline;  /* log(prior) - log(p(c)_w + prior): NB term of a zero cell   */
+    double *cnb_baseline; /* log(p(~c)_w + prior): complement NB normalizer            */
+    double *kl_log_c_iw;  /* log(p(c)_w + prior): KL normalizer                        */
+    double c_min;         /* Minimum of p(c), cells with this value are skipped        */
+    int *livecells;       /* Indices of the cells whose p(c) is above c_min           */
+    int numlive;
+    int *liveindex;       /* Position of a cell in livecells, -1 if it isn't live     */
+    int *allcells;        /* 0..cells-1, scanned instead when the whole grid is output */
+    double logprior;      /* log(prior)                                                */
+    struct f32cells f32live; /* Float copies of the above over the live cells (--float32) */
+    struct f32cells f32all;  /* and over the whole grid                                  */
+    double wordprior;     /* The --prior the cache was computed for                    */
+    int unk;              /* The --unk the cache was computed for                      */
+    int valid;
+};
+
+struct cellcache g_cellcache;
+
+/* Coarse-to-fine search (--coarse-to-fine=K): the model grid is summed    */
+/* into a pyramid of coarser grids, halving the granularity per level.     */
+/* Naive Bayes then scores every cell only at the coarsest level and keeps */
+/* the K best, and at each finer level scores just the four children of    */
+/* the kept cells, so the cost is close to that of the coarsest grid.      */
+#define PYRAMID_MAXLEVELS 8
+#define PYRAMID_MINGRANULARITY 72  /* Don't go coarser than 5 degree cells */
+
+struct pyramid_word {
+    struct sparsematrix *sm;  /* Word matrix summed to this level, NULL until first used */
+    int n;                    /* Number of nonzero entries (-1 = not known yet)          */
+};
+
+struct pyramid_level {
+    int longranularity;
+    int latgranularity;
+    double *logtweets;        /* log p(C), summed over the cells below      */
+    double *nb_baseline;      /* As in the cell cache, with a scaled prior  */
+    char *live;               /* Whether some cell below is above c_min     */
+    double wordprior;         /* --prior times the number of cells below    */
+    double logprior;
+    struct pyramid_word *words;
+};
+
+/* Levels 0..numlevels-1 are coarse levels (0 coarsest); level numlevels is */
+/* the model itself, for which only the word entry counts are kept here     */
+struct pyramid {
+    int numlevels;
+    int numwords;
+    struct pyramid_level levels[PYRAMID_MAXLEVELS + 1];
+    pthread_mutex_t lock;     /* Guards words[] filled in lazily by classifier threads */
+    int valid;
+};
+
+struct pyramid g_pyramid;
+
+int compare_sparse_xy(const void *a, const void *b) {
+    const struct sparsematrix *sa = (const struct sparsematrix *) a;
+    const struct sparsematrix *sb = (const struct sparsematrix *) b;
+    if (sa->x != sb->x)
+	return(sa->x - sb->x);
+    return(sa->y - sb->y);
+}
+
+/* Sum a sparse matrix into cells 2^shift times larger (output sorted like the input) */
+struct sparsematrix *sparsematrix_coarsen(struct sparsematrix *sm, int n, int shift, int *outn) {
+    struct sparsematrix *out;
+    int j, k;
+    out = malloc(sizeof(struct sparsematrix) * (n + 1));
+    for (j = 0; j < n; j++) {
+	out[j].x = sm[j].x >> shift;
+	out[j].y = sm[j].y >> shift;
+	out[j].value = sm[j].value;
     }
-    for (linecount = 0; fgets(line, MAX_LINE_SIZE, input_file); linecount++) {  }
-    rewind(input_file);
-    data_head = malloc(sizeof(struct devtraindata));
-    data_head->next = NULL;
-    data = data_head;
-    for (line_number = 1, j = 0;  ;line_number++) {
-	i = 0;
-	if (line_number > 1) {
-	    data->next = malloc(sizeof(struct devtraindata));
-	    data = data->next;
-	    data->next = NULL;
-	}
-        fgets(line, MAX_LINE_SIZE, input_file);
-        if (feof(input_file))
-            break;
-	field_number = 1;
-        next_field = strtok(line, ",\n ");
-	data->words = malloc(32 * sizeof(char *));
-	indmax = 32;
-        while (next_field != NULL) {
-	    switch (field_number) {
-	    case 1:
-		data->lat = strtod(next_field, NULL);
-		break;
-	    case 2:
-		data->lon = strtod(next_field, NULL);
-		break;
-	    default:
-		if (i >= indmax-2) {
-		    data->words = realloc(data->words, sizeof(char *) * 2 * indmax);
-		    indmax *= 2;
-		}
-		data->words[i] = strdup(next_field);
-		i++;
-	    }
-	    data->words[i] = NULL;
-            next_field = strtok(NULL, ",\n ");
-	    field_number++;
-        }
+    qsort(out, n, sizeof(struct sparsematrix), compare_sparse_xy);
+    for (j = 0, k = 0; j < n; j++) {
+	if (k > 0 && out[k-1].x == out[j].x && out[k-1].y == out[j].y)
+	    out[k-1].value += out[j].value;
+	else
+	    out[k++] = out[j];
     }
-    fclose(input_file);
-    return(data_head);
+    out[k].x = -1; out[k].y = -1; out[k].value = -1.0;
+    *outn = k;
+    return(realloc(out, sizeof(struct sparsematrix) * (k + 1)));
 }
 
-#define WORDSARRAYSIZE 16
-void test_classify(char *filename, double *tweetsmatrix, double *wordmatrix) {
-    FILE *input_file;
-    char *next_field, line[MAX_LINE_SIZE+1], **words;
-    int line_number, field_number, i, x, y, tweet_cell, linecount, wordsarraysize = WORDSARRAYSIZE;
-    double lat_estimate, lon_estimate, *resultmatrix;
-    words = malloc(sizeof(char *) * wordsarraysize);
-    if (g_print_matrix) {
-	resultmatrix = calloc(g_longranularity * g_latgranularity, sizeof(double));
-    } else {
-	resultmatrix = NULL;
-    }
-    input_file = fopen(filename, "r");
-    if (input_file == NULL) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+/* Value of cell (x,y) in an (x,y)-sorted sparse matrix of n entries, 0 if absent */
+double sparsematrix_lookup(struct sparsematrix *sm, int n, int x, int y) {
+    int lo, hi, mid;
+    for (lo = 0, hi = n; lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (sm[mid].x < x || (sm[mid].x == x && sm[mid].y < y))
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
-    for (linecount = 0; fgets(line, MAX_LINE_SIZE, input_file); linecount++) {  }
-    rewind(input_file);
-    for (line_number = 1;  ;line_number++) {
-	i = 0;
-        fgets(line, MAX_LINE_SIZE, input_file);
-        if (feof(input_file))
-            break;
-	field_number = 1;
-        next_field = strtok(line, ",\n ");
-        while (next_field != NULL) {
-	    if (i == wordsarraysize) {
-		words = realloc(words, sizeof(char *) * wordsarraysize * 2);
-		wordsarraysize *= 2;
+    if (lo < n && sm[lo].x == x && sm[lo].y == y)
+	return(sm[lo].value);
+    return(0.0);
+}
+
+void pyramid_update(double *tweetsmatrix, double *wordmatrix) {
+    struct pyramid_level *lv, *fine;
+    double *tweets[PYRAMID_MAXLEVELS + 1], *mass[PYRAMID_MAXLEVELS + 1], normalizer;
+    int l, g, x, y, c, fc, cells;
+
+    if (!g_pyramid.valid) {
+	for (g = g_longranularity, l = 0; g % 4 == 0 && g / 2 >= PYRAMID_MINGRANULARITY && l < PYRAMID_MAXLEVELS; g /= 2, l++) { }
+	g_pyramid.numlevels = l;
+	g_pyramid.numwords = g_binmodel != NULL ? (int)g_binmodel->header->wordtypes : (int)wc_list_max + 1;
+	for (l = 0; l <= g_pyramid.numlevels; l++) {
+	    lv = g_pyramid.levels + l;
+	    lv->longranularity = g_longranularity >> (g_pyramid.numlevels - l);
+	    lv->latgranularity = lv->longranularity / 2;
+	    cells = lv->longranularity * lv->latgranularity;
+	    lv->logtweets = l < g_pyramid.numlevels ? malloc(sizeof(double) * cells) : g_cellcache.logtweets;
+	    lv->nb_baseline = l < g_pyramid.numlevels ? malloc(sizeof(double) * cells) : g_cellcache.nb_baseline;
+	    lv->live = malloc(cells);
+	    lv->words = malloc(sizeof(struct pyramid_word) * (g_pyramid.numwords + 1));
+	    for (c = 0; c <= g_pyramid.numwords; c++) {
+		lv->words[c].sm = NULL;
+		lv->words[c].n = -1;
 	    }
-	    words[i] = next_field;
-	    i++;
-            next_field = strtok(NULL, ",\n ");
-	    field_number++;
-        }
-	words[i] = NULL;
-	tweet_cell = g_kullback_leibler ? tweet_classify_kullbackleibler(words, tweetsmatrix, wordmatrix, resultmatrix) : tweet_classify_naivebayes(words, tweetsmatrix, wordmatrix, resultmatrix);
-	if (g_use_centroid) {
-	    lat_estimate = g_centroids[tweet_cell].lat;
-	    lon_estimate = g_centroids[tweet_cell].lon;
-	} else {
-	    lat_estimate = YTOMIDLAT(CELLTOY(tweet_cell));
-	    lon_estimate = XTOMIDLON(CELLTOX(tweet_cell));
-	}
-	if (g_print_matrix) {
-	    //fprintf(stderr, "%lg,%lg\n", lat_estimate, lon_estimate);
-	    matrix_normalize_log(resultmatrix);
-	    for (y = 0; y < g_latgranularity; y++) {
-		for (x = 0; x < g_longranularity; x++) {
-		    //printf("%lg\t%lg\t%lg\n", YTOMIDLAT(y), XTOMIDLON(x), resultmatrix[x+y*g_longranularity]);
-		    printf("%lg", resultmatrix[x+y*g_longranularity]);
-		    if (x + 1 < g_longranularity)
-			printf("\t");
-		}
-		printf("\n");
+	}
+	pthread_mutex_init(&g_pyramid.lock, NULL);
+	g_pyramid.valid = 1;
+	fprintf(stderr, "Coarse-to-fine search over %i levels, from %i/%i granularity\n", g_pyramid.numlevels, g_pyramid.levels[0].longranularity, g_pyramid.levels[0].latgranularity);
+    }
+    /* Sum p(c) and the wordmatrix upwards from the model grid */
+    fine = g_pyramid.levels + g_pyramid.numlevels;
+    tweets[g_pyramid.numlevels] = tweetsmatrix;
+    mass[g_pyramid.numlevels] = wordmatrix;
+    fine->wordprior = g_wordprior;
+    fine->logprior = g_cellcache.logprior;
+    for (c = 0; c < g_longranularity * g_latgranularity; c++)
+	fine->live[c] = tweetsmatrix[c] != g_cellcache.c_min;
+    for (l = g_pyramid.numlevels - 1; l >= 0; l--) {
+	lv = g_pyramid.levels + l;
+	fine = g_pyramid.levels + l + 1;
+	cells = lv->longranularity * lv->latgranularity;
+	tweets[l] = calloc(cells, sizeof(double));
+	mass[l] = calloc(cells, sizeof(double));
+	memset(lv->live, 0, cells);
+	for (y = 0; y < fine->latgranularity; y++) {
+	    for (x = 0; x < fine->longranularity; x++) {
+		fc = x + y * fine->longranularity;
+		c = x / 2 + (y / 2) * lv->longranularity;
+		tweets[l][c] += tweets[l+1][fc];
+		mass[l][c] += mass[l+1][fc];
+		lv->live[c] |= fine->live[fc];
 	    }
-	    //printf("\n");
-	} else {
-	    printf("%lg,%lg\n", lat_estimate, lon_estimate);
+	}
+	lv->wordprior = g_wordprior * (double)(1 << (2 * (g_pyramid.numlevels - l)));
+	lv->logprior = log(lv->wordprior);
+	normalizer = lv->wordprior * (g_wordtypes + 1.0 + (double)g_unk);
+	for (c = 0; c < cells; c++) {
+	    lv->logtweets[c] = log(tweets[l][c]);
+	    lv->nb_baseline[c] = lv->logprior - log(mass[l][c] + normalizer);
 	}
     }
-    free(words);
-    fclose(input_file);
+    for (l = 0; l < g_pyramid.numlevels; l++) {
+	free(tweets[l]);
+	free(mass[l]);
+    }
 }
 
-void geoloc_tune(double *tweetsmatrix, double *wordmatrix, struct devtraindata *dev_data, struct devtraindata *train_data) {
-    int i, guess_cell, correct_cell, wordindex;
-    double lat_estimate, lon_estimate, error_distance, *tempwordmatrix, correct_cell_weight, guessed_cell_weight, adjust, old_weight, new_weight;
-    struct devtraindata *data;
-
-    /* Go through dev data */
-    for (data = dev_data; data != NULL; data = data->next) {
-	/* Classify tweet with naive bayes */
-	guess_cell = tweet_classify_naivebayes(data->words, tweetsmatrix, wordmatrix, NULL);
-	correct_cell = LATLONTOCELL(data->lat, data->lon);
-	lat_estimate = YTOMIDLAT(CELLTOY(guess_cell));
-	lon_estimate = XTOMIDLON(CELLTOX(guess_cell));
-	error_distance = haversine_km(data->lat, data->lon, lat_estimate, lon_estimate);
-	fprintf(stderr, "GUESSED CELL: %i CORRECT CELL: %i ERROR: %lf\n", guess_cell, correct_cell, error_distance);
-	/* Go through each feature if guess is incorrect: */
-	if (guess_cell != correct_cell) {
-	    for (i = 0; data->words[i] != NULL; i++) {
-		/* If word is stored in model, do something, else just skip */
-		if ((wordindex = wordhash_find(global_wh_train, data->words[i])) != -1) {
-		    tempwordmatrix = word_get_matrix(wordindex);
-		    correct_cell_weight = tempwordmatrix[correct_cell];
-		    guessed_cell_weight = tempwordmatrix[guess_cell];
-		    /* Do something with weight */
-		    old_weight = word_coord_get_weight(data->words[i]);
-		    adjust = 0.0;
-		    if (correct_cell_weight > guessed_cell_weight) {
-			adjust = 0.01;
-		    } else { 
-			adjust = -0.01;
-		    }
-		    new_weight = old_weight + adjust;
-		    word_coord_set_weight(data->words[i], new_weight);
-		    free(tempwordmatrix);
-		}
-	    }
+/* Number of entries in a word's model matrix, counted once for stored matrices */
+int pyramid_word_nonzeros(int wordindex, struct sparsematrix *sm, int tofree) {
+    struct pyramid_word *pw;
+    int n;
+    pw = g_pyramid.levels[g_pyramid.numlevels].words + wordindex;
+    pthread_mutex_lock(&g_pyramid.lock);
+    n = pw->n;
+    pthread_mutex_unlock(&g_pyramid.lock);
+    if (n == -1) {
+	for (n = 0; sm[n].x != -1; n++) { }
+	if (!tofree) { /* Matrices computed on the fly (--nomatrix) can't be cached */
+	    pthread_mutex_lock(&g_pyramid.lock);
+	    pw->n = n;
+	    pthread_mutex_unlock(&g_pyramid.lock);
 	}
     }
-    /* And when we're done: write model to some filename */
-    geoloc_write_model("testmodel.gz", tweetsmatrix, wordmatrix);
+    return(n);
 }
 
-
-#define WORDSARRAYSIZE 16
-void test_evaluate(char *filename, double *tweetsmatrix, double *wordmatrix) {
-    FILE *input_file;
-    char *next_field, line[MAX_LINE_SIZE+1], **words;
-    int line_number, field_number, i, j, tweet_cell, linecount, wordsarraysize = WORDSARRAYSIZE;
-    double lat, lon, lat_estimate, lon_estimate, distance, totaldistance = 0.0, *results, median;
-    words = malloc(sizeof(char *) * wordsarraysize);
-    input_file = fopen(filename, "r");
-    if (input_file == NULL) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+/* A word's matrix summed to a coarse level, built from its model matrix on first use */
+struct pyramid_word *pyramid_word(int level, int wordindex, struct sparsematrix *sm, int n) {
+    struct pyramid_word *pw;
+    struct sparsematrix *coarse;
+    int coarsen;
+    pw = g_pyramid.levels[level].words + wordindex;
+    pthread_mutex_lock(&g_pyramid.lock);
+    coarse = pw->sm;
+    pthread_mutex_unlock(&g_pyramid.lock);
+    if (coarse != NULL)
+	return(pw);
+    /* Build outside the lock; another thread may be doing the same word */
+    coarse = sparsematrix_coarsen(sm, n, g_pyramid.numlevels - level, &coarsen);
+    pthread_mutex_lock(&g_pyramid.lock);
+    if (pw->sm == NULL) {
+	pw->n = coarsen;
+	pw->sm = coarse;
+	coarse = NULL;
     }
-    for (linecount = 0; fgets(line, MAX_LINE_SIZE, input_file); linecount++) {  }
-    rewind(input_file);
-    results = malloc(linecount * sizeof(double));
-    for (line_number = 1, j = 0;  ;line_number++) {
-	i = 0;
-        fgets(line, MAX_LINE_SIZE, input_file);
-        if (feof(input_file))
-            break;
-	field_number = 1;
-        next_field = strtok(line, ",\n ");
-        while (next_field != NULL) {
-	    switch (field_number) {
-	    case 1:
-		lat = strtod(next_field, NULL);
-		break;
-	    case 2:
-		lon = strtod(next_field, NULL);
-		break;
-	    default:
-		if (i == wordsarraysize) {
-		    words = realloc(words, sizeof(char *) * wordsarraysize * 2);
-		    wordsarraysize *= 2;
-		}
-		words[i] = next_field;
-		i++;
-	    }
-            next_field = strtok(NULL, ",\n ");
-	    field_number++;
-        }
-	words[i] = NULL;
-	tweet_cell = g_kullback_leibler ? tweet_classify_kullbackleibler(words, tweetsmatrix, wordmatrix, NULL) : tweet_classify_naivebayes(words, tweetsmatrix, wordmatrix, NULL);
-	if (g_use_centroid) {
-	    lat_estimate = g_centroids[tweet_cell].lat;
-	    lon_estimate = g_centroids[tweet_cell].lon;
-	} else {
-	    lat_estimate = YTOMIDLAT(CELLTOY(tweet_cell));
-	    lon_estimate = XTOMIDLON(CELLTOX(tweet_cell));
-	}
-	distance = haversine_km(lat, lon, lat_estimate, lon_estimate);
-	results[j] = distance;
-	j++;
-	totaldistance += distance;
-	if (line_number % 100 == 0)
-	    printf("%i: %lg,%lg\t%lg\t%i\trunning mean: %lg\n", line_number, lat_estimate, lon_estimate, distance, tweet_cell, totaldistance/(double)line_number);
-    }
-    qsort(results, j, sizeof(double), compare_double);
-    median = (j % 2 == 0) ? (results[j/2] + results[j/2 - 1])/2 : results[j/2];
-    printf("--------------------------\nDATA POINTS: %i\n", line_number - 1);
-    printf("MEAN DISTANCE: %lg\n", totaldistance/(double)(line_number-1));
-    printf("MEDIAN DISTANCE: %lg\n--------------------------\n", median);
-    free(words);
+    pthread_mutex_unlock(&g_pyramid.lock);
+    free(coarse);
+    return(pw);
 }
 
-/* Read training data and put (1) word information into wc_list and 
-                              (2) document origin info into tweetcoords_head */
-void training_read(char *filename) {
-    gzFile input_file; 
-    char *next_field, line[MAX_LINE_SIZE+1], *word;
-    int line_number, field_number, i;
-    double lat, lon;
-    struct coordinate_list *tweetcoords = NULL;
-    
-    input_file = gzopen(filename, "r");
-    if (input_file == NULL) {
-        perror(filename);
-        exit(EXIT_FAILURE);
-    }
-    global_wh_train = wordhash_init(128);
-    for (line_number = 1, i = 0;  ;line_number++) {
-        gzgets(input_file, line, MAX_LINE_SIZE);
-        if (gzeof(input_file))
-            break;
-	field_number = 1;
-        next_field = strtok(line, ",\n ");
-        while (next_field != NULL) {
-	    switch (field_number) {
-	    case 1:
-		lat = strtod(next_field, NULL);
-		break;
-	    case 2:
-		lon = strtod(next_field, NULL);
-		break;
-	    default:
-		word = next_field;
-		if (global_wh_stopwords == NULL || wordhash_find(global_wh_stopwords, word) == -1) {
-		    word_coord_add_word(word, lat, lon, 1); /* Add word, lat, lon to table */
-		}
-	    }
-            next_field = strtok(NULL, ",\n ");
-	    field_number++;
-        }
-	/* Store the tweet coordinates */
-	if (tweetcoords == NULL) {
-	    tweetcoords = malloc(sizeof(struct coordinate_list));
-	    tweetcoords->next = NULL;
-	    g_tweetcoords_head = tweetcoords;
+/* Float layout of the given cells, from the cellcache's double terms */
+void f32cells_build(struct f32cells *f, int *cells, int numcells) {
+    int c, k;
+    f->n = numcells == 0 ? F32_WIDTH : (numcells + F32_WIDTH - 1) / F32_WIDTH * F32_WIDTH;
+    f->cells = realloc(f->cells, sizeof(int) * f->n);
+    f->index = realloc(f->index, sizeof(int) * g_longranularity * g_latgranularity);
+    f->logtweets = realloc(f->logtweets, sizeof(float) * f->n);
+    f->nb_baseline = realloc(f->nb_baseline, sizeof(float) * f->n);
+    f->kl_baseline = realloc(f->kl_baseline, sizeof(float) * f->n);
+    f->empty = realloc(f->empty, sizeof(float) * f->n);
+    for (c = 0; c < g_longranularity * g_latgranularity; c++)
+	f->index[c] = -1;
+    for (k = 0; k < f->n; k++) {
+	if (k < numcells) {
+	    c = cells[k];
+	    f->cells[k] = c;
+	    f->index[c] = k;
+	    f->logtweets[k] = (float)g_cellcache.logtweets[c];
+	    f->nb_baseline[k] = (float)g_cellcache.nb_baseline[c];
+	    f->kl_baseline[k] = (float)(g_cellcache.kl_log_c_iw[c] - g_cellcache.logprior);
+	    f->empty[k] = 0.0f;
 	} else {
-	    tweetcoords->next = malloc(sizeof(struct coordinate_list));
-	    tweetcoords = tweetcoords->next;
-	    tweetcoords->next = NULL;
+	    f->cells[k] = 0;
+	    f->logtweets[k] = -INFINITY;
+	    f->nb_baseline[k] = 0.0f;
+	    f->kl_baseline[k] = 0.0f;
+	    f->empty[k] = -INFINITY;
 	}
-	tweetcoords->lat = (float)lat;
-	tweetcoords->lon = (float)lon;
     }
-    gzclose(input_file);
 }
 
-struct sparsematrix_handle *sparsematrix_create() {
-    struct sparsematrix_handle *smh;
-    smh = malloc(sizeof(struct sparsematrix_handle));
-    smh->sm = malloc(128 * sizeof(struct sparsematrix));
-    smh->tail = 0;
-    smh->size = 128;
-    return(smh);
+void cellcache_update(double *tweetsmatrix, double *wordmatrix) {
+    int c, numcells;
+    double c_iw, normalizer;
+    if (g_cellcache.valid && g_cellcache.wordprior == g_wordprior && g_cellcache.unk == g_unk)
+	return;
+    if (!g_cellcache.valid) {
+	g_cellcache.logtweets = matrix_init(0.0);
+	g_cellcache.nb_baseline = matrix_init(0.0);
+	g_cellcache.cnb_baseline = matrix_init(0.0);
+	g_cellcache.kl_log_c_iw = matrix_init(0.0);
+	numcells = g_longranularity * g_latgranularity;
+	g_cellcache.livecells = malloc(sizeof(int) * numcells);
+	g_cellcache.allcells = malloc(sizeof(int) * numcells);
+	g_cellcache.liveindex = malloc(sizeof(int) * numcells);
+	for (c = 0; c < numcells; c++)
+	    g_cellcache.allcells[c] = c;
+    }
+    normalizer = g_wordprior * (g_wordtypes + 1.0 + (double)g_unk); /* prior mass of a cell (includes UNK) */
+    g_cellcache.logprior = log(g_wordprior);
+    for (c = 0, g_cellcache.c_min = DBL_MAX; c < g_longranularity * g_latgranularity; c++) {
+	if (tweetsmatrix[c] < g_cellcache.c_min)
+	    g_cellcache.c_min = tweetsmatrix[c];
+	g_cellcache.logtweets[c] = log(tweetsmatrix[c]);
+	c_iw = log(wordmatrix[c] + normalizer);
+	g_cellcache.nb_baseline[c] = g_cellcache.logprior - c_iw;
+	g_cellcache.cnb_baseline[c] = log(g_total_wordcount - wordmatrix[c] + normalizer);
+	g_cellcache.kl_log_c_iw[c] = c_iw;
+    }
+    /* Most of a world grid is ocean or empty: the classifiers only scan the rest */
+    for (c = 0, g_cellcache.numlive = 0; c < g_longranularity * g_latgranularity; c++) {
+	g_cellcache.liveindex[c] = tweetsmatrix[c] != g_cellcache.c_min ? g_cellcache.numlive : -1;
+	if (tweetsmatrix[c] != g_cellcache.c_min)
+	    g_cellcache.livecells[g_cellcache.numlive++] = c;
+    }
+    if (g_float32) {
+	f32cells_build(&g_cellcache.f32live, g_cellcache.livecells, g_cellcache.numlive);
+	f32cells_build(&g_cellcache.f32all, g_cellcache.allcells, g_longranularity * g_latgranularity);
+    }
+    g_cellcache.wordprior = g_wordprior;
+    g_cellcache.unk = g_unk;
+    g_cellcache.valid = 1;
+    if (g_coarse_to_fine > 0)
+	pyramid_update(tweetsmatrix, wordmatrix);
 }
 
-void sparsematrix_add(struct sparsematrix_handle *smh, int x, int y, double value) {
-    if (smh->tail + 1 == smh->size) {
-	smh->sm = realloc(smh->sm, sizeof(struct sparsematrix) * smh->size * 2);
-	smh->size *= 2;
-    }
-    smh->sm[smh->tail].x = (short int)x;
-    smh->sm[smh->tail].y = (short int)y;
-    smh->sm[smh->tail].value = (float)value;
-    smh->tail++;
+/* --stats: counters and monotonic timers on the hot paths, reported as a */
+/* JSON summary on stderr. Classifier threads count into their scratch    */
+/* space and training workers into a local copy; both are summed into     */
+/* g_stats_total when the thread is done. A timer costs one clock read    */
+/* per phase boundary, and only a branch without --stats.                 */
+#define STATS_LATENCY_BUCKETS 96  /* 4 per doubling of the latency, from 1 µs */
+
+struct stats {
+    int64_t tokenize_ns, lookup_ns, decode_ns, score_ns, argmax_ns;
+    int64_t lookups, lookup_misses, decodes, decoded_nonzeros, documents;
+    int64_t latency_ns, latency_max_ns;
+    int64_t latency[STATS_LATENCY_BUCKETS];
+    /* Training */
+    int64_t read_ns, kde_ns, kde_max_ns, write_ns, words, nonzeros;
+};
+
+struct stats g_stats_total;
+int64_t g_stats_load_ns = 0, g_stats_bytes_written = 0, g_stats_start_ns = 0;
+pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int64_t stats_clock() {
+    struct timespec ts;
+    if (!g_stats)
+	return(0);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
 }
 
-struct sparsematrix *sparsematrix_close(struct sparsematrix_handle *smh) {
-    struct sparsematrix *sm;
-    smh->sm = realloc(smh->sm, sizeof(struct sparsematrix) * smh->tail);
-    sm = smh->sm;
-    free(smh);
-    return(sm);
+/* Adds the time since t0 to *acc and returns the current time, so phases can be chained */
+static inline int64_t stats_lap(int64_t *acc, int64_t t0) {
+    int64_t t;
+    if (!g_stats)
+	return(0);
+    t = stats_clock();
+    *acc += t - t0;
+    return(t);
 }
 
-double *sparsematrix_to_matrix(struct sparsematrix *sm) {
-    int i;
-    double *matrix;
-    matrix = calloc(g_latgranularity * g_longranularity, sizeof(double));
-    if (matrix == NULL) {
-	fprintf(stderr, "Out of memory.\n");
-	exit(EXIT_FAILURE);
-    }
-    for (i = 0; sm[i].x != -1; i++) {
-	matrix[sm[i].x + sm[i].y * g_longranularity] = (double)sm[i].value;
+void stats_document(struct stats *st, int64_t ns) {
+    int b;
+    st->documents++;
+    st->latency_ns += ns;
+    if (ns > st->latency_max_ns)
+	st->latency_max_ns = ns;
+    b = ns < 1000 ? 0 : 1 + (int)(4.0 * log2(ns / 1000.0));
+    st->latency[b < STATS_LATENCY_BUCKETS ? b : STATS_LATENCY_BUCKETS - 1]++;
+}
+
+void stats_merge(struct stats *st) {
+    struct stats *total = &g_stats_total;
+    int b;
+    pthread_mutex_lock(&g_stats_lock);
+    total->tokenize_ns += st->tokenize_ns;
+    total->lookup_ns += st->lookup_ns;
+    total->decode_ns += st->decode_ns;
+    total->score_ns += st->score_ns;
+    total->argmax_ns += st->argmax_ns;
+    total->lookups += st->lookups;
+    total->lookup_misses += st->lookup_misses;
+    total->decodes += st->decodes;
+    total->decoded_nonzeros += st->decoded_nonzeros;
+    total->documents += st->documents;
+    total->latency_ns += st->latency_ns;
+    total->latency_max_ns = st->latency_max_ns > total->latency_max_ns ? st->latency_max_ns : total->latency_max_ns;
+    for (b = 0; b < STATS_LATENCY_BUCKETS; b++)
+	total->latency[b] += st->latency[b];
+    total->read_ns += st->read_ns;
+    total->kde_ns += st->kde_ns;
+    total->kde_max_ns = st->kde_max_ns > total->kde_max_ns ? st->kde_max_ns : total->kde_max_ns;
+    total->write_ns += st->write_ns;
+    total->words += st->words;
+    total->nonzeros += st->nonzeros;
+    memset(st, 0, sizeof(struct stats));
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+/* Upper end (µs) of the latency bucket holding the q-quantile */
+double stats_percentile(struct stats *st, double q) {
+    int64_t n, target;
+    int b;
+    if (st->documents == 0)
+	return(0.0);
+    target = (int64_t)ceil(q * st->documents);
+    for (b = 0, n = 0; b < STATS_LATENCY_BUCKETS - 1; b++)
+	if ((n += st->latency[b]) >= target)
+	    break;
+    if (b == STATS_LATENCY_BUCKETS - 1 || pow(2.0, b / 4.0) > st->latency_max_ns / 1000.0)
+	return(st->latency_max_ns / 1000.0);
+    return(pow(2.0, b / 4.0));
+}
+
+/* Per-thread scratch space for the classifiers, so documents can be */
+/* classified concurrently and without allocating grids per document */
+struct classify_scratch {
+    double *totalmatrix;
+    /* Coarse-to-fine search only */
+    double *coarsematrix;     /* Scores of the coarsest pyramid level            */
+    int *beam, *nextbeam;     /* The K cells kept at the current/next level     */
+    double *beamscore, *nextscore;
+    int featuresize;          /* Allocated size of the feature arrays below     */
+    int *featureword;
+    int *featuren;
+    int *featuretofree;
+    double *featureweight;
+    struct sparsematrix **featuresm;
+    /* Kullback-Leibler only: open-addressing table of the features seen in */
+    /* the current document (slots are live while their stamp is current)  */
+    int *slotfeature;
+    unsigned int *slotstamp;
+    int slotsize;
+    unsigned int stamp;
+    /* Batched Naive Bayes only */
+    double *tile;             /* [live cells x documents] scores               */
+    int tilesize;
+    struct batchfeature *batchfeatures;
+    int batchfeaturesize;
+    double *batchweight;      /* Summed feature weights per document           */
+    double *batchbest;        /* Best score per document                       */
+    /* Ensembles only (--ensemble), over the largest grid of the models */
+    unsigned char *candidate; /* Whether a cell is being scored (cleared after) */
+    double *candsum;          /* Scores of those cells                          */
+    int *candcells;           /* The cells, and the score they carry over from  */
+    double *candbase;         /* the previous model                             */
+    /* Single precision only (--float32) */
+    float *totalf;            /* Scores over a float layout                    */
+    int totalfsize;
+    int *f32pos;              /* Layout positions, values and logs of the     */
+    float *f32value, *f32log; /* sparse entries of one feature                */
+    int f32size;
+    struct stats stats;       /* --stats counters of this thread               */
+};
+
+struct batchfeature {
+    int word;
+    int doc;
+};
+
+struct classify_scratch *classify_scratch_init() {
+    struct classify_scratch *scratch;
+    scratch = calloc(1, sizeof(struct classify_scratch));
+    scratch->totalmatrix = matrix_init(0.0);
+    return(scratch);
+}
+
+void classify_scratch_free(struct classify_scratch *scratch) {
+    if (g_stats)
+	stats_merge(&scratch->stats);
+    free(scratch->totalmatrix);
+    free(scratch->coarsematrix);
+    free(scratch->beam);
+    free(scratch->nextbeam);
+    free(scratch->beamscore);
+    free(scratch->nextscore);
+    free(scratch->featureword);
+    free(scratch->featuren);
+    free(scratch->featuretofree);
+    free(scratch->featuresm);
+    free(scratch->featureweight);
+    free(scratch->slotfeature);
+    free(scratch->slotstamp);
+    free(scratch->tile);
+    free(scratch->batchfeatures);
+    free(scratch->batchweight);
+    free(scratch->batchbest);
+    free(scratch->candidate);
+    free(scratch->candsum);
+    free(scratch->candcells);
+    free(scratch->candbase);
+    free(scratch->totalf);
+    free(scratch->f32pos);
+    free(scratch->f32value);
+    free(scratch->f32log);
+    free(scratch);
+}
+
+/* Room for n features in the scratch's feature arrays */
+void classify_scratch_features(struct classify_scratch *scratch, int n) {
+    if (n <= scratch->featuresize)
+	return;
+    while (scratch->featuresize < n)
+	scratch->featuresize = scratch->featuresize == 0 ? WORDSARRAYSIZE : scratch->featuresize * 2;
+    scratch->featureword = realloc(scratch->featureword, sizeof(int) * scratch->featuresize);
+    scratch->featuren = realloc(scratch->featuren, sizeof(int) * scratch->featuresize);
+    scratch->featuretofree = realloc(scratch->featuretofree, sizeof(int) * scratch->featuresize);
+    scratch->featuresm = realloc(scratch->featuresm, sizeof(struct sparsematrix *) * scratch->featuresize);
+    scratch->featureweight = realloc(scratch->featureweight, sizeof(double) * scratch->featuresize);
+}
+
+/* Insert cell c with score p into the (descending) top-k list of n cells */
+int beam_insert(int *cells, double *scores, int n, int k, int c, double p) {
+    int pos;
+    if (n == k && p <= scores[k-1])
+	return(n);
+    for (pos = n < k ? n : k - 1; pos > 0 && scores[pos-1] < p; pos--) {
+	cells[pos] = cells[pos-1];
+	scores[pos] = scores[pos-1];
     }
-    return(matrix);
+    cells[pos] = c;
+    scores[pos] = p;
+    return(n < k ? n + 1 : k);
 }
 
-double *word_get_matrix(int wordindex) {
-    double *w;
-    /* If matrix is not stored, we generate it on the fly */
-    if (wc_list[wordindex].sparsematrix == NULL) {
-	w = matrix_init(0.0);
-	if (g_nokde) {
-	    matrix_nokde_from_coords(w, wc_list[wordindex].coordinate_list);
+/* Naive Bayes over the pyramid: all cells of the coarsest level, then the */
+/* children of the g_coarse_to_fine best cells at each finer level         */
+int tweet_classify_coarse_to_fine(char **words, struct classify_scratch *scratch) {
+    struct pyramid_level *lv, *coarse;
+    struct pyramid_word *pw;
+    struct sparsematrix *sm;
+    char **w;
+    int j, l, b, c, x, y, dx, dy, f, nf, k, wordindex, tofree, numbeam, numnext, *tmpcells;
+    double p, v, weight, weightsum, *totalmatrix, *tmpscores;
+    struct stats *st = &scratch->stats;
+    int64_t t;
+
+    k = g_coarse_to_fine;
+    if (scratch->beam == NULL) {
+	scratch->coarsematrix = malloc(sizeof(double) * g_pyramid.levels[0].longranularity * g_pyramid.levels[0].latgranularity);
+	scratch->beam = malloc(sizeof(int) * k);
+	scratch->nextbeam = malloc(sizeof(int) * k);
+	scratch->beamscore = malloc(sizeof(double) * k);
+	scratch->nextscore = malloc(sizeof(double) * k);
+    }
+    /* The document's features and their model matrices */
+    t = stats_clock();
+    for (w = words, weightsum = 0.0, nf = 0; *w != NULL; w++) {
+	wordindex = word_lookup(*w);
+	t = stats_lap(&st->lookup_ns, t);
+	st->lookups++;
+	if (wordindex != -1) {
+	    if ((weight = word_get_weight(wordindex)) == 0)
+		continue;
+	} else if (!g_unk) {
+	    st->lookup_misses++;
+	    continue;
 	} else {
-	    matrix_kde_from_coords(w, wc_list[wordindex].coordinate_list, g_sigma, g_sigma, 0.0);
+	    st->lookup_misses++;
+	    weight = 1.0;
 	}
-	return(w);
-    } else {
-	return(sparsematrix_to_matrix(wc_list[wordindex].sparsematrix));
+	weightsum += weight;
+	if (wordindex == -1 || (sm = word_get_sparsematrix(wordindex, &tofree)) == NULL)
+	    continue; /* Only contributes the baseline */
+	classify_scratch_features(scratch, nf + 1);
+	scratch->featureword[nf] = wordindex;
+	scratch->featureweight[nf] = weight;
+	scratch->featuresm[nf] = sm;
+	scratch->featuretofree[nf] = tofree;
+	scratch->featuren[nf] = pyramid_word_nonzeros(wordindex, sm, tofree);
+	st->decodes++;
+	st->decoded_nonzeros += scratch->featuren[nf];
+	nf++;
+	t = stats_lap(&st->decode_ns, t);
     }
-}
 
-struct sparsematrix *matrix_to_sparsematrix(double *matrix) {
-    int i, x, y, cellcount;
-    struct sparsematrix *sm;
-    for (i = 0, cellcount = 0; i < g_latgranularity * g_longranularity; i++)
-	if (matrix[i] != 0.0)
-	    cellcount++;
-    sm = malloc(sizeof(struct sparsematrix) * (cellcount + 1));
-    
-    for (x = 0, i = 0; x < g_longranularity; x++) {
-	for (y = 0; y < g_latgranularity; y++) {
-	    if (matrix[x+y*g_longranularity] != 0.0) {
-		sm[i].x = (short int)x;
-		sm[i].y = (short int)y;
-		sm[i].value = (float)matrix[x+y*g_longranularity];
-		i++;
+    /* Coarsest level: score every cell, with the same sparse accumulation as the full search */
+    lv = g_pyramid.levels;
+    totalmatrix = scratch->coarsematrix;
+    memcpy(totalmatrix, lv->logtweets, lv->longranularity * lv->latgranularity * sizeof(double));
+    for (f = 0; f < nf; f++) {
+	pw = pyramid_word(0, scratch->featureword[f], scratch->featuresm[f], scratch->featuren[f]);
+	for (j = 0; j < pw->n; j++)
+	    totalmatrix[pw->sm[j].x + pw->sm[j].y * lv->longranularity] += scratch->featureweight[f] * (log(pw->sm[j].value + lv->wordprior) - lv->logprior);
+    }
+    for (c = 0, numbeam = 0; c < lv->longranularity * lv->latgranularity; c++) {
+	if (lv->live[c])
+	    numbeam = beam_insert(scratch->beam, scratch->beamscore, numbeam, k, c, totalmatrix[c] + weightsum * lv->nb_baseline[c]);
+    }
+
+    /* Finer levels: only the children of the kept cells */
+    for (l = 1; l <= g_pyramid.numlevels; l++) {
+	lv = g_pyramid.levels + l;
+	coarse = lv - 1;
+	for (b = 0, numnext = 0; b < numbeam; b++) {
+	    for (dy = 0; dy < 2; dy++) {
+		for (dx = 0; dx < 2; dx++) {
+		    x = (scratch->beam[b] % coarse->longranularity) * 2 + dx;
+		    y = (scratch->beam[b] / coarse->longranularity) * 2 + dy;
+		    c = x + y * lv->longranularity;
+		    if (!lv->live[c])
+			continue;
+		    p = lv->logtweets[c];
+		    for (f = 0; f < nf; f++) {
+			if (l == g_pyramid.numlevels) {
+			    v = sparsematrix_lookup(scratch->featuresm[f], scratch->featuren[f], x, y);
+			} else {
+			    pw = pyramid_word(l, scratch->featureword[f], scratch->featuresm[f], scratch->featuren[f]);
+			    v = sparsematrix_lookup(pw->sm, pw->n, x, y);
+			}
+			if (v != 0.0)
+			    p += scratch->featureweight[f] * (log(v + lv->wordprior) - lv->logprior);
+		    }
+		    numnext = beam_insert(scratch->nextbeam, scratch->nextscore, numnext, k, c, p + weightsum * lv->nb_baseline[c]);
+		}
 	    }
 	}
+	tmpcells = scratch->beam; scratch->beam = scratch->nextbeam; scratch->nextbeam = tmpcells;
+	tmpscores = scratch->beamscore; scratch->beamscore = scratch->nextscore; scratch->nextscore = tmpscores;
+	numbeam = numnext;
     }
-    sm[i].x = -1; sm[i].y = -1; sm[i].value = -1.0;
-    return(sm);
+    for (f = 0; f < nf; f++) {
+	word_release_sparsematrix(scratch->featureword[f], scratch->featuresm[f], scratch->featuretofree[f]);
+    }
+    stats_lap(&st->score_ns, t); /* The beam is the argmax */
+    return(numbeam > 0 ? scratch->beam[0] : 0);
 }
+int tweet_classify_naivebayes(char **words, double *tweetsmatrix, double *wordmatrix, double *resultmatrix, struct classify_scratch *scratch) {
+    char **w;
+    int maxindex, j, k, c, wordindex, wordcount, tofree, numcells, *cells;
+    double p, p_max, *totalmatrix, feature_weight, weightsum, logprior, logcount, logcountsum;
+    struct sparsematrix *sm;
+    struct stats *st = &scratch->stats;
+    int64_t t;
+    /* Whole distributions and complement NB need every cell */
+    if (g_pyramid.valid && g_pyramid.numlevels > 0 && resultmatrix == NULL && !g_complement_nb)
+	return(tweet_classify_coarse_to_fine(words, scratch));
+    /* Shortcut to speed up classification: we only consider cells above the minimum prior */
+    /* This, unless we want to output the whole distribution  */
+    cells = resultmatrix == NULL ? g_cellcache.livecells : g_cellcache.allcells;
+    numcells = resultmatrix == NULL ? g_cellcache.numlive : g_longranularity * g_latgranularity;
+    logprior = g_cellcache.logprior;
 
-/* Normalizes a matrix in logspace and converts to reals */
-void matrix_normalize_log(double *matrix) {
-    int c;
-    double max, sum;
-    max = -DBL_MAX;
-    for (c = 0; c < g_longranularity * g_latgranularity; c++) {
-	if (matrix[c] > max)
-	    max = matrix[c];
+    // Naive Bayes:
+    // p(c_i) * mass(c_i, w_1)/mass(c_i)_w * ... * mass(c_i, w_n)/mass(c_i)_w
+    /* Each feature contributes the per-cell baseline everywhere, so we only sum   */
+    /* the feature weights here and walk their nonzero sparse entries for the delta */
+    /* (features count once per occurrence, scaled by their --tune weight)          */
+    totalmatrix = scratch->totalmatrix;
+    memcpy(totalmatrix, g_cellcache.logtweets, g_longranularity * g_latgranularity * sizeof(double)); /* Need to get tweetmatrix in logspace */
+
+    t = stats_clock();
+    for (w = words, weightsum = 0.0, logcountsum = 0.0; *w != NULL; w++) {
+	wordindex = word_lookup(*w);
+	t = stats_lap(&st->lookup_ns, t);
+	st->lookups++;
+	if (wordindex != -1) {
+	    feature_weight = word_get_weight(wordindex);
+	    wordcount = word_get_count(wordindex);
+	} else if (g_unk) {
+	    /* Unknown word, zero matrix, prior gets added as the baseline below */
+	    feature_weight = 1.0;
+	    wordcount = 0;
+	    st->lookup_misses++;
+	} else {
+	    st->lookup_misses++;
+	    continue;
+	}
+	if (feature_weight == 0)
+	    continue;
+	weightsum += feature_weight;
+	sm = wordindex != -1 ? word_get_sparsematrix(wordindex, &tofree) : NULL;
+	t = stats_lap(&st->decode_ns, t);
+	if (!g_complement_nb) {
+	    for (j = 0; sm != NULL && sm[j].x != -1; j++) {
+		c = sm[j].x + sm[j].y * g_longranularity;
+		totalmatrix[c] += feature_weight * (log(sm[j].value + g_wordprior) - logprior);
+	    }
+	} else {
+	    /* Mass in other classes: the baseline depends on the word's count */
+	    logcount = log(wordcount + g_wordprior);
+	    logcountsum += feature_weight * logcount;
+	    for (j = 0; sm != NULL && sm[j].x != -1; j++) {
+		c = sm[j].x + sm[j].y * g_longranularity;
+		totalmatrix[c] -= feature_weight * (log(wordcount - sm[j].value + g_wordprior) - logcount);
+	    }
+	}
+	if (sm != NULL) {
+	    st->decodes++;
+	    st->decoded_nonzeros += j;
+	    word_release_sparsematrix(wordindex, sm, tofree);
+	}
+	t = stats_lap(&st->score_ns, t);
     }
-    for (c = 0, sum = 0; c < g_longranularity * g_latgranularity; c++) {
-	matrix[c] = exp(matrix[c] - max);
-	sum += matrix[c];
+    /* Add the baseline of all (weighted) features, then find argmax c p(c_i) * mass(c_i|w_1)/mass(c_i)_w * ... */
+    for (k = 0, p_max = -DBL_MAX, maxindex = 0; k < numcells; k++) {
+	c = cells[k];
+	if (!g_complement_nb)
+	    p = totalmatrix[c] += weightsum * g_cellcache.nb_baseline[c];
+	else
+	    p = totalmatrix[c] -= logcountsum - weightsum * g_cellcache.cnb_baseline[c];
+	if (p > p_max) {
+	    p_max = p;
+	    maxindex = c;
+	}
     }
-    for (c = 0; c < g_longranularity * g_latgranularity; c++) {
-	matrix[c] /= sum;
+    if (resultmatrix != NULL) { /* Copy totalmatrix to resultmatrix */
+	for (c = 0; c < g_longranularity * g_latgranularity ; c++)
+	    resultmatrix[c] = totalmatrix[c];
     }
+    stats_lap(&st->argmax_ns, t);
+    return(maxindex);
+} 
+
+/* A document read for classification; words point into the reader's buffer */
+struct document {
+    char **words;
+    int wordsarraysize;
+    double lat;
+    double lon;
+    int cell;
+    double *resultmatrix;     /* Whole distribution, only with --print-matrix/--print-topk */
+};
+
+int compare_batchfeature(const void *a, const void *b) {
+    const struct batchfeature *fa = (const struct batchfeature *) a;
+    const struct batchfeature *fb = (const struct batchfeature *) b;
+    if (fa->word != fb->word)
+	return(fa->word - fb->word);
+    return(fa->doc - fb->doc);
 }
 
-void matrix_set(double *matrix, double value) {
-    int i;
-    for (i = 0; i < g_latgranularity * g_longranularity ; i++) {
-	matrix[i] = value;
+/* Naive Bayes for up to g_batch documents at once, scored side by side on a */
+/* cell-major [live cells x documents] tile: the model matrix of a feature   */
+/* is fetched, and its log-deltas computed, once for all documents of the    */
+/* group that contain it. Sets the cell of each document.                    */
+void tweet_classify_naivebayes_batch(struct document *docs, int numdocs, struct classify_scratch *scratch) {
+    struct batchfeature *bf;
+    struct sparsematrix *sm;
+    char **w;
+    int d, j, k, c, e, f, g, nf, wordindex, tofree;
+    double delta, baseline, p, logprior, weight, weightsum, *row;
+    struct stats *st = &scratch->stats;
+    int64_t t;
+
+    logprior = g_cellcache.logprior;
+    if (scratch->batchweight == NULL) {
+	scratch->batchweight = malloc(sizeof(double) * g_batch);
+	scratch->batchbest = malloc(sizeof(double) * g_batch);
     }
-}
+    if (scratch->tilesize < g_cellcache.numlive * numdocs) {
+	scratch->tilesize = g_cellcache.numlive * g_batch;
+	free(scratch->tile);
+	scratch->tile = malloc(sizeof(double) * scratch->tilesize);
+    }
+    /* (feature, document) pairs, with repeats, grouped by feature */
+    t = stats_clock();
+    for (d = 0, nf = 0; d < numdocs; d++) {
+	for (w = docs[d].words, weightsum = 0.0; *w != NULL; w++) {
+	    st->lookups++;
+	    if ((wordindex = word_lookup(*w)) != -1) {
+		if ((weight = word_get_weight(wordindex)) == 0)
+		    continue;
+	    } else if (!g_unk) {
+		st->lookup_misses++;
+		continue;
+	    } else {
+		st->lookup_misses++;
+		weight = 1.0;
+	    }
+	    weightsum += weight;
+	    if (wordindex == -1)
+		continue; /* Unknown word: only the baseline */
+	    if (nf == scratch->batchfeaturesize) {
+		scratch->batchfeaturesize = nf == 0 ? 1024 : nf * 2;
+		scratch->batchfeatures = realloc(scratch->batchfeatures, sizeof(struct batchfeature) * scratch->batchfeaturesize);
+	    }
+	    scratch->batchfeatures[nf].word = wordindex;
+	    scratch->batchfeatures[nf].doc = d;
+	    nf++;
+	}
+	scratch->batchweight[d] = weightsum;
+    }
+    bf = scratch->batchfeatures;
+    qsort(bf, nf, sizeof(struct batchfeature), compare_batchfeature);
+    t = stats_lap(&st->lookup_ns, t);
 
-double *matrix_init(double prior) {
-    double *matrix;
-    matrix = malloc(g_latgranularity * g_longranularity * sizeof(double));
-    matrix_set(matrix, prior);
-    return(matrix);
+    for (k = 0; k < g_cellcache.numlive; k++) {
+	row = scratch->tile + k * numdocs;
+	p = g_cellcache.logtweets[g_cellcache.livecells[k]];
+	for (d = 0; d < numdocs; d++)
+	    row[d] = p;
+    }
+    for (f = 0; f < nf; f = g) {
+	for (g = f + 1; g < nf && bf[g].word == bf[f].word; g++) { }
+	sm = word_get_sparsematrix(bf[f].word, &tofree);
+	t = stats_lap(&st->decode_ns, t);
+	if (sm == NULL)
+	    continue;
+	weight = word_get_weight(bf[f].word);
+	for (j = 0; sm[j].x != -1; j++) {
+	    if ((k = g_cellcache.liveindex[sm[j].x + sm[j].y * g_longranularity]) == -1)
+		continue;
+	    delta = weight * (log(sm[j].value + g_wordprior) - logprior);
+	    row = scratch->tile + k * numdocs;
+	    for (e = f; e < g; e++)
+		row[bf[e].doc] += delta;
+	}
+	st->decodes++;
+	st->decoded_nonzeros += j;
+	word_release_sparsematrix(bf[f].word, sm, tofree);
+	t = stats_lap(&st->score_ns, t);
+    }
+    /* Baselines and argmax, scanning cells in the same order as the single-document search */
+    for (d = 0; d < numdocs; d++) {
+	scratch->batchbest[d] = -DBL_MAX;
+	docs[d].cell = 0;
+    }
+    for (k = 0; k < g_cellcache.numlive; k++) {
+	c = g_cellcache.livecells[k];
+	baseline = g_cellcache.nb_baseline[c];
+	row = scratch->tile + k * numdocs;
+	for (d = 0; d < numdocs; d++) {
+	    p = row[d] + scratch->batchweight[d] * baseline;
+	    if (p > scratch->batchbest[d]) {
+		scratch->batchbest[d] = p;
+		docs[d].cell = c;
+	    }
+	}
+    }
+    stats_lap(&st->argmax_ns, t);
 }
 
-double *matrix_copy(double *matrix1) {
-    int i;
-    double *matrix2;
-    matrix2 = matrix_init(0.0);
-    for (i = 0; i <  g_latgranularity * g_longranularity; i++) {
-        matrix2[i] = matrix1[i];
+/* Start collecting the unique features of a document of n tokens */
+void kl_features_begin(struct classify_scratch *scratch, int n) {
+    classify_scratch_features(scratch, n);
+    if (scratch->slotsize < 2 * n || scratch->slotsize == 0) {
+	for (scratch->slotsize = scratch->slotsize == 0 ? 64 : scratch->slotsize; scratch->slotsize < 2 * n; scratch->slotsize *= 2) { }
+	scratch->slotfeature = realloc(scratch->slotfeature, sizeof(int) * scratch->slotsize);
+	scratch->slotstamp = realloc(scratch->slotstamp, sizeof(unsigned int) * scratch->slotsize);
+	memset(scratch->slotstamp, 0, sizeof(unsigned int) * scratch->slotsize);
+	scratch->stamp = 0;
+    }
+    if (++scratch->stamp == 0) {
+	memset(scratch->slotstamp, 0, sizeof(unsigned int) * scratch->slotsize);
+	scratch->stamp = 1;
     }
-    return(matrix2);
 }
 
-void matrix_normalize(double *matrix) {
-    int i;
-    double sum;
-    for (i = 0, sum = 0.0; i < g_latgranularity * g_longranularity; i++) {
-	sum += matrix[i];
+/* Count an occurrence of the known feature wordindex among the nf so far; */
+/* returns the new number of features                                     */
+int kl_features_add(struct classify_scratch *scratch, int wordindex, int nf) {
+    int slot, mask;
+    mask = scratch->slotsize - 1;
+    for (slot = (unsigned int) wordindex * 2654435761u & mask; scratch->slotstamp[slot] == scratch->stamp; slot = (slot + 1) & mask) {
+	if (scratch->featureword[scratch->slotfeature[slot]] == wordindex)
+	    break;
     }
-    for (i = 0; i <  g_latgranularity * g_longranularity; i++) {
-	matrix[i] /= sum;
+    if (scratch->slotstamp[slot] == scratch->stamp) {
+	scratch->featuren[scratch->slotfeature[slot]]++;
+    } else {
+	scratch->slotstamp[slot] = scratch->stamp;
+	scratch->slotfeature[slot] = nf;
+	scratch->featureword[nf] = wordindex;
+	scratch->featuren[nf++] = 1;
     }
+    return(nf);
 }
 
-void matrix_add(double *matrix1, double *matrix2) {
-    int i;
-    for (i = 0; i <  g_latgranularity * g_longranularity; i++) {
-	matrix2[i] += matrix1[i];
+/* The unique known features of a document and their counts go into the */
+/* scratch's feature arrays, in order of first occurrence; returns their  */
+/* number                                                                 */
+int kl_features(char **words, struct classify_scratch *scratch) {
+    char **w;
+    int n, nf, wordindex;
+    struct stats *st = &scratch->stats;
+    for (n = 0; words[n] != NULL; n++) { }
+    kl_features_begin(scratch, n);
+    for (w = words, nf = 0; *w != NULL; w++) {
+	st->lookups++;
+	if ((wordindex = word_lookup(*w)) == -1) {
+	    st->lookup_misses++;
+	    continue;
+	}
+	nf = kl_features_add(scratch, wordindex, nf);
     }
+    return(nf);
 }
 
-/* Find the centroid within each cell for more accurate placement       */
-/* at classification time. Takes a list of coordinates, and returns     */
-/* a matrix of the centroid for each cell                               */
+int tweet_classify_kullbackleibler(char **words, double *tweetsmatrix, double *wordmatrix, double *resultmatrix, struct classify_scratch *scratch) {
+    int minindex, j, k, c, f, nf, tofree, numcells, *cells;
+    double p, p_min, ratio, mass, offset, logprior, *totalmatrix;
+    struct sparsematrix *sm;
+    struct stats *st = &scratch->stats;
+    int64_t t;
+    // KL divergence:
+    // sum w \in t p(w|t) * log( p(w|t)/p(w_i|c_i) )
+    t = stats_clock();
+    nf = kl_features(words, scratch);
+    t = stats_lap(&st->lookup_ns, t);
+    /* Shortcut to speed up classification: we only consider cells above the minimum prior */
+    /* This, unless we want to output the whole distribution  */
+    cells = resultmatrix == NULL ? g_cellcache.livecells : g_cellcache.allcells;
+    numcells = resultmatrix == NULL ? g_cellcache.numlive : g_longranularity * g_latgranularity;
+    logprior = g_cellcache.logprior;
 
-void find_centroids(struct coordinate_list *cl) {
-    struct coordinate_list *clist;
-    double *lats, *lons;
-    int cell, *counts;
-    lats   = calloc(g_latgranularity * g_longranularity, sizeof(double));
-    lons   = calloc(g_latgranularity * g_longranularity, sizeof(double));
-    counts = calloc(g_latgranularity * g_longranularity, sizeof(int));
-    g_centroids = calloc(g_latgranularity * g_longranularity, sizeof(struct centroids));
-    for (clist = cl; clist != NULL; clist = clist->next) {
-	cell = LONTOX(clist->lon) + LATTOY(clist->lat) * g_longranularity;
-	lats[cell] += clist->lat;
-	lons[cell] += clist->lon;
-	counts[cell] += 1;
+    /* p(w|t) ~ count/nf. Where a feature's matrix is zero its term is     */
+    /* p(w|t) * (log p(c)_w + log p(w|t) - log prior), so, as with Naive    */
+    /* Bayes, the sums of p(w|t) and p(w|t) log p(w|t) give a baseline for  */
+    /* every cell and only the nonzero sparse entries are walked            */
+    totalmatrix = scratch->totalmatrix;
+    memset(totalmatrix, 0, g_longranularity * g_latgranularity * sizeof(double));
+    for (f = 0, mass = 0.0, offset = 0.0; f < nf; f++) {
+	ratio = (double) scratch->featuren[f] / nf;
+	mass += ratio;
+	offset += ratio * log(ratio);
+	sm = word_get_sparsematrix(scratch->featureword[f], &tofree);
+	t = stats_lap(&st->decode_ns, t);
+	for (j = 0; sm != NULL && sm[j].x != -1; j++) {
+	    c = sm[j].x + sm[j].y * g_longranularity;
+	    totalmatrix[c] -= ratio * (log(sm[j].value + g_wordprior) - logprior);
+	}
+	if (sm != NULL) {
+	    st->decodes++;
+	    st->decoded_nonzeros += j;
+	    word_release_sparsematrix(scratch->featureword[f], sm, tofree);
+	}
+	t = stats_lap(&st->score_ns, t);
     }
-    for (cell = 0; cell < g_longranularity * g_latgranularity; cell++) {
-	if (counts[cell] == 0) {
-	    g_centroids[cell].lat = YTOMIDLAT(CELLTOY(cell));
-	    g_centroids[cell].lon = XTOMIDLON(CELLTOX(cell));
-	} else {
-	    g_centroids[cell].lat = lats[cell]/(double)counts[cell];
-	    g_centroids[cell].lon = lons[cell]/(double)counts[cell];
+    for (k = 0, minindex = 0, p_min = DBL_MAX; k < numcells; k++) {
+	c = cells[k];
+	p = totalmatrix[c] += mass * (g_cellcache.kl_log_c_iw[c] - logprior) + offset;
+	if (p < p_min) {
+	    minindex = c;
+	    p_min = p;
 	}
     }
-    free(lats);
-    free(lons);
-    free(counts);
+    if (resultmatrix != NULL)
+	for (c = 0; c < g_longranularity * g_latgranularity ; c++)
+	    resultmatrix[c] = -totalmatrix[c];
+    stats_lap(&st->argmax_ns, t);
+    return(minindex);
 }
 
-/* Non-kde version:                                               */
-/* WE just add mass to the matrix for each coordinate in the list */
-void matrix_nokde_from_coords(double * restrict matrix, struct coordinate_list *cl) {
-    struct coordinate_list * restrict clist;
-    int x, y, numpoints;
-    
-    /* Find out number of points */
-    for (clist = cl, numpoints = 0; clist != NULL; clist = clist->next) {
-	numpoints++;
+/* Room for scores over a float layout of n positions and for the sparse */
+/* entries of one feature                                                */
+float *classify_scratch_f32(struct classify_scratch *scratch, int n) {
+    if (scratch->totalfsize < n) {
+	scratch->totalfsize = n;
+	free(scratch->totalf);
+	scratch->totalf = malloc(sizeof(float) * n);
     }
-    for (clist = cl; clist != NULL; clist = clist->next) {
-	x = LONTOX(clist->lon);
-	y = LATTOY(clist->lat);
-	matrix[x+y*g_longranularity] += 1.0;
+    if (scratch->f32size == 0) {
+	scratch->f32size = 1024;
+	scratch->f32pos = malloc(sizeof(int) * scratch->f32size);
+	scratch->f32value = malloc(sizeof(float) * scratch->f32size);
+	scratch->f32log = malloc(sizeof(float) * scratch->f32size);
     }
+    return(scratch->totalf);
 }
 
-/* Read list of coordinates (individual points) */
-/* and fill values in a density matrix          */
-void matrix_kde_from_coords(double * restrict matrix, struct coordinate_list *cl, double sigma1, double sigma2, double rho) {
-    double lat, lon, thisdensity;
-    struct coordinate_list * restrict clist;
-    int x, y, numpoints, maxradius, minx, maxx, miny, maxy;
-    /* Find out maximum radius (in ticks) we need to take into account for each point */
-    /* This is to avoid having to later calculate the density for the whole grid for each point */
-    /* We do this by looking at the Gaussian away from the center until the density dips below a point */ 
-    for (x = 0;  ; x++) {
-	thisdensity = bivariate_gaussian_pdf((double)x * (360.0/(double)g_longranularity), 0.0, sigma1, sigma2, rho, 0.0, 0.0);
-	if (thisdensity < 0.001)
-	    break;
-    }
-    maxradius = x ; /* Maximum radius in ticks worth examining (per degree) */
-
-    /* Find out number of points to examine */
-    for (clist = cl, numpoints = 0; clist != NULL; clist = clist->next) {
-	numpoints++;
-    }
-    for (clist = cl; clist != NULL; clist = clist->next) {
-	minx = LONTOX(clist->lon) - maxradius;
-	minx = minx < 0 ? 0 : minx;
-	maxx = LONTOX(clist->lon) + maxradius;
-	maxx = maxx >= g_longranularity ? g_longranularity : maxx;
-	miny = LATTOY(clist->lat) - maxradius;
-	miny = miny < 0 ? 0 : miny;
-	maxy = LATTOY(clist->lat) + maxradius;
-	maxy = maxy >= g_latgranularity ? g_latgranularity : maxy;
-	for (y = miny; y < maxy; y++) {
-	    lat = YTOMIDLAT(y);
-	    for (x = minx; x < maxx; x++) {
-		lon = XTOMIDLON(x);
-		/* We measure density at center of cell */
-		thisdensity = bivariate_gaussian_pdf(lon, lat, sigma1, sigma2, rho, clist->lon, clist->lat);
-		matrix[x+y*g_longranularity] += thisdensity;
-	    }
+/* total[k] += weight * (log(value + prior) - log(prior)) over the sparse */
+/* entries of a feature in layout f; returns the number of entries        */
+int f32_accumulate(struct classify_scratch *scratch, struct f32cells *f, struct sparsematrix *sm, float weight, float logprior) {
+    int i, j, k, m;
+    float *total = scratch->totalf;
+    for (j = 0, m = 0; sm[j].x != -1; j++) {
+	if ((k = f->index[sm[j].x + sm[j].y * g_longranularity]) == -1)
+	    continue;
+	if (m == scratch->f32size) {
+	    scratch->f32size *= 2;
+	    scratch->f32pos = realloc(scratch->f32pos, sizeof(int) * scratch->f32size);
+	    scratch->f32value = realloc(scratch->f32value, sizeof(float) * scratch->f32size);
+	    scratch->f32log = realloc(scratch->f32log, sizeof(float) * scratch->f32size);
 	}
+	scratch->f32pos[m] = k;
+	scratch->f32value[m++] = sm[j].value;
     }
+    f32_logs(scratch->f32value, scratch->f32log, m, (float)g_wordprior);
+    for (i = 0; i < m; i++)
+	total[scratch->f32pos[i]] += weight * (scratch->f32log[i] - logprior);
+    return(j);
 }
 
+/* tweet_classify_naivebayes() in single precision (--float32) */
+int tweet_classify_naivebayes_f32(char **words, double *resultmatrix, struct classify_scratch *scratch) {
+    char **w;
+    int c, k, wordindex, tofree, decoded;
+    float *total, weight, weightsum;
+    struct f32cells *f;
+    struct sparsematrix *sm;
+    struct stats *st = &scratch->stats;
+    int64_t t;
+    f = resultmatrix == NULL ? &g_cellcache.f32live : &g_cellcache.f32all;
+    total = classify_scratch_f32(scratch, f->n);
+    memcpy(total, f->logtweets, sizeof(float) * f->n);
+    t = stats_clock();
+    for (w = words, weightsum = 0.0f; *w != NULL; w++) {
+	wordindex = word_lookup(*w);
+	t = stats_lap(&st->lookup_ns, t);
+	st->lookups++;
+	if (wordindex != -1) {
+	    weight = (float)word_get_weight(wordindex);
+	} else if (g_unk) {
+	    weight = 1.0f;
+	    st->lookup_misses++;
+	} else {
+	    st->lookup_misses++;
+	    continue;
+	}
+	if (weight == 0)
+	    continue;
+	weightsum += weight;
+	if (wordindex == -1)
+	    continue; /* Unknown word: only the baseline */
+	sm = word_get_sparsematrix(wordindex, &tofree);
+	t = stats_lap(&st->decode_ns, t);
+	if (sm != NULL) {
+	    decoded = f32_accumulate(scratch, f, sm, weight, (float)g_cellcache.logprior);
+	    st->decodes++;
+	    st->decoded_nonzeros += decoded;
+	    word_release_sparsematrix(wordindex, sm, tofree);
+	}
+	t = stats_lap(&st->score_ns, t);
+    }
+    k = f32_axpy_argmax(total, f->nb_baseline, weightsum, f->n);
+    if (resultmatrix != NULL)
+	for (c = 0; c < g_longranularity * g_latgranularity; c++)
+	    resultmatrix[c] = total[f->index[c]];
+    stats_lap(&st->argmax_ns, t);
+    return(f->cells[k]);
+}
 
-/* Get distance in km between two points */
+/* tweet_classify_kullbackleibler() in single precision (--float32), with */
+/* the scores negated so that the best cell is the maximum                */
+int tweet_classify_kullbackleibler_f32(char **words, double *resultmatrix, struct classify_scratch *scratch) {
+    int c, k, f, nf, tofree, decoded;
+    double ratio, mass, offset;
+    float *total;
+    struct f32cells *fc;
+    struct sparsematrix *sm;
+    struct stats *st = &scratch->stats;
+    int64_t t;
+    t = stats_clock();
+    nf = kl_features(words, scratch);
+    t = stats_lap(&st->lookup_ns, t);
+    fc = resultmatrix == NULL ? &g_cellcache.f32live : &g_cellcache.f32all;
+    total = classify_scratch_f32(scratch, fc->n);
+    memcpy(total, fc->empty, sizeof(float) * fc->n);
+    for (f = 0, mass = 0.0, offset = 0.0; f < nf; f++) {
+	ratio = (double) scratch->featuren[f] / nf;
+	mass += ratio;
+	offset += ratio * log(ratio);
+	sm = word_get_sparsematrix(scratch->featureword[f], &tofree);
+	t = stats_lap(&st->decode_ns, t);
+	if (sm != NULL) {
+	    decoded = f32_accumulate(scratch, fc, sm, (float)ratio, (float)g_cellcache.logprior);
+	    st->decodes++;
+	    st->decoded_nonzeros += decoded;
+	    word_release_sparsematrix(scratch->featureword[f], sm, tofree);
+	}
+	t = stats_lap(&st->score_ns, t);
+    }
+    k = f32_axpy_argmax(total, fc->kl_baseline, (float)-mass, fc->n);
+    if (resultmatrix != NULL)
+	for (c = 0; c < g_longranularity * g_latgranularity; c++)
+	    resultmatrix[c] = total[fc->index[c]] - offset;
+    stats_lap(&st->argmax_ns, t);
+    return(fc->cells[k]);
+}
 
-#define TWOPI 6.283185307179586477
-#define DEG2RAD(x) (((x) * TWOPI/360))
+/* Coordinate we issue for a cell: its centroid (--centroid) or its midpoint */
+void cell_to_latlon(int cell, double *lat, double *lon) {
+    if (g_use_centroid) {
+	*lat = g_centroids[cell].lat;
+	*lon = g_centroids[cell].lon;
+    } else {
+	*lat = YTOMIDLAT(CELLTOY(cell));
+	*lon = XTOMIDLON(CELLTOX(cell));
+    }
+}
 
-double haversine_km(double lat1, double lon1, double lat2, double lon2) {
-    //double R = 6371; // Radius of the earth in km
-    double R = 6372.795;
-    double dlat = DEG2RAD(lat2-lat1);
-    double dlon = DEG2RAD(lon2-lon1);
-    double a = sin(dlat/2) * sin(dlat/2) + cos(DEG2RAD(lat1)) * cos(DEG2RAD(lat2)) * sin(dlon/2) * sin(dlon/2);
-    double c = 2 * atan2(sqrt(a), sqrt(1-a));
-    return (R * c);
+int tweet_classify(char **words, double *tweetsmatrix, double *wordmatrix, double *resultmatrix, struct classify_scratch *scratch) {
+    /* Complement NB and the pyramid search stay in double precision */
+    if (g_float32 && g_kullback_leibler)
+	return(tweet_classify_kullbackleibler_f32(words, resultmatrix, scratch));
+    if (g_float32 && !g_complement_nb && !(g_pyramid.valid && g_pyramid.numlevels > 0 && resultmatrix == NULL))
+	return(tweet_classify_naivebayes_f32(words, resultmatrix, scratch));
+    if (g_kullback_leibler)
+	return(tweet_classify_kullbackleibler(words, tweetsmatrix, wordmatrix, resultmatrix, scratch));
+    return(tweet_classify_naivebayes(words, tweetsmatrix, wordmatrix, resultmatrix, scratch));
 }
 
-/* Density of bivariate gaussian at point x1, x2, given parameters sigma1, sigma2, rho, mu1 (mean), mu2 (mean) */
-double bivariate_gaussian_pdf(double x1, double x2, double sigma1, double sigma2, double rho, double mu1, double mu2) {
-    double z = (x1 - mu1)*(x1 - mu1)/(sigma1 * sigma1) - 2*rho*(x1 - mu1)*(x2 - mu2)/(sigma1 * sigma2) + (x2 - mu2)*(x2 - mu2)/(sigma2 * sigma2);
-    return(1/(TWOPI*sigma1*sigma2*sqrt(1 - rho * rho)) * exp(-(z/(2*(1 - rho * rho)))));
+int compare_double(const void *a, const void *b) {
+       const double *da = (const double *) a;
+       const double *db = (const double *) b;     
+       return (*da > *db) - (*da < *db);
 }
 
-int geoloc_read_model(char *modelfilename, double **tm, double **wm, struct wordhash *iwh) {
-    double *tweetsmatrix, *wordmatrix, value, lat, lon, feature_weight;
-    struct sparsematrix_handle *smh;
-    struct sparsematrix *sm;
-    int i, x, y, index, has_matrix, numelem; 
-    char buf[1024], word[1024];
-    gzFile fp;
+/* Read stopwords and put each word into hash */
+void read_stopwords(char *filename) {
+    FILE *input_file;
+    char line[16384];
+    fprintf(stderr, "Reading stopwords from '%s'...\n", filename);
+    input_file = fopen(filename, "r");
+    if (input_file == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    global_wh_stopwords = wordhash_init(128);
+    while (fgets(line, 16384, input_file)) {
+	strtok(line, "\n");
+	if (strlen(line) > 0) {
+	    wordhash_insert(global_wh_stopwords, line);
+	}
+    }
+    fclose(input_file);
+}
 
-    /* Reconstruct (1) tweetsmatrix (2) centroid positions (3) wordmatrix (4) wordlist */
-    
-    fprintf(stderr, "Reading model from %s...\n", modelfilename);
-    fp = gzopen(modelfilename, "r");
-    gzbuffer(fp, 524288);
-    gzgets(fp, buf, 1024);
-    if (sscanf(buf, "#LONGRANULARITY# %i", &g_longranularity) != 1) { goto infileerr; }
-    g_latgranularity = g_longranularity / 2;
-    fprintf(stderr, "Stored model has %i/%i granularity; grid size = %lg° x %lg°\n", g_longranularity, g_latgranularity, (double)360/g_longranularity, (double)360/g_longranularity);
+/* Single-pass reader for document files: plain or gzipped files, or stdin */
+/* given as "-". Lines are handed out in place in one large buffer and     */
+/* stay valid until the next docreader_release(), so a whole batch of      */
+/* documents can be tokenized and classified without copying.              */
+struct docreader {
+    gzFile fp;
+    char *buf;
+    size_t size;              /* Allocated size of buf, minus room for a final NUL */
+    size_t mark;              /* Start of the oldest line still in use             */
+    size_t pos;               /* Start of the next line                            */
+    size_t end;               /* End of the data read so far                       */
+    int eof;
+};
 
-    gzgets(fp, buf, 1024);
-    
-    /* TWEETMATRIX */
-    if (strncmp("#TWEETMATRIX#", buf, 13) != 0)  { goto infileerr; }
-    tweetsmatrix = matrix_init(0.0);
+struct docreader *docreader_open(char *filename) {
+    struct docreader *r;
+    r = calloc(1, sizeof(struct docreader));
+    if (strcmp(filename, "-") == 0)
+	r->fp = gzdopen(fileno(stdin), "r");
+    else
+	r->fp = gzopen(filename, "r");
+    if (r->fp == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    gzbuffer(r->fp, 131072);
+    r->size = DOCREADER_BUFSIZE;
+    r->buf = malloc(r->size + 1);
+    return(r);
+}
+
+/* Next line (without newline), or NULL at end of input. Also returns     */
+/* NULL early if the buffer is full of lines that are still in use; the   */
+/* caller then releases them and asks again.                              */
+char *docreader_next(struct docreader *r) {
+    char *line, *nl;
+    int n;
     for (;;) {
-	gzgets(fp, buf, 1024);
-	if (buf[0] == '#')
+	if ((nl = memchr(r->buf + r->pos, '\n', r->end - r->pos)) != NULL) {
+	    line = r->buf + r->pos;
+	    *nl = '\0';
+	    r->pos = nl - r->buf + 1;
+	    return(line);
+	}
+	if (r->eof) {
+	    if (r->pos == r->end)
+		return(NULL);
+	    line = r->buf + r->pos; /* Last line has no newline */
+	    r->buf[r->end] = '\0';
+	    r->pos = r->end;
+	    return(line);
+	}
+	if (r->end == r->size) {
+	    if (r->mark < r->pos)
+		return(NULL);
+	    if (r->pos == 0) { /* A single line fills the buffer */
+		r->size *= 2;
+		if ((r->buf = realloc(r->buf, r->size + 1)) == NULL) {
+		    fprintf(stderr, "Out of memory.\n");
+		    exit(EXIT_FAILURE);
+		}
+	    } else {
+		memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+		r->end -= r->pos;
+		r->mark = r->pos = 0;
+	    }
+	}
+	if ((n = gzread(r->fp, r->buf + r->end, r->size - r->end)) < 0) {
+	    fprintf(stderr, "Error reading documents: %s\n", gzerror(r->fp, &n));
+	    exit(EXIT_FAILURE);
+	}
+	if (n == 0)
+	    r->eof = 1;
+	r->end += n;
+    }
+}
+
+/* The caller is done with all lines handed out so far */
+void docreader_release(struct docreader *r) {
+    r->mark = r->pos;
+}
+
+void docreader_close(struct docreader *r) {
+    gzclose(r->fp);
+    free(r->buf);
+    free(r);
+}
+
+/* Tokenize a line in place into its features (NULL-terminated *words,     */
+/* grown as needed), preceded by LAT,LON if haslatlon. Separators are ','  */
+/* and ' ', and like strtok() runs of them count as one.                   */
+int docreader_parse(char *line, int haslatlon, double *lat, double *lon, char ***words, int *wordsarraysize) {
+    char *p, *field;
+    int field_number, numwords;
+    *lat = *lon = 0.0;
+    field_number = haslatlon ? 1 : 3;
+    for (p = line, numwords = 0; ; field_number++) {
+	while (*p == ',' || *p == ' ')
+	    p++;
+	if (*p == '\0')
 	    break;
-	if (sscanf(buf, "%i %i %lg", &x, &y, &value) != 3) { goto infileerr; }
-	tweetsmatrix[x+y*g_longranularity] = value;
+	for (field = p; *p != '\0' && *p != ',' && *p != ' '; p++) { }
+	if (*p != '\0')
+	    *p++ = '\0';
+	if (field_number == 1) {
+	    *lat = strtod(field, NULL);
+	} else if (field_number == 2) {
+	    *lon = strtod(field, NULL);
+	} else {
+	    if (numwords >= *wordsarraysize) {
+		*wordsarraysize = *wordsarraysize == 0 ? WORDSARRAYSIZE : *wordsarraysize * 2;
+		*words = realloc(*words, sizeof(char *) * (*wordsarraysize + 1));
+	    }
+	    (*words)[numwords++] = field;
+	}
     }
-    if (strncmp("#END#", buf, 5) != 0)  { goto infileerr; }
-    
-    gzgets(fp, buf, 1024);
-    /* CENTROIDS */
-    if (strncmp("#CENTROIDS#", buf, 11) != 0)  { goto infileerr; }
-    g_centroids = calloc(g_longranularity * g_latgranularity, sizeof(struct centroids));
-    for (i = 0;;i++) {
-	gzgets(fp, buf, 1024);
-	if (buf[0] == '#')
+    if (*words == NULL) {
+	*wordsarraysize = WORDSARRAYSIZE;
+	*words = malloc(sizeof(char *) * (*wordsarraysize + 1));
+    }
+    (*words)[numwords] = NULL;
+    return(numwords);
+}
+
+struct wordhash *geoloc_index_words(char *filename) {
+    struct docreader *r;
+    struct wordhash *iwh;
+    char *line, **words = NULL;
+    int i, numwords, inserted, wordsarraysize = 0;
+    double lat, lon;
+    r = docreader_open(filename);
+    iwh = wordhash_init(128);
+    while ((line = docreader_next(r)) != NULL) {
+	numwords = docreader_parse(line, 0, &lat, &lon, &words, &wordsarraysize);
+	for (i = 0; i < numwords; i++)
+	    wordhash_find_or_insert(iwh, words[i], &inserted);
+	docreader_release(r);
+    }
+    free(words);
+    docreader_close(r);
+    return(iwh);
+}
+
+/* Dev/train documents for --tune stay in memory: each one is a single    */
+/* allocation holding its feature pointers followed by its line           */
+struct devtraindata *geoloc_read_data(char *filename) {
+    struct docreader *r;
+    struct devtraindata *data_head = NULL, **tail, *data;
+    char *line, *copy, **words = NULL;
+    int i, numwords, wordsarraysize = 0;
+    size_t len;
+    double lat, lon;
+
+    r = docreader_open(filename);
+    for (tail = &data_head; (line = docreader_next(r)) != NULL; tail = &data->next) {
+	len = strlen(line) + 1;
+	numwords = docreader_parse(line, 1, &lat, &lon, &words, &wordsarraysize);
+	data = malloc(sizeof(struct devtraindata) + sizeof(char *) * (numwords + 1) + len);
+	data->words = (char **) (data + 1);
+	copy = (char *) (data->words + numwords + 1);
+	memcpy(copy, line, len);
+	for (i = 0; i < numwords; i++)
+	    data->words[i] = copy + (words[i] - line);
+	data->words[numwords] = NULL;
+	data->lat = lat;
+	data->lon = lon;
+	data->next = NULL;
+	*tail = data;
+	docreader_release(r);
+    }
+    free(words);
+    docreader_close(r);
+    return(data_head);
+}
+
+/* Documents are read in batches by the main thread, classified by a pool */
+/* of --threads workers that each own their scratch space, and then       */
+/* written out in input order                                             */
+struct docbatch {
+    struct document *docs;
+    int size;
+    int numdocs;
+    int next;                 /* Next document to be picked up by a worker */
+    pthread_mutex_t lock;
+    double *tweetsmatrix;
+    double *wordmatrix;
+    struct classify_scratch **scratch;
+};
+
+struct docbatch_worker {
+    struct docbatch *batch;
+    int thread;
+};
+
+#define DOCBATCHSIZE 1024      /* Documents per thread in a batch */
+
+/* A batch of size documents, or of a size that suits g_threads if size is 0 */
+struct docbatch *docbatch_init_size(double *tweetsmatrix, double *wordmatrix, int size) {
+    struct docbatch *batch;
+    int i;
+    batch = calloc(1, sizeof(struct docbatch));
+    /* Keep batches short when each document carries a whole grid */
+    if (size > 0)
+	batch->size = size;
+    else
+	batch->size = g_print_matrix || g_print_topk ? 2 * g_threads : DOCBATCHSIZE * g_threads;
+    batch->docs = calloc(batch->size, sizeof(struct document));
+    for (i = 0; i < batch->size; i++) {
+	batch->docs[i].wordsarraysize = WORDSARRAYSIZE;
+	batch->docs[i].words = malloc(sizeof(char *) * (WORDSARRAYSIZE + 1));
+	batch->docs[i].resultmatrix = g_print_matrix || g_print_topk ? matrix_init(0.0) : NULL;
+    }
+    batch->scratch = malloc(sizeof(struct classify_scratch *) * g_threads);
+    for (i = 0; i < g_threads; i++)
+	batch->scratch[i] = classify_scratch_init();
+    pthread_mutex_init(&batch->lock, NULL);
+    batch->tweetsmatrix = tweetsmatrix;
+    batch->wordmatrix = wordmatrix;
+    return(batch);
+}
+
+struct docbatch *docbatch_init(double *tweetsmatrix, double *wordmatrix) {
+    return(docbatch_init_size(tweetsmatrix, wordmatrix, 0));
+}
+
+void docbatch_free(struct docbatch *batch) {
+    int i;
+    for (i = 0; i < batch->size; i++) {
+	free(batch->docs[i].words);
+	free(batch->docs[i].resultmatrix);
+    }
+    for (i = 0; i < g_threads; i++)
+	classify_scratch_free(batch->scratch[i]);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->scratch);
+    free(batch->docs);
+    free(batch);
+}
+
+/* Fill the batch with up to size documents: LAT,LON,feature1,...  */
+/* if haslatlon, otherwise feature1,... Returns number of documents */
+int docbatch_read(struct docbatch *batch, struct docreader *r, int haslatlon) {
+    struct document *doc;
+    char *line;
+    int64_t t;
+    t = stats_clock();
+    docreader_release(r); /* The previous batch is done with its lines */
+    for (batch->numdocs = 0; batch->numdocs < batch->size; batch->numdocs++) {
+	if ((line = docreader_next(r)) == NULL)
 	    break;
-	if (sscanf(buf, "%lg %lg", &lat, &lon) != 2) { goto infileerr; }
-	g_centroids[i].lat = lat;
-	g_centroids[i].lon = lon;
+	doc = batch->docs + batch->numdocs;
+	docreader_parse(line, haslatlon, &doc->lat, &doc->lon, &doc->words, &doc->wordsarraysize);
     }
-    if (strncmp("#END#", buf, 5) != 0)  { goto infileerr; }
-    
-    /* WORDS */
-    global_wh_train = wordhash_init(128);
+    /* Workers aren't running, so the first thread's counters are free to use */
+    stats_lap(&batch->scratch[0]->stats.tokenize_ns, t);
+    batch->next = 0;
+    return(batch->numdocs);
+}
+
+/* Copies the next (up to batch size) in-memory documents into the batch */
+int docbatch_fill(struct docbatch *batch, struct devtraindata **data) {
+    struct document *doc;
+    int n;
+    for (batch->numdocs = 0; batch->numdocs < batch->size && *data != NULL; batch->numdocs++, *data = (*data)->next) {
+	doc = batch->docs + batch->numdocs;
+	for (n = 0; (*data)->words[n] != NULL; n++) { }
+	if (n > doc->wordsarraysize) {
+	    doc->wordsarraysize = n;
+	    doc->words = realloc(doc->words, sizeof(char *) * (n + 1));
+	}
+	memcpy(doc->words, (*data)->words, sizeof(char *) * (n + 1));
+	doc->lat = (*data)->lat;
+	doc->lon = (*data)->lon;
+    }
+    batch->next = 0;
+    return(batch->numdocs);
+}
+
+void *docbatch_worker(void *arg) {
+    struct docbatch_worker *worker = arg;
+    struct docbatch *batch = worker->batch;
+    struct document *doc;
+    struct classify_scratch *scratch = batch->scratch[worker->thread];
+    int d, e, n, step;
+    int64_t t;
+    /* Groups of documents go to the batched kernel when plain Naive Bayes is all we need */
+    step = g_batch > 1 && !g_float32 && !g_kullback_leibler && !g_complement_nb && batch->docs[0].resultmatrix == NULL && !g_pyramid.valid && g_ensemble == NULL ? g_batch : 1;
     for (;;) {
-	gzgets(fp, buf, 1024);
-	if (strncmp("#END#", buf, 5) == 0)
+	pthread_mutex_lock(&batch->lock);
+	d = batch->next;
+	batch->next += step;
+	pthread_mutex_unlock(&batch->lock);
+	if (d >= batch->numdocs)
 	    break;
-	numelem = sscanf(buf, "#WORD# %i %s %lf", &index, word, &feature_weight);
-	if (numelem != 2 && numelem != 3) { goto infileerr; }
-	if (numelem == 2)
-	    feature_weight = 1.0;
-	g_wordtypes++;
-	if (iwh != NULL && wordhash_find(iwh, word) == -1) {
-	    //fprintf(stderr, "SKIP: %s\n", word);
-	    for (;;) {
-		gzgets(fp, buf, 1024);
-		if (strncmp("#END#", buf, 5) == 0)
-		    break;
-	    }
-	} else {
-	    //fprintf(stderr, "READ: %s\n", word);
-	    word_coord_add_word(word, 0.0, 0.0, 1); /* Add entry, and if coords are provided, add those below */
-	    word_coord_set_weight(word, feature_weight);
-	    for (;;) {
-		gzgets(fp, buf, 1024);
-		if (strncmp("#MATRIX#", buf, 8) == 0) {
-		    has_matrix = 1;
-		    break;
-		}
-		if (strncmp("#END#", buf, 5) == 0) {
-		    has_matrix = 0;
-		    break;
+	doc = batch->docs + d;
+	n = d + step <= batch->numdocs ? step : batch->numdocs - d;
+	t = stats_clock();
+	if (g_ensemble != NULL)
+	    ensemble_score(g_ensemble, d, scratch);
+	else if (step > 1)
+	    tweet_classify_naivebayes_batch(doc, n, scratch);
+	else
+	    doc->cell = tweet_classify(doc->words, batch->tweetsmatrix, batch->wordmatrix, doc->resultmatrix, scratch);
+	if (g_stats && g_ensemble != NULL)
+	    ensemble_scored(g_ensemble, d, stats_clock() - t, scratch);
+	else if (g_stats) /* Documents scored together share the latency of their group */
+	    for (t = (stats_clock() - t) / n, e = 0; e < n; e++)
+		stats_document(&scratch->stats, t);
+    }
+    return(NULL);
+}
+
+/* Classify the batch with the current model */
+void docbatch_run(struct docbatch *batch) {
+    pthread_t *threads;
+    struct docbatch_worker *workers, single;
+    int t;
+    if (g_threads == 1) {
+	single.batch = batch;
+	single.thread = 0;
+	docbatch_worker(&single);
+	return;
+    }
+    threads = malloc(sizeof(pthread_t) * g_threads);
+    workers = malloc(sizeof(struct docbatch_worker) * g_threads);
+    for (t = 0; t < g_threads; t++) {
+	workers[t].batch = batch;
+	workers[t].thread = t;
+	if (pthread_create(threads + t, NULL, docbatch_worker, workers + t) != 0) {
+	    fprintf(stderr, "ERROR: could not create thread\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    for (t = 0; t < g_threads; t++)
+	pthread_join(threads[t], NULL);
+    free(threads);
+    free(workers);
+}
+
+void docbatch_classify(struct docbatch *batch) {
+    if (g_ensemble != NULL)
+	ensemble_classify(batch);
+    else
+	docbatch_run(batch);
+}
+
+/* --print-matrix=binary writes one frame per document: a 16-byte header */
+/* of "GLMX" and three int32 (longranularity, latgranularity, the cell of */
+/* the estimate), followed by the normalized probability of every cell as */
+/* float32, in the same order as the text output. All little-endian.      */
+static inline uint32_t uint32_le(uint32_t u) {
+    const union { uint32_t u; unsigned char c[4]; } probe = { 1 };
+    if (probe.c[0] == 1)
+	return(u);
+    return((u >> 24) | ((u >> 8) & 0xff00) | ((u << 8) & 0xff0000) | (u << 24));
+}
+
+void print_matrix_binary(FILE *out, double *resultmatrix, int cell, uint32_t *frame) {
+    union { float f; uint32_t u; } v;
+    int c, cells;
+    cells = g_longranularity * g_latgranularity;
+    memcpy(frame, "GLMX", 4);
+    frame[1] = uint32_le((uint32_t)g_longranularity);
+    frame[2] = uint32_le((uint32_t)g_latgranularity);
+    frame[3] = uint32_le((uint32_t)cell);
+    for (c = 0; c < cells; c++) {
+	v.f = (float)resultmatrix[c];
+	frame[4 + c] = uint32_le(v.u);
+    }
+    fwrite(frame, sizeof(uint32_t), 4 + cells, out);
+}
+
+void test_classify(char *filename, double *tweetsmatrix, double *wordmatrix) {
+    struct docreader *r;
+    int d, x, y;
+    double lat_estimate, lon_estimate, *resultmatrix;
+    uint32_t *frame = NULL;
+    struct docbatch *batch;
+    r = docreader_open(filename);
+    batch = docbatch_init(tweetsmatrix, wordmatrix);
+    if (g_print_matrix == PRINT_MATRIX_BINARY)
+	frame = malloc(sizeof(uint32_t) * (4 + g_longranularity * g_latgranularity));
+    while (docbatch_read(batch, r, 0) > 0) {
+	docbatch_classify(batch);
+	for (d = 0; d < batch->numdocs; d++) {
+	    cell_to_latlon(batch->docs[d].cell, &lat_estimate, &lon_estimate);
+	    if (g_print_matrix == PRINT_MATRIX_BINARY) {
+		matrix_normalize_log(batch->docs[d].resultmatrix);
+		print_matrix_binary(stdout, batch->docs[d].resultmatrix, batch->docs[d].cell, frame);
+	    } else if (g_print_matrix) {
+		resultmatrix = batch->docs[d].resultmatrix;
+		matrix_normalize_log(resultmatrix);
+		for (y = 0; y < g_latgranularity; y++) {
+		    for (x = 0; x < g_longranularity; x++) {
+			printf("%lg", resultmatrix[x+y*g_longranularity]);
+			if (x + 1 < g_longranularity)
+			    printf("\t");
+		    }
+		    printf("\n");
 		}
-		if (sscanf(buf, "%lg %lg", &lat, &lon) != 2) { goto infileerr; }
-		/* Add lat lon to word */
-		g_total_wordcount++;
-		word_coord_add_word(word, lat, lon, 0);
+	    } else if (g_print_topk > 0) {
+		printf("%lg,%lg", lat_estimate, lon_estimate);
+		print_topk(stdout, batch->docs[d].resultmatrix, g_print_topk);
+		printf("\n");
+	    } else {
+		printf("%lg,%lg\n", lat_estimate, lon_estimate);
 	    }
-	    if (has_matrix) {
-		smh = sparsematrix_create();
-		for (;;) {
-		    gzgets(fp, buf, 1024);
-		    if (strncmp("#END#", buf, 5) == 0)
-			break;
-		    if (sscanf(buf, "%i %i %lg", &x, &y, &value) != 3) { goto infileerr; }
-		    /* Add x y value to sparsematrix */		
-		    sparsematrix_add(smh, x, y, value);
+	}
+    }
+    free(frame);
+    docbatch_free(batch);
+    docreader_close(r);
+}
+
+/* --tune learns a weight per feature for Naive Bayes, perceptron style: */
+/* the tuning documents are classified in batches by the --threads       */
+/* workers with the weights fixed, then each feature of a misclassified  */
+/* document is nudged up if it puts more mass on the correct cell than   */
+/* on the guessed one, and down if it puts less. The step shrinks every  */
+/* epoch, and tuning stops once the error on the held-out documents (or  */
+/* on the tuning set) no longer improves, keeping the best weights.      */
+/* The batches (the weight updates) have a fixed size, so --threads only */
+/* changes the speed                                                     */
+#define TUNEBATCHSIZE 1024
+
+/* Values of two cells of a sparse matrix, from one pass over its entries */
+void sparsematrix_lookup2(struct sparsematrix *sm, int c1, int c2, double *v1, double *v2) {
+    int j, key, key1, key2, maxkey;
+    key1 = CELLTOX(c1) * g_latgranularity + CELLTOY(c1);
+    key2 = CELLTOX(c2) * g_latgranularity + CELLTOY(c2);
+    maxkey = key1 > key2 ? key1 : key2;
+    *v1 = *v2 = 0.0;
+    for (j = 0; sm[j].x != -1; j++) {
+	key = sm[j].x * g_latgranularity + sm[j].y;
+	if (key == key1)
+	    *v1 = sm[j].value;
+	if (key == key2)
+	    *v2 = sm[j].value;
+	if (key >= maxkey)
+	    break;
+    }
+}
+
+/* Mean error (km) of the current weights on documents in memory */
+double tune_evaluate(struct docbatch *batch, struct devtraindata *data_head) {
+    struct devtraindata *data;
+    struct document *doc;
+    double total = 0.0;
+    int d, n = 0;
+    for (data = data_head; docbatch_fill(batch, &data) > 0; ) {
+	docbatch_classify(batch);
+	for (d = 0; d < batch->numdocs; d++, n++) {
+	    doc = batch->docs + d;
+	    total += haversine_km(doc->lat, doc->lon, YTOMIDLAT(CELLTOY(doc->cell)), XTOMIDLON(CELLTOX(doc->cell)));
+	}
+    }
+    return(n > 0 ? total / n : 0.0);
+}
+
+void geoloc_tune(char *modelfilename, double *tweetsmatrix, double *wordmatrix, struct devtraindata *tune_data, struct devtraindata *heldout_data) {
+    struct devtraindata *data;
+    struct docbatch *batch;
+    struct document *doc;
+    struct sparsematrix *sm;
+    double *bestweights, error, besterror, step, correct_weight, guessed_weight;
+    int epoch, d, i, wordindex, tofree, correct_cell, numwrong, numdocs, numwords, changed;
+    char *tmpfilename;
+
+    g_kullback_leibler = 0;
+    numwords = wc_list_max + 1;
+    bestweights = malloc(sizeof(double) * numwords);
+    for (i = 0; i < numwords; i++)
+	bestweights[i] = wc_list[i].weight;
+    if (heldout_data == NULL)
+	heldout_data = tune_data;
+    batch = docbatch_init_size(tweetsmatrix, wordmatrix, TUNEBATCHSIZE);
+    besterror = tune_evaluate(batch, heldout_data);
+    fprintf(stderr, "Initial held-out mean error: %lg km\n", besterror);
+    for (epoch = 0; epoch < g_tune_epochs; epoch++) {
+	step = g_tune_rate / (1.0 + epoch);
+	for (data = tune_data, numwrong = 0, numdocs = 0, changed = 0; docbatch_fill(batch, &data) > 0; ) {
+	    docbatch_classify(batch);
+	    for (d = 0; d < batch->numdocs; d++) {
+		doc = batch->docs + d;
+		numdocs++;
+		correct_cell = LATLONTOCELL(doc->lat, doc->lon);
+		if (doc->cell == correct_cell)
+		    continue;
+		numwrong++;
+		for (i = 0; doc->words[i] != NULL; i++) {
+		    if ((wordindex = word_lookup(doc->words[i])) == -1 || wc_list[wordindex].weight == 0.0)
+			continue;
+		    if ((sm = word_get_sparsematrix(wordindex, &tofree)) == NULL)
+			continue;
+		    sparsematrix_lookup2(sm, correct_cell, doc->cell, &correct_weight, &guessed_weight);
+		    word_release_sparsematrix(wordindex, sm, tofree);
+		    if (correct_weight == guessed_weight)
+			continue;
+		    wc_list[wordindex].weight += correct_weight > guessed_weight ? step : -step;
+		    if (wc_list[wordindex].weight < 0.0)
+			wc_list[wordindex].weight = 0.0;
+		    changed++;
 		}
-		sparsematrix_add(smh, -1, -1, 0.0);
-		sm = sparsematrix_close(smh);
-		word_coord_add_sparsematrix(word, sm);
-	    } 
+	    }
+	}
+	error = tune_evaluate(batch, heldout_data);
+	fprintf(stderr, "Epoch %i: %i/%i tuning documents misclassified, %i weight updates (step %lg), held-out mean error: %lg km\n", epoch + 1, numwrong, numdocs, changed, step, error);
+	if (error >= besterror) {
+	    fprintf(stderr, "No improvement, stopping\n");
+	    break;
 	}
+	besterror = error;
+	for (i = 0; i < numwords; i++)
+	    bestweights[i] = wc_list[i].weight;
     }
-    
-    /* WORDMATRIX */
-    gzgets(fp, buf, 1024);
-    if (strncmp("#WORDMATRIX#", buf, 12) != 0) { goto infileerr; }
-    wordmatrix = matrix_init(0.0);
+    for (i = 0; i < numwords; i++)
+	wc_list[i].weight = bestweights[i];
+    docbatch_free(batch);
+    free(bestweights);
+
+    /* Every word of the model is written back, whatever the threshold */
+    g_threshold = 1;
+    tmpfilename = malloc(strlen(modelfilename) + 5);
+    sprintf(tmpfilename, "%s.tmp", modelfilename);
+    geoloc_write_model(tmpfilename, tweetsmatrix, wordmatrix);
+    modelindex_rename(tmpfilename, modelfilename);
+    free(tmpfilename);
+    fprintf(stderr, "Wrote tuned model to '%s' (held-out mean error %lg km).\n", modelfilename, besterror);
+}
+
+/* Parses a comma-separated list of numbers (--prior, --sigma), returns the count */
+int parse_number_list(char *arg, double **values) {
+    char *s, *end;
+    int n;
+    free(*values);
+    *values = NULL;
+    for (n = 0, s = arg; ; s = end + 1) {
+	*values = realloc(*values, sizeof(double) * (n + 1));
+	(*values)[n++] = strtod(s, &end);
+	if (end == s || (*end != ',' && *end != '\0')) {
+	    fprintf(stderr, "Invalid number list '%s'\n", arg);
+	    exit(EXIT_FAILURE);
+	}
+	if (*end == '\0')
+	    return(n);
+    }
+}
+
+/* Prints the error summary of an evaluation and returns the median (sorts results) */
+double evaluate_report(double *results, int n, double totaldistance) {
+    double median;
+    qsort(results, n, sizeof(double), compare_double);
+    median = (n % 2 == 0) ? (results[n/2] + results[n/2 - 1])/2 : results[n/2];
+    printf("--------------------------\nDATA POINTS: %i\n", n);
+    printf("MEAN DISTANCE: %lg\n", totaldistance/(double)n);
+    printf("MEDIAN DISTANCE: %lg\n--------------------------\n", median);
+    return(median);
+}
+
+void test_evaluate(char *filename, double *tweetsmatrix, double *wordmatrix) {
+    struct docreader *r;
+    int d, j, line_number, resultsize = 1024;
+    double lat_estimate, lon_estimate, distance, totaldistance = 0.0, *results;
+    struct docbatch *batch;
+    struct document *doc;
+    r = docreader_open(filename);
+    results = malloc(resultsize * sizeof(double));
+    batch = docbatch_init(tweetsmatrix, wordmatrix);
+    for (line_number = 1, j = 0; docbatch_read(batch, r, 1) > 0; ) {
+	docbatch_classify(batch);
+	for (d = 0; d < batch->numdocs; d++, line_number++) {
+	    doc = batch->docs + d;
+	    cell_to_latlon(doc->cell, &lat_estimate, &lon_estimate);
+	    distance = haversine_km(doc->lat, doc->lon, lat_estimate, lon_estimate);
+	    if (j == resultsize) {
+		resultsize *= 2;
+		results = realloc(results, resultsize * sizeof(double));
+	    }
+	    results[j] = distance;
+	    j++;
+	    totaldistance += distance;
+	    if (line_number % 100 == 0)
+		printf("%i: %lg,%lg\t%lg\t%i\trunning mean: %lg\n", line_number, lat_estimate, lon_estimate, distance, doc->cell, totaldistance/(double)line_number);
+	}
+    }
+    evaluate_report(results, j, totaldistance);
+    docbatch_free(batch);
+    free(results);
+    docreader_close(r);
+}
+
+/* --sweep evaluates the held-out set, read once, under every combination */
+/* of the --sigma and --prior lists and the classifiers, scoring each     */
+/* estimate both at the cell center and at its centroid. For each sigma   */
+/* the word matrices are re-estimated from the stored coordinates by a    */
+/* pool of --threads workers: all words contribute to the wordmatrix, but */
+/* only the held-out words keep a matrix. p(c) stays the model's own.     */
+/* As in training, words are added to the wordmatrix in word order, so    */
+/* the results don't depend on --threads                                  */
+#define SWEEP_NB 1
+#define SWEEP_KL 2
+
+struct sweeppool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;       /* A word was added to the wordmatrix */
+    int next;
+    int numwords;
+    int summed;                /* Words added to wordmatrix so far   */
+    char *needed;              /* Words that occur in the held-out set */
+    double *wordmatrix;
+};
+
+struct sweeppool_worker {
+    struct sweeppool *pool;
+};
+
+void *sweeppool_worker(void *arg) {
+    struct sweeppool_worker *worker = arg;
+    struct sweeppool *pool = worker->pool;
+    double *w;
+    int i;
+    w = matrix_init(0.0);
     for (;;) {
-	gzgets(fp, buf, 1024);
-	if (buf[0] == '#')
+	pthread_mutex_lock(&pool->lock);
+	i = pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	if (i >= pool->numwords)
 	    break;
-	if (sscanf(buf, "%i %i %lg", &x, &y, &value) != 3) { goto infileerr; }
-	wordmatrix[x+y*g_longranularity] = value;
+	if (g_binmodel == NULL && g_modelindex != NULL && !__atomic_load_n(&wc_list[i].loaded, __ATOMIC_ACQUIRE))
+	    modelindex_load_word(i);
+	matrix_set(w, 0.0);
+	word_matrix_from_coords(w, i);
+	if (pool->needed[i])
+	    g_sweepmatrices[i] = matrix_to_sparsematrix(w);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->summed != i)
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	matrix_add(w, pool->wordmatrix); /* Only the worker whose turn it is writes */
+	pthread_mutex_lock(&pool->lock);
+	pool->summed++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
     }
-    fprintf(stderr, "Done...\n");
-    fprintf(stderr, "Number of word types in model: %i\n", g_wordtypes);
-    fprintf(stderr, "Number of word tokens in model: %i\n", g_total_wordcount);
-    *tm = tweetsmatrix;
-    *wm = wordmatrix;
-    return(1);
- infileerr:
-    fprintf(stderr, "File error reading model\n");
-    return(0);
+    free(w);
+    return(NULL);
 }
 
-/* Writes a model to a file: assumes tweetsmatrix and wordmatrix are available */
-/* Fetches words and coordinates from */
-void geoloc_write_model(char *modelfilename, double *tweetsmatrix, double *wordmatrix) {
-    gzFile fp;
-    int i, j;
-    struct sparsematrix *sm;
-    struct coordinate_list *cl;
+/* Re-estimates the word matrices and wordmatrix (in place) with sigma */
+void sweep_reestimate(double sigma, char *needed, int numwords, double *wordmatrix) {
+    struct sweeppool pool;
+    struct sweeppool_worker *workers;
+    pthread_t *threads;
+    int i, t;
+    fprintf(stderr, "Re-estimating word matrices with sigma %lg...\n", sigma);
+    g_sigma = sigma;
+    for (i = 0; i < numwords; i++) {
+	free(g_sweepmatrices[i]);
+	g_sweepmatrices[i] = NULL;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.next = 0;
+    pool.numwords = numwords;
+    pool.summed = 0;
+    pool.needed = needed;
+    pool.wordmatrix = wordmatrix;
+    matrix_set(wordmatrix, 0.0);
+    threads = malloc(sizeof(pthread_t) * g_threads);
+    workers = malloc(sizeof(struct sweeppool_worker) * g_threads);
+    for (t = 0; t < g_threads; t++) {
+	workers[t].pool = &pool;
+	if (pthread_create(threads + t, NULL, sweeppool_worker, workers + t) != 0) {
+	    fprintf(stderr, "ERROR: could not create thread\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    for (t = 0; t < g_threads; t++)
+	pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    free(threads);
+    free(workers);
+    g_cellcache.wordprior = -1.0; /* The normalizers depend on the wordmatrix */
+}
+
+struct sweepresult {
+    double sigma;              /* -1 = the model's own matrices */
+    double prior;
+    int classifier;
+    int centroid;
+    double mean;
+    double median;
+};
+
+void geoloc_sweep(char *filename, double *tweetsmatrix, double *wordmatrix, double *priors, int numpriors, double *sigmas, int numsigmas, int classifiers) {
+    struct devtraindata *data_head, *data;
+    struct docbatch *batch;
+    struct document *doc;
+    struct sweepresult *table, *best;
+    double *results[2], total[2], lat, lon;
+    char *needed = NULL, sigmaname[32];
+    int numdocs, numwords = 0, numresults = 0, s, p, k, d, j, i, pl;
+
+    data_head = geoloc_read_data(filename);
+    for (numdocs = 0, data = data_head; data != NULL; data = data->next)
+	numdocs++;
+    if (numdocs == 0) {
+	fprintf(stderr, "No documents to evaluate in '%s'\n", filename);
+	exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Sweeping %i configurations over %i documents\n", (numsigmas > 0 ? numsigmas : 1) * numpriors * ((classifiers & SWEEP_NB ? 1 : 0) + (classifiers & SWEEP_KL ? 1 : 0)) * 2, numdocs);
+    if (numsigmas > 0) {
+	numwords = g_binmodel != NULL ? g_binmodel->header->wordtypes : (int)wc_list_max + 1;
+	wordmatrix = matrix_copy(wordmatrix); /* A binary model's own is mapped read-only */
+	needed = calloc(numwords, sizeof(char));
+	g_sweepmatrices = calloc(numwords, sizeof(struct sparsematrix *));
+	for (data = data_head; data != NULL; data = data->next)
+	    for (i = 0; data->words[i] != NULL; i++)
+		if ((j = word_lookup(data->words[i])) != -1)
+		    needed[j] = 1;
+    }
+    results[0] = malloc(sizeof(double) * numdocs);
+    results[1] = malloc(sizeof(double) * numdocs);
+    table = malloc(sizeof(struct sweepresult) * (numsigmas > 0 ? numsigmas : 1) * numpriors * 4);
+    batch = docbatch_init(tweetsmatrix, wordmatrix);
+    for (s = 0; s < (numsigmas > 0 ? numsigmas : 1); s++) {
+	if (numsigmas > 0)
+	    sweep_reestimate(sigmas[s], needed, numwords, wordmatrix);
+	for (p = 0; p < numpriors; p++) {
+	    g_wordprior = priors[p];
+	    cellcache_update(tweetsmatrix, wordmatrix);
+	    for (k = SWEEP_NB; k <= SWEEP_KL; k <<= 1) {
+		if (!(classifiers & k))
+		    continue;
+		g_kullback_leibler = k == SWEEP_KL;
+		total[0] = total[1] = 0.0;
+		for (data = data_head, j = 0; docbatch_fill(batch, &data) > 0; ) {
+		    docbatch_classify(batch);
+		    for (d = 0; d < batch->numdocs; d++, j++) {
+			doc = batch->docs + d;
+			lat = YTOMIDLAT(CELLTOY(doc->cell));
+			lon = XTOMIDLON(CELLTOX(doc->cell));
+			results[0][j] = haversine_km(doc->lat, doc->lon, lat, lon);
+			results[1][j] = haversine_km(doc->lat, doc->lon, g_centroids[doc->cell].lat, g_centroids[doc->cell].lon);
+			total[0] += results[0][j];
+			total[1] += results[1][j];
+		    }
+		}
+		for (pl = 0; pl < 2; pl++) {
+		    if (numsigmas > 0)
+			snprintf(sigmaname, sizeof(sigmaname), "%lg", sigmas[s]);
+		    else
+			strcpy(sigmaname, "model");
+		    printf("SIGMA: %s PRIOR: %lg CLASSIFIER: %s PLACEMENT: %s\n", sigmaname, priors[p], k == SWEEP_KL ? "kl" : "nb", pl ? "centroid" : "center");
+		    table[numresults].sigma = numsigmas > 0 ? sigmas[s] : -1.0;
+		    table[numresults].prior = priors[p];
+		    table[numresults].classifier = k;
+		    table[numresults].centroid = pl;
+		    table[numresults].mean = total[pl] / numdocs;
+		    table[numresults].median = evaluate_report(results[pl], numdocs, total[pl]);
+		    numresults++;
+		}
+	    }
+	}
+    }
+    /* One line per configuration, best median error marked */
+    for (i = 1, best = table; i < numresults; i++)
+	if (table[i].median < best->median)
+	    best = table + i;
+    printf("sigma\tprior\tclassifier\tplacement\tmean\tmedian\n");
+    for (i = 0; i < numresults; i++) {
+	if (table[i].sigma < 0.0)
+	    printf("model");
+	else
+	    printf("%lg", table[i].sigma);
+	printf("\t%lg\t%s\t%s\t%lg\t%lg%s\n", table[i].prior, table[i].classifier == SWEEP_KL ? "kl" : "nb", table[i].centroid ? "centroid" : "center", table[i].mean, table[i].median, table + i == best ? "\tbest" : "");
+    }
+    docbatch_free(batch);
+    if (g_sweepmatrices != NULL) {
+	for (i = 0; i < numwords; i++)
+	    free(g_sweepmatrices[i]);
+	free(g_sweepmatrices);
+	g_sweepmatrices = NULL;
+	free(wordmatrix);
+    }
+    for (data = data_head; data != NULL; data = data_head) {
+	data_head = data->next;
+	free(data);
+    }
+    free(needed);
+    free(results[0]);
+    free(results[1]);
+    free(table);
+}
+
+/* Writes the k most likely cells of a classification, as normalized     */
+/* log-probabilities: "\tLAT,LON,LOGPROB" per cell, most likely first    */
+void print_topk(FILE *out, double *resultmatrix, int k) {
+    int c, i, *best;
+    double max, sum, lognorm, lat, lon;
+    best = malloc(sizeof(int) * k);
+    for (i = 0; i < k; i++)
+	best[i] = -1;
+    for (c = 0, max = -DBL_MAX; c < g_longranularity * g_latgranularity; c++) {
+	if (resultmatrix[c] > max)
+	    max = resultmatrix[c];
+	/* Insertion into the (short) sorted list of best cells */
+	if (best[k-1] != -1 && resultmatrix[c] <= resultmatrix[best[k-1]])
+	    continue;
+	for (i = k - 1; i > 0 && (best[i-1] == -1 || resultmatrix[c] > resultmatrix[best[i-1]]); i--)
+	    best[i] = best[i-1];
+	best[i] = c;
+    }
+    for (c = 0, sum = 0.0; c < g_longranularity * g_latgranularity; c++)
+	sum += exp(resultmatrix[c] - max);
+    lognorm = max + log(sum);
+    for (i = 0; i < k && best[i] != -1; i++) {
+	cell_to_latlon(best[i], &lat, &lon);
+	fprintf(out, "\t%lg,%lg,%lg", lat, lon, resultmatrix[best[i]] - lognorm);
+    }
+    free(best);
+}
+
+/* Read a whole line without its newline into *line, doubling the buffer */
+/* (*size) for long lines like docreader_next(); 0 at end of input        */
+int serve_read_line(FILE *in, char **line, size_t *size) {
+    size_t len;
+    for (len = 0; ; ) {
+	if (fgets(*line + len, *size - len + 1, in) == NULL)
+	    return(len > 0);
+	len += strlen(*line + len);
+	if (len > 0 && (*line)[len-1] == '\n') {
+	    (*line)[len-1] = '\0';
+	    return(1);
+	}
+	if (len < *size)  /* Last line has no newline */
+	    return(1);
+	*size *= 2;
+	if ((*line = realloc(*line, *size + 1)) == NULL) {
+	    fprintf(stderr, "Out of memory.\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+}
+
+/* Server line protocol: read one document (feature1,...,featureN) per line */
+/* and answer each with LAT,LON (and optionally the top-k cells), flushing  */
+/* after every answer so clients can use it interactively. Lines are        */
+/* tokenized with docreader_parse(), exactly as --classify does             */
+void serve_stream(FILE *in, FILE *out, double *tweetsmatrix, double *wordmatrix, double *resultmatrix, char **line, size_t *linesize) {
+    char **words = NULL;
+    int tweet_cell, wordsarraysize = 0;
+    double lat_estimate, lon_estimate;
+    struct classify_scratch *scratch;
+    int64_t t0, lastreport;
+    scratch = classify_scratch_init();
+    lastreport = stats_clock();
+    while (serve_read_line(in, line, linesize)) {
+	t0 = stats_clock();
+	docreader_parse(*line, 0, &lat_estimate, &lon_estimate, &words, &wordsarraysize);
+	stats_lap(&scratch->stats.tokenize_ns, t0);
+	tweet_cell = tweet_classify(words, tweetsmatrix, wordmatrix, resultmatrix, scratch);
+	cell_to_latlon(tweet_cell, &lat_estimate, &lon_estimate);
+	fprintf(out, "%lg,%lg", lat_estimate, lon_estimate);
+	if (g_print_topk > 0)
+	    print_topk(out, resultmatrix, g_print_topk);
+	fprintf(out, "\n");
+	if (g_stats) {
+	    stats_document(&scratch->stats, stats_clock() - t0);
+	    if (g_stats_interval > 0 && stats_clock() - lastreport >= g_stats_interval * 1e9) {
+		stats_merge(&scratch->stats);
+		stats_report("serve");
+		lastreport = stats_clock();
+	    }
+	}
+	if (fflush(out) != 0)
+	    break;
+    }
+    classify_scratch_free(scratch);
+    free(words);
+}
+
+/* Keep the model resident and answer classification requests, either on */
+/* stdin/stdout or on a Unix (--socket) or TCP (--port) socket, where     */
+/* clients are served one connection at a time                            */
+void geoloc_serve(char *socketpath, int port, double *tweetsmatrix, double *wordmatrix) {
+    int listenfd, fd, one = 1;
+    char *line;
+    size_t linesize;
+    double *resultmatrix;
+    FILE *in, *out;
+    struct sockaddr_un addr_un;
+    struct sockaddr_in addr_in;
+
+    linesize = MAX_LINE_SIZE;
+    line = malloc(linesize + 1);
+    resultmatrix = g_print_topk > 0 ? matrix_init(0.0) : NULL;
+    if (socketpath == NULL && port == 0) {
+	fprintf(stderr, "Serving on stdin/stdout\n");
+	serve_stream(stdin, stdout, tweetsmatrix, wordmatrix, resultmatrix, &line, &linesize);
+	free(line);
+	return;
+    }
+    signal(SIGPIPE, SIG_IGN); /* A vanished client must not take the server down */
+    if (socketpath != NULL) {
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr_un, 0, sizeof(addr_un));
+	addr_un.sun_family = AF_UNIX;
+	strncpy(addr_un.sun_path, socketpath, sizeof(addr_un.sun_path) - 1);
+	unlink(socketpath);
+	if (listenfd == -1 || bind(listenfd, (struct sockaddr *) &addr_un, sizeof(addr_un)) == -1) {
+	    perror(socketpath);
+	    exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Serving on Unix socket %s\n", socketpath);
+    } else {
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr_in, 0, sizeof(addr_in));
+	addr_in.sin_family = AF_INET;
+	addr_in.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr_in.sin_port = htons(port);
+	if (listenfd == -1 || bind(listenfd, (struct sockaddr *) &addr_in, sizeof(addr_in)) == -1) {
+	    perror("bind");
+	    exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Serving on TCP port %i\n", port);
+    }
+    if (listen(listenfd, 16) == -1) {
+	perror("listen");
+	exit(EXIT_FAILURE);
+    }
+    for (;;) {
+	if ((fd = accept(listenfd, NULL, NULL)) == -1) {
+	    perror("accept");
+	    continue;
+	}
+	in = fdopen(fd, "r");
+	out = fdopen(dup(fd), "w");
+	serve_stream(in, out, tweetsmatrix, wordmatrix, resultmatrix, &line, &linesize);
+	fclose(in);
+	fclose(out);
+    }
+}
+
+/* Tokenize a training line LAT,LON,FEATURE1,...,FEATUREN in place; the */
+/* features that aren't stopwords are returned in *words                  */
+int training_parse_line(char *line, double *lat, double *lon, char ***words, int *wordsarraysize) {
+    int i, numwords, kept;
+    numwords = docreader_parse(line, 1, lat, lon, words, wordsarraysize);
+    if (global_wh_stopwords == NULL)
+	return(numwords);
+    for (i = 0, kept = 0; i < numwords; i++) {
+	if (wordhash_find(global_wh_stopwords, (*words)[i]) == -1)
+	    (*words)[kept++] = (*words)[i];
+    }
+    (*words)[kept] = NULL;
+    return(kept);
+}
+
+struct sparsematrix_handle *sparsematrix_create() {
+    struct sparsematrix_handle *smh;
+    smh = malloc(sizeof(struct sparsematrix_handle));
+    smh->sm = malloc(128 * sizeof(struct sparsematrix));
+    smh->tail = 0;
+    smh->size = 128;
+    return(smh);
+}
+
+void sparsematrix_add(struct sparsematrix_handle *smh, int x, int y, double value) {
+    if (smh->tail + 1 == smh->size) {
+	smh->sm = realloc(smh->sm, sizeof(struct sparsematrix) * smh->size * 2);
+	smh->size *= 2;
+    }
+    smh->sm[smh->tail].x = (short int)x;
+    smh->sm[smh->tail].y = (short int)y;
+    smh->sm[smh->tail].value = (float)value;
+    smh->tail++;
+}
+
+struct sparsematrix *sparsematrix_close(struct sparsematrix_handle *smh) {
+    struct sparsematrix *sm;
+    smh->sm = realloc(smh->sm, sizeof(struct sparsematrix) * smh->tail);
+    sm = smh->sm;
+    free(smh);
+    return(sm);
+}
+
+double *sparsematrix_to_matrix(struct sparsematrix *sm) {
+    int i;
+    double *matrix;
+    matrix = calloc(g_latgranularity * g_longranularity, sizeof(double));
+    if (matrix == NULL) {
+	fprintf(stderr, "Out of memory.\n");
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; sm[i].x != -1; i++) {
+	matrix[sm[i].x + sm[i].y * g_longranularity] = (double)sm[i].value;
+    }
+    return(matrix);
+}
+
+/* Half-precision <-> float, for the nonnegative values of packed matrices */
+float g_halftofloat[32768];
+
+void halftofloat_init() {
+    int h;
+    for (h = 0; h < 32768; h++)
+	g_halftofloat[h] = (h >> 10) == 0 ? ldexpf((float)h, -24) : ldexpf((float)((h & 0x3ff) | 0x400), (h >> 10) - 25);
+}
+
+uint16_t float_to_half(float f) {
+    union { float f; uint32_t u; } v;
+    uint32_t m, h, rem, half;
+    int exp, shift;
+    v.f = f;
+    exp = (int)((v.u >> 23) & 0xff) - 112; /* Rebias 127 -> 15 */
+    m = v.u & 0x7fffff;
+    if (exp >= 31)
+	return(0x7bff);
+    if (exp <= 0) { /* Subnormal half */
+	if ((shift = 14 - exp) > 24)
+	    return(0);
+	m |= 0x800000;
+    } else {
+	shift = 13;
+	m |= (uint32_t)exp << 23;
+    }
+    /* Round to nearest even; a carry into the exponent is still correct */
+    h = m >> shift;
+    rem = m & ((1u << shift) - 1);
+    half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1)))
+	h++;
+    return((uint16_t)h);
+}
+
+struct packedmatrix *sparsematrix_pack(struct sparsematrix *sm, size_t *size) {
+    struct packedmatrix *pm;
+    struct packedrun *run;
+    uint16_t *values;
+    int j, n, numruns;
+    float max;
+    for (j = 0, numruns = 0, max = 0.0; sm[j].x != -1; j++) {
+	if (j == 0 || sm[j].x != sm[j-1].x || sm[j].y != sm[j-1].y + 1)
+	    numruns++;
+	if (sm[j].value > max)
+	    max = sm[j].value;
+    }
+    n = j;
+    *size = PACKED_SIZE(numruns, n);
+    pm = calloc(1, *size);
+    pm->scale = max > 0.0 ? max : 1.0;
+    pm->numruns = numruns;
+    pm->nonzeros = n;
+    run = PACKED_RUNS(pm) - 1;
+    values = PACKED_VALUES(pm);
+    for (j = 0; j < n; j++) {
+	if (j == 0 || sm[j].x != sm[j-1].x || sm[j].y != sm[j-1].y + 1) {
+	    run++;
+	    run->x = sm[j].x;
+	    run->y = sm[j].y;
+	    run->length = 0;
+	}
+	run->length++;
+	values[j] = float_to_half(sm[j].value / pm->scale);
+    }
+    return(pm);
+}
+
+/* Back to a plain sparse matrix (with sentinel), in the same order */
+struct sparsematrix *packedmatrix_unpack(struct packedmatrix *pm) {
+    struct sparsematrix *sm, *out;
+    struct packedrun *run;
+    uint16_t *values;
+    int r, i;
+    sm = out = malloc(sizeof(struct sparsematrix) * (pm->nonzeros + 1));
+    values = PACKED_VALUES(pm);
+    for (r = 0, run = PACKED_RUNS(pm); r < pm->numruns; r++, run++) {
+	for (i = 0; i < run->length; i++, out++) {
+	    out->x = run->x;
+	    out->y = run->y + i;
+	    out->value = g_halftofloat[*values++] * pm->scale;
+	}
+    }
+    out->x = -1; out->y = -1; out->value = -1.0;
+    return(sm);
+}
+
+double *packedmatrix_to_matrix(struct packedmatrix *pm) {
+    struct packedrun *run;
+    uint16_t *values;
+    double *matrix, *cell;
+    int r, i;
+    matrix = matrix_init(0.0);
+    values = PACKED_VALUES(pm);
+    for (r = 0, run = PACKED_RUNS(pm); r < pm->numruns; r++, run++) {
+	cell = matrix + run->x + run->y * g_longranularity;
+	for (i = 0; i < run->length; i++, cell += g_longranularity)
+	    *cell = (double)(g_halftofloat[*values++] * pm->scale);
+    }
+    return(matrix);
+}
+
+double *word_get_matrix(int wordindex) {
+    double *w;
+    struct sparsematrix *sm;
+    struct packedmatrix *pm;
+    if ((sm = word_stored_sparsematrix(wordindex)) != NULL)
+	return(sparsematrix_to_matrix(sm));
+    if ((pm = word_packed_matrix(wordindex)) != NULL)
+	return(packedmatrix_to_matrix(pm));
+    /* If matrix is not stored, we generate it on the fly */
+    w = matrix_init(0.0);
+    word_matrix_from_coords(w, wordindex);
+    return(w);
+}
+
+/* Sparse matrices computed on the fly for --nomatrix models, or unpacked   */
+/* from --quantize matrices, are kept in an LRU cache bounded by            */
+/* --matrix-cache megabytes, since a few frequent features make up most     */
+/* lookups. Entries in use (refs > 0) aren't evicted.                       */
+struct matrixcache_entry {
+    int word;
+    struct matrixcache_entry **byword; /* Index it is in (one per model of an --ensemble) */
+    int refs;
+    size_t bytes;
+    struct sparsematrix *sm;
+    struct matrixcache_entry *prev, *next; /* Most recently used first */
+};
+
+struct matrixcache {
+    struct matrixcache_entry **byword;
+    struct matrixcache_entry *head, *tail;
+    size_t bytes;
+    long hits, misses, evictions;
+    pthread_mutex_t lock;
+};
+
+struct matrixcache g_matrixcache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void matrixcache_unlink(struct matrixcache_entry *e) {
+    if (e->prev != NULL) e->prev->next = e->next; else g_matrixcache.head = e->next;
+    if (e->next != NULL) e->next->prev = e->prev; else g_matrixcache.tail = e->prev;
+}
+
+void matrixcache_push(struct matrixcache_entry *e) {
+    e->prev = NULL;
+    e->next = g_matrixcache.head;
+    if (g_matrixcache.head != NULL) g_matrixcache.head->prev = e; else g_matrixcache.tail = e;
+    g_matrixcache.head = e;
+}
+
+/* Drop least recently used entries that are not in use until within budget (lock held) */
+void matrixcache_evict() {
+    struct matrixcache_entry *e, *prev;
+    for (e = g_matrixcache.tail; e != NULL && g_matrixcache.bytes > (size_t)g_matrix_cache * 1024 * 1024; e = prev) {
+	prev = e->prev;
+	if (e->refs > 0)
+	    continue;
+	matrixcache_unlink(e);
+	e->byword[e->word] = NULL;
+	g_matrixcache.bytes -= e->bytes;
+	g_matrixcache.evictions++;
+	free(e->sm);
+	free(e);
+    }
+}
+
+void matrixcache_report() {
+    if (g_matrixcache.hits + g_matrixcache.misses == 0)
+	return;
+    fprintf(stderr, "Matrix cache: %li hits, %li misses (%.1f%% hit rate), %li evictions, %.1f MB in use\n", g_matrixcache.hits, g_matrixcache.misses, 100.0 * g_matrixcache.hits / (g_matrixcache.hits + g_matrixcache.misses), g_matrixcache.evictions, g_matrixcache.bytes / 1048576.0);
+}
+
+void stats_report(char *mode) {
+    struct stats *st = &g_stats_total;
+    pthread_mutex_lock(&g_stats_lock);
+    fprintf(stderr, "{\"mode\": \"%s\", \"wall_s\": %.6f, \"model_load_s\": %.6f", mode, (stats_clock() - g_stats_start_ns) / 1e9, g_stats_load_ns / 1e9);
+    if (st->words > 0) {
+	fprintf(stderr, ", \"training\": {\"read_s\": %.6f, \"words\": %" PRId64 ", \"kde_s\": %.6f, \"kde_per_word_us\": %.3f, \"kde_max_us\": %.3f, \"nonzeros\": %" PRId64 ", \"write_s\": %.6f, \"bytes_written\": %" PRId64 "}",
+		st->read_ns / 1e9, st->words, st->kde_ns / 1e9, st->kde_ns / 1e3 / st->words, st->kde_max_ns / 1e3, st->nonzeros, st->write_ns / 1e9, g_stats_bytes_written);
+    }
+    if (st->documents > 0) {
+	fprintf(stderr, ", \"documents\": %" PRId64 ", \"tokenize_s\": %.6f, \"lookup_s\": %.6f, \"lookups\": %" PRId64 ", \"lookup_misses\": %" PRId64, st->documents, st->tokenize_ns / 1e9, st->lookup_ns / 1e9, st->lookups, st->lookup_misses);
+	fprintf(stderr, ", \"decode_s\": %.6f, \"decodes\": %" PRId64 ", \"decoded_nonzeros\": %" PRId64 ", \"score_s\": %.6f, \"argmax_s\": %.6f", st->decode_ns / 1e9, st->decodes, st->decoded_nonzeros, st->score_ns / 1e9, st->argmax_ns / 1e9);
+	fprintf(stderr, ", \"latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}", st->latency_ns / 1e3 / st->documents, stats_percentile(st, 0.5), stats_percentile(st, 0.99), st->latency_max_ns / 1e3);
+	fprintf(stderr, ", \"matrix_cache\": {\"hits\": %li, \"misses\": %li, \"evictions\": %li}", g_matrixcache.hits, g_matrixcache.misses, g_matrixcache.evictions);
+    }
+    fprintf(stderr, "}\n");
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+/* Like word_get_matrix, but returns the sparse form without densifying it. */
+/* If the matrix is not stored it is generated on the fly, and *tofree is   */
+/* set to tell the caller to hand it back with word_release_sparsematrix()  */
+struct sparsematrix *word_get_sparsematrix(int wordindex, int *tofree) {
+    double *w;
+    struct sparsematrix *sm;
+    struct packedmatrix *pm;
+    struct matrixcache_entry *e;
+    int n;
+    if ((sm = word_stored_sparsematrix(wordindex)) != NULL) {
+	*tofree = 0;
+	return(sm);
+    }
+    *tofree = 1;
+    if (g_matrix_cache > 0) {
+	pthread_mutex_lock(&g_matrixcache.lock);
+	if (g_matrixcache.byword == NULL)
+	    g_matrixcache.byword = calloc(g_binmodel != NULL ? g_binmodel->header->wordtypes + 1 : wc_list_max + 1, sizeof(struct matrixcache_entry *));
+	if ((e = g_matrixcache.byword[wordindex]) != NULL) {
+	    g_matrixcache.hits++;
+	    e->refs++;
+	    matrixcache_unlink(e);
+	    matrixcache_push(e);
+	    pthread_mutex_unlock(&g_matrixcache.lock);
+	    return(e->sm);
+	}
+	g_matrixcache.misses++;
+	pthread_mutex_unlock(&g_matrixcache.lock);
+    }
+    /* Compute outside the lock; another thread may be doing the same word */
+    if ((pm = word_packed_matrix(wordindex)) != NULL) {
+	sm = packedmatrix_unpack(pm);
+    } else {
+	w = word_get_matrix(wordindex);
+	sm = matrix_to_sparsematrix(w);
+	free(w);
+    }
+    if (g_matrix_cache > 0) {
+	pthread_mutex_lock(&g_matrixcache.lock);
+	if ((e = g_matrixcache.byword[wordindex]) != NULL) {
+	    free(sm);
+	    e->refs++;
+	    sm = e->sm;
+	} else {
+	    for (n = 0; sm[n].x != -1; n++) { }
+	    e = malloc(sizeof(struct matrixcache_entry));
+	    e->word = wordindex;
+	    e->byword = g_matrixcache.byword;
+	    e->refs = 1;
+	    e->sm = sm;
+	    e->bytes = sizeof(struct sparsematrix) * (n + 1) + sizeof(struct matrixcache_entry);
+	    g_matrixcache.byword[wordindex] = e;
+	    g_matrixcache.bytes += e->bytes;
+	    matrixcache_push(e);
+	    matrixcache_evict();
+	}
+	pthread_mutex_unlock(&g_matrixcache.lock);
+    }
+    return(sm);
+}
+
+/* Gives back a matrix from word_get_sparsematrix() with *tofree set */
+void word_release_sparsematrix(int wordindex, struct sparsematrix *sm, int tofree) {
+    struct matrixcache_entry *e;
+    if (!tofree)
+	return;
+    if (g_matrix_cache <= 0) {
+	free(sm);
+	return;
+    }
+    pthread_mutex_lock(&g_matrixcache.lock);
+    e = g_matrixcache.byword[wordindex];
+    if (--e->refs == 0 && g_matrixcache.bytes > (size_t)g_matrix_cache * 1024 * 1024)
+	matrixcache_evict();
+    pthread_mutex_unlock(&g_matrixcache.lock);
+}
+
+struct sparsematrix *matrix_to_sparsematrix(double *matrix) {
+    int i, x, y, cellcount;
+    struct sparsematrix *sm;
+    for (i = 0, cellcount = 0; i < g_latgranularity * g_longranularity; i++)
+	if (matrix[i] != 0.0)
+	    cellcount++;
+    sm = malloc(sizeof(struct sparsematrix) * (cellcount + 1));
+    
+    for (x = 0, i = 0; x < g_longranularity; x++) {
+	for (y = 0; y < g_latgranularity; y++) {
+	    if (matrix[x+y*g_longranularity] != 0.0) {
+		sm[i].x = (short int)x;
+		sm[i].y = (short int)y;
+		sm[i].value = (float)matrix[x+y*g_longranularity];
+		i++;
+	    }
+	}
+    }
+    sm[i].x = -1; sm[i].y = -1; sm[i].value = -1.0;
+    return(sm);
+}
+
+/* Normalizes a matrix in logspace and converts to reals */
+void matrix_normalize_log(double *matrix) {
+    int c;
+    double max, sum;
+    max = -DBL_MAX;
+    for (c = 0; c < g_longranularity * g_latgranularity; c++) {
+	if (matrix[c] > max)
+	    max = matrix[c];
+    }
+    for (c = 0, sum = 0; c < g_longranularity * g_latgranularity; c++) {
+	matrix[c] = exp(matrix[c] - max);
+	sum += matrix[c];
+    }
+    for (c = 0; c < g_longranularity * g_latgranularity; c++) {
+	matrix[c] /= sum;
+    }
+}
+
+void matrix_set(double *matrix, double value) {
+    int i;
+    for (i = 0; i < g_latgranularity * g_longranularity ; i++) {
+	matrix[i] = value;
+    }
+}
+
+double *matrix_init(double prior) {
+    double *matrix;
+    matrix = malloc(g_latgranularity * g_longranularity * sizeof(double));
+    matrix_set(matrix, prior);
+    return(matrix);
+}
+
+double *matrix_copy(double *matrix1) {
+    int i;
+    double *matrix2;
+    matrix2 = matrix_init(0.0);
+    for (i = 0; i <  g_latgranularity * g_longranularity; i++) {
+        matrix2[i] = matrix1[i];
+    }
+    return(matrix2);
+}
+
+double matrix_sum(double *matrix) {
+    int i;
+    double sum;
+    for (i = 0, sum = 0.0; i < g_latgranularity * g_longranularity; i++) {
+	sum += matrix[i];
+    }
+    return(sum);
+}
+void matrix_normalize(double *matrix) {
+    int i;
+    double sum;
+    sum = matrix_sum(matrix);
+    for (i = 0; i <  g_latgranularity * g_longranularity; i++) {
+	matrix[i] /= sum;
+    }
+}
+
+void matrix_add(double *matrix1, double *matrix2) {
+    int i;
+    for (i = 0; i <  g_latgranularity * g_longranularity; i++) {
+	matrix2[i] += matrix1[i];
+    }
+}
+
+/* Find the centroid within each cell for more accurate placement       */
+/* at classification time. Takes a list of coordinates, and returns     */
+/* a matrix of the centroid for each cell                               */
+
+/* Turn per-cell coordinate sums into g_centroids (midpoint for empty cells) */
+void centroids_from_sums(double *lats, double *lons, int *counts) {
+    int cell;
+    g_centroids = calloc(g_latgranularity * g_longranularity, sizeof(struct centroids));
+    g_centroidcounts = malloc(g_latgranularity * g_longranularity * sizeof(int));
+    memcpy(g_centroidcounts, counts, g_latgranularity * g_longranularity * sizeof(int));
+    for (cell = 0; cell < g_longranularity * g_latgranularity; cell++) {
+	if (counts[cell] == 0) {
+	    g_centroids[cell].lat = YTOMIDLAT(CELLTOY(cell));
+	    g_centroids[cell].lon = XTOMIDLON(CELLTOX(cell));
+	} else {
+	    g_centroids[cell].lat = lats[cell]/(double)counts[cell];
+	    g_centroids[cell].lon = lons[cell]/(double)counts[cell];
+	}
+    }
+}
+/* Non-kde version:                                               */
+/* WE just add mass to the matrix for each coordinate in the list */
+void matrix_nokde_from_coords(double * restrict matrix, struct coordinate *pts, int numpoints) {
+    int i;
+    for (i = 0; i < numpoints; i++) {
+	matrix[LONTOX(pts[i].lon)+LATTOY(pts[i].lat)*g_longranularity] += 1.0;
+    }
+}
+
+/* Find out maximum radius (in ticks) we need to take into account for each point */
+/* This is to avoid having to later calculate the density for the whole grid for each point */
+/* We do this by looking at the Gaussian away from the center until the density dips below a point */ 
+int kde_maxradius(double sigma1, double sigma2, double rho) {
+    int x;
+    double thisdensity;
+    for (x = 0;  ; x++) {
+	thisdensity = bivariate_gaussian_pdf((double)x * (360.0/(double)g_longranularity), 0.0, sigma1, sigma2, rho, 0.0, 0.0);
+	if (thisdensity < 0.001)
+	    break;
+    }
+    return(x); /* Maximum radius in ticks worth examining (per degree) */
+}
+
+/* KDE kernel for one matrix: the window radius, and with rho == 0 (which */
+/* is what training always uses) the Gaussian factors into a product of   */
+/* 1-D Gaussians in lon and lat, so each point only needs one weight      */
+/* vector per axis and the window is filled as their outer product.       */
+/* --kde-direct keeps the per-cell bivariate_gaussian_pdf() path anyway,  */
+/* which make check compares against                                     */
+struct kde_kernel {
+    int maxradius;
+    double sigma1;
+    double sigma2;
+    double rho;
+    double *wx;           /* Per-point weights along x (incl. normalization) */
+    double *wy;           /* Per-point weights along y                       */
+};
+
+void kde_kernel_init(struct kde_kernel *k, double sigma1, double sigma2, double rho) {
+    k->maxradius = kde_maxradius(sigma1, sigma2, rho);
+    k->sigma1 = sigma1;
+    k->sigma2 = sigma2;
+    k->rho = rho;
+    k->wx = malloc(sizeof(double) * (2 * k->maxradius + 1));
+    k->wy = malloc(sizeof(double) * (2 * k->maxradius + 1));
+}
+
+void kde_kernel_free(struct kde_kernel *k) {
+    free(k->wx);
+    free(k->wy);
+}
+
+/* row[i] += wy * wx[i]: the inner loop of the outer product, which */
+/* the compiler vectorizes                                          */
+static inline void kde_row_add(double * restrict row, const double * restrict wx, double wy, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+	row[i] += wy * wx[i];
+}
+
+/* Add the density of one point to the cells within maxradius of it */
+void matrix_kde_add_point(double * restrict matrix, double pointlat, double pointlon, struct kde_kernel *k) {
+    double lat, lon, d;
+    int x, y, minx, maxx, miny, maxy;
+    minx = LONTOX(pointlon) - k->maxradius;
+    minx = minx < 0 ? 0 : minx;
+    maxx = LONTOX(pointlon) + k->maxradius;
+    maxx = maxx >= g_longranularity ? g_longranularity : maxx;
+    miny = LATTOY(pointlat) - k->maxradius;
+    miny = miny < 0 ? 0 : miny;
+    maxy = LATTOY(pointlat) + k->maxradius;
+    maxy = maxy >= g_latgranularity ? g_latgranularity : maxy;
+    if (k->rho != 0.0 || g_kde_direct) {
+	for (y = miny; y < maxy; y++) {
+	    lat = YTOMIDLAT(y);
+	    for (x = minx; x < maxx; x++) {
+		lon = XTOMIDLON(x);
+		/* We measure density at center of cell */
+		matrix[x+y*g_longranularity] += bivariate_gaussian_pdf(lon, lat, k->sigma1, k->sigma2, k->rho, pointlon, pointlat);
+	    }
+	}
+	return;
+    }
+    /* Separable case: we still measure density at center of cell */
+    for (x = minx; x < maxx; x++) {
+	d = (XTOMIDLON(x) - pointlon) / k->sigma1;
+	k->wx[x-minx] = exp(-0.5 * d * d) / (TWOPI * k->sigma1 * k->sigma2);
+    }
+    for (y = miny; y < maxy; y++) {
+	d = (YTOMIDLAT(y) - pointlat) / k->sigma2;
+	k->wy[y-miny] = exp(-0.5 * d * d);
+    }
+    for (y = miny; y < maxy; y++)
+	kde_row_add(matrix + minx + y * g_longranularity, k->wx, k->wy[y-miny], maxx - minx);
+}
+
+/* Read list of coordinates (individual points) */
+/* and fill values in a density matrix          */
+void matrix_kde_from_coords(double * restrict matrix, struct coordinate *pts, int numpoints, double sigma1, double sigma2, double rho) {
+    struct kde_kernel k;
+    int i;
+    kde_kernel_init(&k, sigma1, sigma2, rho);
+    for (i = 0; i < numpoints; i++) {
+	matrix_kde_add_point(matrix, pts[i].lat, pts[i].lon, &k);
+    }
+    kde_kernel_free(&k);
+}
+
+
+/* Get distance in km between two points */
+
+#define DEG2RAD(x) (((x) * TWOPI/360))
+
+double haversine_km(double lat1, double lon1, double lat2, double lon2) {
+    //double R = 6371; // Radius of the earth in km
+    double R = 6372.795;
+    double dlat = DEG2RAD(lat2-lat1);
+    double dlon = DEG2RAD(lon2-lon1);
+    double a = sin(dlat/2) * sin(dlat/2) + cos(DEG2RAD(lat1)) * cos(DEG2RAD(lat2)) * sin(dlon/2) * sin(dlon/2);
+    double c = 2 * atan2(sqrt(a), sqrt(1-a));
+    return (R * c);
+}
+
+/* Density of bivariate gaussian at point x1, x2, given parameters sigma1, sigma2, rho, mu1 (mean), mu2 (mean) */
+double bivariate_gaussian_pdf(double x1, double x2, double sigma1, double sigma2, double rho, double mu1, double mu2) {
+    double z = (x1 - mu1)*(x1 - mu1)/(sigma1 * sigma1) - 2*rho*(x1 - mu1)*(x2 - mu2)/(sigma1 * sigma2) + (x2 - mu2)*(x2 - mu2)/(sigma2 * sigma2);
+    return(1/(TWOPI*sigma1*sigma2*sqrt(1 - rho * rho)) * exp(-(z/(2*(1 - rho * rho)))));
+}
+
+int geoloc_read_model(char *modelfilename, double **tm, double **wm, struct wordhash *iwh) {
+    double *tweetsmatrix, *wordmatrix, value, lat, lon, feature_weight;
+    struct sparsematrix_handle *smh;
+    struct sparsematrix *sm;
+    int i, x, y, index, wordindex, has_matrix, hascounts, numelem; 
+    char buf[1024], word[1024];
+    size_t packedsize, packedbytes = 0, plainbytes = 0;
+    gzFile fp;
+
+    if (binmodel_is_binary(modelfilename))
+	return(geoloc_read_model_bin(modelfilename, tm, wm));
+
+    /* Reconstruct (1) tweetsmatrix (2) centroid positions (3) wordmatrix (4) wordlist */
+    
+    fprintf(stderr, "Reading model from %s...\n", modelfilename);
+    fp = gzopen(modelfilename, "r");
+    gzbuffer(fp, 524288);
+    gzgets(fp, buf, 1024);
+    if (sscanf(buf, "#LONGRANULARITY# %i", &g_longranularity) != 1) { goto infileerr; }
+    g_latgranularity = g_longranularity / 2;
+    fprintf(stderr, "Stored model has %i/%i granularity; grid size = %lg° x %lg°\n", g_longranularity, g_latgranularity, (double)360/g_longranularity, (double)360/g_longranularity);
+
+    gzgets(fp, buf, 1024);
+    
+    /* TWEETMATRIX */
+    if (strncmp("#TWEETMATRIX#", buf, 13) != 0)  { goto infileerr; }
+    if (sscanf(buf + 13, "%lg", &g_tweetmass) != 1)
+	g_tweetmass = 0.0; /* Older model without the p(c) mass */
+    tweetsmatrix = matrix_init(0.0);
+    for (;;) {
+	gzgets(fp, buf, 1024);
+	if (buf[0] == '#')
+	    break;
+	if (sscanf(buf, "%i %i %lg", &x, &y, &value) != 3) { goto infileerr; }
+	tweetsmatrix[x+y*g_longranularity] = value;
+    }
+    if (strncmp("#END#", buf, 5) != 0)  { goto infileerr; }
+    
+    gzgets(fp, buf, 1024);
+    /* CENTROIDS */
+    if (strncmp("#CENTROIDS#", buf, 11) != 0)  { goto infileerr; }
+    g_centroids = calloc(g_longranularity * g_latgranularity, sizeof(struct centroids));
+    g_centroidcounts = calloc(g_longranularity * g_latgranularity, sizeof(int));
+    for (i = 0, hascounts = 1;;i++) {
+	gzgets(fp, buf, 1024);
+	if (buf[0] == '#')
+	    break;
+	if ((numelem = sscanf(buf, "%lg %lg %i", &lat, &lon, &x)) < 2) { goto infileerr; }
+	g_centroids[i].lat = lat;
+	g_centroids[i].lon = lon;
+	if (numelem == 3)
+	    g_centroidcounts[i] = x;
+	else
+	    hascounts = 0;
+    }
+    if (!hascounts) { /* Older model without document counts */
+	free(g_centroidcounts);
+	g_centroidcounts = NULL;
+    }
+    if (strncmp("#END#", buf, 5) != 0)  { goto infileerr; }
+
+    if (g_modelindex != NULL) { /* Words are read when first looked up */
+	gzclose(fp);
+	*tm = tweetsmatrix;
+	*wm = modelindex_read_words(g_modelindex);
+	fprintf(stderr, "Done...\n");
+	fprintf(stderr, "Number of word types in model: %i (indexed, read on demand)\n", g_wordtypes);
+	fprintf(stderr, "Number of word tokens in model: %i\n", g_total_wordcount);
+	return(1);
+    }
+    
+    /* WORDS */
+    global_wh_train = wordhash_init(128);
+    for (;;) {
+	gzgets(fp, buf, 1024);
+	if (strncmp("#END#", buf, 5) == 0)
+	    break;
+	numelem = sscanf(buf, "#WORD# %i %s %lf", &index, word, &feature_weight);
+	if (numelem != 2 && numelem != 3) { goto infileerr; }
+	if (numelem == 2)
+	    feature_weight = 1.0;
+	g_wordtypes++;
+	if (iwh != NULL && wordhash_find(iwh, word) == -1) {
+	    //fprintf(stderr, "SKIP: %s\n", word);
+	    for (;;) {
+		gzgets(fp, buf, 1024);
+		if (strncmp("#END#", buf, 5) == 0)
+		    break;
+	    }
+	} else {
+	    //fprintf(stderr, "READ: %s\n", word);
+	    wordindex = word_coord_add_word(word, 0.0, 0.0, 1); /* Add entry, and if coords are provided, add those below */
+	    word_coord_set_weight(word, feature_weight);
+	    for (;;) {
+		gzgets(fp, buf, 1024);
+		if (strncmp("#MATRIX#", buf, 8) == 0) {
+		    has_matrix = 1;
+		    break;
+		}
+		if (strncmp("#END#", buf, 5) == 0) {
+		    has_matrix = 0;
+		    break;
+		}
+		if (sscanf(buf, "%lg %lg", &lat, &lon) != 2) { goto infileerr; }
+		/* Add lat lon to word */
+		g_total_wordcount++;
+		word_coord_append(wordindex, lat, lon);
+	    }
+	    if (has_matrix) {
+		smh = sparsematrix_create();
+		for (;;) {
+		    gzgets(fp, buf, 1024);
+		    if (strncmp("#END#", buf, 5) == 0)
+			break;
+		    if (sscanf(buf, "%i %i %lg", &x, &y, &value) != 3) { goto infileerr; }
+		    /* Add x y value to sparsematrix */		
+		    sparsematrix_add(smh, x, y, value);
+		}
+		sparsematrix_add(smh, -1, -1, 0.0);
+		plainbytes += smh->tail * sizeof(struct sparsematrix);
+		sm = sparsematrix_close(smh);
+		if (g_quantize) {
+		    wc_list[wordindex].packed = sparsematrix_pack(sm, &packedsize);
+		    packedbytes += packedsize;
+		    free(sm);
+		} else {
+		    word_coord_add_sparsematrix(word, sm);
+		}
+	    } 
+	}
+    }
+    
+    /* WORDMATRIX */
+    gzgets(fp, buf, 1024);
+    if (strncmp("#WORDMATRIX#", buf, 12) != 0) { goto infileerr; }
+    wordmatrix = matrix_init(0.0);
+    for (;;) {
+	gzgets(fp, buf, 1024);
+	if (buf[0] == '#')
+	    break;
+	if (sscanf(buf, "%i %i %lg", &x, &y, &value) != 3) { goto infileerr; }
+	wordmatrix[x+y*g_longranularity] = value;
+    }
+    fprintf(stderr, "Done...\n");
+    fprintf(stderr, "Number of word types in model: %i\n", g_wordtypes);
+    fprintf(stderr, "Number of word tokens in model: %i\n", g_total_wordcount);
+    if (g_quantize && plainbytes > 0)
+	fprintf(stderr, "Packed word matrices: %.1f MB (unpacked %.1f MB)\n", packedbytes / 1048576.0, plainbytes / 1048576.0);
+    *tm = tweetsmatrix;
+    *wm = wordmatrix;
+    return(1);
+ infileerr:
+    fprintf(stderr, "File error reading model\n");
+    return(0);
+}
+
+/* Text model writer. Records are formatted into plain buffers, with the   */
+/* integers and %lg doubles converted by hand (the bulk of what gzprintf   */
+/* spent its time on), and the model is deflated pigz-style: the text is   */
+/* cut into blocks that are compressed independently (no shared window),  */
+/* in parallel by g_threads compressor threads, and written in order. Each */
+/* block ends with a sync flush on a byte boundary, so the blocks make up  */
+/* one valid gzip stream, and inflating can start at any of them, which   */
+/* the word index relies on.                                               */
+
+#define GZWRITER_BLOCKSIZE 131072 /* Longest block; the word index cuts more often */
+
+struct textbuf {
+    char *buf;
+    size_t len, size;
+};
+
+void textbuf_reserve(struct textbuf *tb, size_t n) {
+    if (tb->len + n <= tb->size)
+	return;
+    tb->size = tb->size == 0 ? 1024 : tb->size;
+    while (tb->size < tb->len + n)
+	tb->size *= 2;
+    tb->buf = realloc(tb->buf, tb->size);
+}
+
+void textbuf_put(struct textbuf *tb, const char *s, size_t n) {
+    textbuf_reserve(tb, n);
+    memcpy(tb->buf + tb->len, s, n);
+    tb->len += n;
+}
+
+void textbuf_str(struct textbuf *tb, const char *s) {
+    textbuf_put(tb, s, strlen(s));
+}
+
+void textbuf_printf(struct textbuf *tb, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    textbuf_reserve(tb, n + 1);
+    va_start(ap, fmt);
+    vsnprintf(tb->buf + tb->len, n + 1, fmt, ap);
+    va_end(ap);
+    tb->len += n;
+}
+
+void textbuf_int(struct textbuf *tb, int v) {
+    char digits[12];
+    unsigned int u;
+    int n = 0;
+    textbuf_reserve(tb, 12);
+    u = v < 0 ? -(unsigned int)v : (unsigned int)v;
+    do {
+	digits[n++] = '0' + u % 10;
+	u /= 10;
+    } while (u > 0);
+    if (v < 0)
+	tb->buf[tb->len++] = '-';
+    while (n > 0)
+	tb->buf[tb->len++] = digits[--n];
+}
+
+/* Same text as printf("%g", v). The six significant digits come from one  */
+/* scaling by an exact power of ten (relative error below 2^-52), so the   */
+/* rounding is the correct one unless the scaled value is within 1e-6 of a */
+/* tie; those, and very small or large values, go through snprintf.        */
+void textbuf_double(struct textbuf *tb, double v) {
+    static const double powers[23] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+				       1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    char digits[6], *p;
+    double a, scaled, r;
+    int e, m, n, i;
+    textbuf_reserve(tb, 32);
+    p = tb->buf + tb->len;
+    a = fabs(v);
+    if (v == 0.0 && !signbit(v)) {
+	tb->buf[tb->len++] = '0';
+	return;
+    }
+    if (!(a >= 1e-16 && a < 1e21))
+	goto fallback;
+    e = (int) floor(log10(a));
+    scaled = 5 - e >= 0 ? a * powers[5 - e] : a / powers[e - 5];
+    if (scaled < 100000.0) {
+	e--;
+	scaled = 5 - e >= 0 ? a * powers[5 - e] : a / powers[e - 5];
+    } else if (scaled >= 1000000.0) {
+	e++;
+	scaled = 5 - e >= 0 ? a * powers[5 - e] : a / powers[e - 5];
+    }
+    r = floor(scaled);
+    if (fabs(scaled - r - 0.5) < 1e-6)
+	goto fallback;
+    m = (int) r + (scaled - r > 0.5);
+    if (m == 1000000) {
+	m = 100000;
+	e++;
+    }
+    for (i = 5; i >= 0; i--, m /= 10)
+	digits[i] = '0' + m % 10;
+    for (n = 6; n > 1 && digits[n - 1] == '0'; n--) { }
+    if (v < 0)
+	*p++ = '-';
+    if (e < -4 || e >= 6) {
+	*p++ = digits[0];
+	if (n > 1) {
+	    *p++ = '.';
+	    for (i = 1; i < n; i++)
+		*p++ = digits[i];
+	}
+	*p++ = 'e';
+	*p++ = e < 0 ? '-' : '+';
+	e = abs(e);
+	if (e >= 100)
+	    *p++ = '0' + e / 100;
+	*p++ = '0' + e / 10 % 10;
+	*p++ = '0' + e % 10;
+    } else if (e >= 0) {
+	for (i = 0; i <= e; i++)
+	    *p++ = digits[i];
+	if (n > e + 1) {
+	    *p++ = '.';
+	    for (i = e + 1; i < n; i++)
+		*p++ = digits[i];
+	}
+    } else {
+	*p++ = '0';
+	*p++ = '.';
+	for (i = -1; i > e; i--)
+	    *p++ = '0';
+	for (i = 0; i < n; i++)
+	    *p++ = digits[i];
+    }
+    tb->len = p - tb->buf;
+    return;
+ fallback:
+    tb->len += snprintf(p, 32, "%g", v);
+}
+
+/* "x y value" lines of a sparse matrix */
+void textbuf_sparsematrix(struct textbuf *tb, struct sparsematrix *sm) {
+    int j;
+    for (j = 0; sm[j].x != -1; j++) {
+	textbuf_int(tb, sm[j].x);
+	tb->buf[tb->len++] = ' ';
+	textbuf_int(tb, sm[j].y);
+	tb->buf[tb->len++] = ' ';
+	textbuf_double(tb, sm[j].value);
+	tb->buf[tb->len++] = '\n';
+    }
+}
+
+/* The #WORD# ... #END# record of word i (sm may be NULL). With weight,  */
+/* its feature weight follows the word, as --update and --tune write it */
+void textbuf_word(struct textbuf *tb, int i, struct sparsematrix *sm, int weight) {
+    int j;
+    textbuf_str(tb, "#WORD# ");
+    textbuf_int(tb, i);
+    tb->buf[tb->len++] = ' ';
+    textbuf_str(tb, wc_list[i].word);
+    if (weight)
+	textbuf_printf(tb, " %lf", wc_list[i].weight);
+    textbuf_put(tb, "\n", 1);
+    for (j = 0; j < wc_list[i].numcoords; j++) {
+	textbuf_double(tb, wc_list[i].coords[j].lat);
+	tb->buf[tb->len++] = ' ';
+	textbuf_double(tb, wc_list[i].coords[j].lon);
+	tb->buf[tb->len++] = '\n';
+    }
+    if (sm != NULL) {
+	textbuf_str(tb, "#MATRIX#\n");
+	textbuf_sparsematrix(tb, sm);
+    }
+    textbuf_str(tb, "#END#\n");
+}
+
+struct gzblock {
+    struct textbuf in;
+    unsigned char *out;
+    size_t outlen, outsize;
+    uLong crc;
+    int done;
+};
+
+struct gzwriter {
+    char *filename;
+    FILE *fp;
+    int level;
+    struct textbuf cur;         /* Text of the block being filled */
+    int64_t uncompressed;       /* Text in blocks cut so far */
+    int64_t compressed;         /* Bytes written so far */
+    uLong crc;
+    int numblocks;              /* Blocks cut so far */
+    int64_t *offsets;           /* Compressed offset of each block written */
+    int numwritten, offsetsize;
+    struct gzblock *ring;       /* Blocks head..tail-1 are being compressed or */
+    int ringsize;               /* wait to be written; workers claim 'next'    */
+    int64_t head, next, tail;
+    int numthreads, stop;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* A block was submitted or compressed */
+    z_stream z;                 /* Without threads, blocks are compressed here */
+};
+
+void gzblock_compress(struct gzblock *b, z_stream *z) {
+    deflateReset(z);
+    b->crc = crc32(crc32(0L, Z_NULL, 0), (unsigned char *) b->in.buf, b->in.len);
+    if (b->outsize < deflateBound(z, b->in.len) + 64) {
+	b->outsize = deflateBound(z, b->in.len) + 64;
+	b->out = realloc(b->out, b->outsize);
+    }
+    z->next_in = (unsigned char *) b->in.buf;
+    z->avail_in = b->in.len;
+    b->outlen = 0;
+    do {
+	if (b->outlen == b->outsize) {
+	    b->outsize *= 2;
+	    b->out = realloc(b->out, b->outsize);
+	}
+	z->next_out = b->out + b->outlen;
+	z->avail_out = b->outsize - b->outlen;
+	deflate(z, Z_SYNC_FLUSH);
+	b->outlen = b->outsize - z->avail_out;
+    } while (z->avail_out == 0);
+}
+
+void gzwriter_deflate_init(z_stream *z, int level) {
+    memset(z, 0, sizeof(z_stream));
+    if (deflateInit2(z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	fprintf(stderr, "ERROR: deflateInit2 failed\n");
+	exit(EXIT_FAILURE);
+    }
+}
+
+void *gzwriter_worker(void *arg) {
+    struct gzwriter *gz = arg;
+    struct gzblock *b;
+    z_stream z;
+    gzwriter_deflate_init(&z, gz->level);
+    pthread_mutex_lock(&gz->lock);
+    for (;;) {
+	while (gz->next == gz->tail && !gz->stop)
+	    pthread_cond_wait(&gz->cond, &gz->lock);
+	if (gz->next == gz->tail)
+	    break;
+	b = gz->ring + gz->next++ % gz->ringsize;
+	pthread_mutex_unlock(&gz->lock);
+	gzblock_compress(b, &z);
+	pthread_mutex_lock(&gz->lock);
+	b->done = 1;
+	pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->lock);
+    deflateEnd(&z);
+    return(NULL);
+}
+
+void gzwriter_bytes(struct gzwriter *gz, const void *buf, size_t n) {
+    if (n > 0 && fwrite(buf, 1, n, gz->fp) != n) {
+	perror(gz->filename);
+	exit(EXIT_FAILURE);
+    }
+    gz->compressed += n;
+}
+
+struct gzwriter *gzwriter_open(char *filename, int level) {
+    struct gzwriter *gz;
+    unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 }; /* No name or mtime, Unix */
+    int t;
+    gz = calloc(1, sizeof(struct gzwriter));
+    gz->filename = strdup(filename);
+    if ((gz->fp = fopen(filename, "wb")) == NULL) {
+	perror(filename);
+	exit(EXIT_FAILURE);
+    }
+    gz->level = level;
+    gz->crc = crc32(0L, Z_NULL, 0);
+    header[8] = level == 9 ? 2 : level == 1 ? 4 : 0;
+    gzwriter_bytes(gz, header, 10);
+    gz->numthreads = g_threads > 1 ? g_threads : 0;
+    gz->ringsize = gz->numthreads > 0 ? 2 * gz->numthreads : 1;
+    gz->ring = calloc(gz->ringsize, sizeof(struct gzblock));
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+    if (gz->numthreads == 0)
+	gzwriter_deflate_init(&gz->z, level);
+    gz->threads = malloc(sizeof(pthread_t) * (gz->numthreads + 1));
+    for (t = 0; t < gz->numthreads; t++) {
+	if (pthread_create(gz->threads + t, NULL, gzwriter_worker, gz) != 0) {
+	    fprintf(stderr, "ERROR: could not create thread\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    return(gz);
+}
+
+/* Write compressed blocks in order until at most 'keep' are in flight */
+void gzwriter_flush(struct gzwriter *gz, int keep) {
+    struct gzblock *b;
+    int done;
+    while (gz->head < gz->tail) {
+	b = gz->ring + gz->head % gz->ringsize;
+	pthread_mutex_lock(&gz->lock);
+	while (!b->done && gz->tail - gz->head > keep)
+	    pthread_cond_wait(&gz->cond, &gz->lock);
+	done = b->done;
+	pthread_mutex_unlock(&gz->lock);
+	if (!done)
+	    return;
+	if (gz->numwritten == gz->offsetsize) {
+	    gz->offsetsize = gz->offsetsize == 0 ? 1024 : gz->offsetsize * 2;
+	    gz->offsets = realloc(gz->offsets, sizeof(int64_t) * (gz->offsetsize + 1));
+	}
+	gz->offsets[gz->numwritten++] = gz->compressed;
+	gzwriter_bytes(gz, b->out, b->outlen);
+	gz->crc = crc32_combine(gz->crc, b->crc, b->in.len);
+	b->done = 0;
+	gz->head++;
+    }
+}
+
+/* Ends the current block (if it has any text) and returns the number of */
+/* the block that text written from now on goes to                       */
+int gzwriter_cut(struct gzwriter *gz) {
+    struct gzblock *b;
+    struct textbuf tb;
+    if (gz->cur.len == 0)
+	return(gz->numblocks);
+    gzwriter_flush(gz, gz->ringsize - 1);
+    b = gz->ring + gz->tail % gz->ringsize;
+    tb = b->in;
+    b->in = gz->cur;
+    gz->cur = tb;
+    gz->cur.len = 0;
+    gz->uncompressed += b->in.len;
+    gz->numblocks++;
+    if (gz->numthreads == 0) {
+	gzblock_compress(b, &gz->z);
+	b->done = 1;
+	gz->tail++;
+    } else {
+	pthread_mutex_lock(&gz->lock);
+	gz->tail++;
+	pthread_cond_broadcast(&gz->cond);
+	pthread_mutex_unlock(&gz->lock);
+    }
+    gzwriter_flush(gz, gz->ringsize);
+    return(gz->numblocks);
+}
+
+void gzwriter_put(struct gzwriter *gz, const char *s, size_t n) {
+    size_t k;
+    while (n > 0) {
+	if (gz->cur.len >= GZWRITER_BLOCKSIZE)
+	    gzwriter_cut(gz);
+	k = GZWRITER_BLOCKSIZE - gz->cur.len < n ? GZWRITER_BLOCKSIZE - gz->cur.len : n;
+	textbuf_put(&gz->cur, s, k);
+	s += k;
+	n -= k;
+    }
+}
+
+/* Uncompressed offset of the next byte written */
+int64_t gzwriter_tell(struct gzwriter *gz) {
+    return(gz->uncompressed + gz->cur.len);
+}
+
+/* Finishes the gzip stream and closes the file. Returns the compressed */
+/* offset of each block (to be freed), for the word index               */
+int64_t *gzwriter_close(struct gzwriter *gz) {
+    unsigned char trailer[10] = { 3, 0 }; /* Empty final block */
+    int64_t *offsets;
+    int t, i;
+    gzwriter_cut(gz);
+    gzwriter_flush(gz, 0);
+    for (i = 0; i < 4; i++) {
+	trailer[2 + i] = (gz->crc >> (8 * i)) & 0xff;
+	trailer[6 + i] = ((uint64_t) gz->uncompressed >> (8 * i)) & 0xff;
+    }
+    if (gz->offsets == NULL)
+	gz->offsets = malloc(sizeof(int64_t));
+    gz->offsets[gz->numwritten] = gz->compressed;
+    gzwriter_bytes(gz, trailer, 10);
+    if (fclose(gz->fp) != 0) {
+	perror(gz->filename);
+	exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&gz->lock);
+    gz->stop = 1;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->lock);
+    for (t = 0; t < gz->numthreads; t++)
+	pthread_join(gz->threads[t], NULL);
+    if (gz->numthreads == 0)
+	deflateEnd(&gz->z);
+    for (i = 0; i < gz->ringsize; i++) {
+	free(gz->ring[i].in.buf);
+	free(gz->ring[i].out);
+    }
+    pthread_mutex_destroy(&gz->lock);
+    pthread_cond_destroy(&gz->cond);
+    offsets = gz->offsets;
+    free(gz->cur.buf);
+    free(gz->ring);
+    free(gz->threads);
+    free(gz->filename);
+    free(gz);
+    return(offsets);
+}
+
+/* Writes a model to a file: assumes tweetsmatrix and wordmatrix are available */
+/* Fetches words and coordinates from */
+/* Word offset index for text models (MODELFILE.idx, written next to the  */
+/* model). A new deflate block (see gzwriter) is started at the first     */
+/* word after every MODELINDEX_BLOCKSIZE bytes, so decompression can      */
+/* start over at each such block. The index maps each word to its block   */
+/* and the uncompressed offset of its #WORD# line. When classifying, only */
+/* the header of the model is read, and a word's section is decompressed  */
+/* the first time the word is looked up. Layout, in host byte order:      */
+/*   header | blocks (struct modelindex_block[]) | words                   */
+/*   (struct modelindex_word[]) | string pool                              */
+/* An index is only used if the model still has the size and fingerprint */
+/* (modelindex_fingerprint) it was written for                            */
+
+#define MODELINDEX_MAGIC     "GEOLOCIX"
+#define MODELINDEX_VERSION   2
+#define MODELINDEX_BLOCKSIZE 65536
+#define MODELINDEX_HEADBYTES 65536 /* Model bytes covered by the fingerprint, besides the trailer */
+
+struct modelindex_header {
+    char magic[8];
+    int32_t byteorder;        /* BINMODEL_BYTEORDER                               */
+    int32_t version;
+    int32_t numwords;
+    int32_t numblocks;
+    int64_t modelsize;        /* Size of the model file the index was written for  */
+    int64_t total_wordcount;
+    int64_t wordmatrix;       /* Uncompressed offset of #WORDMATRIX#               */
+    int32_t wordmatrixblock;
+    uint32_t fingerprint;     /* modelindex_fingerprint() of the model file        */
+};
+
+struct modelindex_block {
+    int64_t compressed;       /* Offset in the model file of the flush point       */
+    int64_t uncompressed;     /* Offset in the uncompressed text                   */
+};
+
+struct modelindex_word {
+    int64_t offset;           /* Uncompressed offset of the word's #WORD# line      */
+    int64_t word;             /* Offset in string pool                             */
+    int32_t block;
+    int32_t pad;
+};
+
+struct modelindex {
+    int fd;                   /* The model file */
+    void *map;
+    size_t size;
+    struct modelindex_header *header;
+    struct modelindex_block *blocks;
+    struct modelindex_word *words;
+    char *strings;
+    pthread_mutex_t lock;     /* Guards the loading flags of wc_list             */
+    pthread_cond_t loaded;    /* Signalled when a word has been read             */
+};
+
+struct modelindex_writer {
+    char *filename;
+    struct modelindex_header header;
+    struct modelindex_block *blocks;
+    int blocksize;
+    struct modelindex_word *words;
+    int wordsize;
+    char *strings;
+    int64_t stringsize, stringalloc;
+};
+
+/* Set while a text model is being written */
+struct modelindex_writer *g_indexwriter = NULL;
+
+struct modelindex_writer *modelindex_writer_open(char *modelfilename) {
+    struct modelindex_writer *iw;
+    iw = calloc(1, sizeof(struct modelindex_writer));
+    iw->filename = malloc(strlen(modelfilename) + 5);
+    sprintf(iw->filename, "%s.idx", modelfilename);
+    memcpy(iw->header.magic, MODELINDEX_MAGIC, 8);
+    iw->header.byteorder = BINMODEL_BYTEORDER;
+    iw->header.version = MODELINDEX_VERSION;
+    return(iw);
+}
+
+/* Start a new block at the current position if the last one is full (or forced) */
+/* (its compressed offset is only known once the model is closed, so the  */
+/* gzwriter block number stands in for it until then)                      */
+void modelindex_writer_block(struct modelindex_writer *iw, struct gzwriter *gz, int force) {
+    if (iw->header.numblocks > 0 && !force && gzwriter_tell(gz) - iw->blocks[iw->header.numblocks - 1].uncompressed < MODELINDEX_BLOCKSIZE)
+	return;
+    if (iw->header.numblocks == iw->blocksize) {
+	iw->blocksize = iw->blocksize == 0 ? 1024 : iw->blocksize * 2;
+	iw->blocks = realloc(iw->blocks, iw->blocksize * sizeof(struct modelindex_block));
+    }
+    iw->blocks[iw->header.numblocks].compressed = gzwriter_cut(gz);
+    iw->blocks[iw->header.numblocks].uncompressed = gzwriter_tell(gz);
+    iw->header.numblocks++;
+}
+
+/* Called just before a word's #WORD# line is written */
+void modelindex_writer_word(struct modelindex_writer *iw, struct gzwriter *gz, char *word, int numcoords) {
+    struct modelindex_word *w;
+    int64_t len;
+    modelindex_writer_block(iw, gz, 0);
+    if (iw->header.numwords == iw->wordsize) {
+	iw->wordsize = iw->wordsize == 0 ? 1024 : iw->wordsize * 2;
+	iw->words = realloc(iw->words, iw->wordsize * sizeof(struct modelindex_word));
+    }
+    len = strlen(word) + 1;
+    if (iw->stringsize + len > iw->stringalloc) {
+	iw->stringalloc = iw->stringalloc == 0 ? 65536 : iw->stringalloc * 2;
+	iw->stringalloc = iw->stringalloc < iw->stringsize + len ? iw->stringsize + len : iw->stringalloc;
+	iw->strings = realloc(iw->strings, iw->stringalloc);
+    }
+    w = iw->words + iw->header.numwords++;
+    w->offset = gzwriter_tell(gz);
+    w->word = iw->stringsize;
+    w->block = iw->header.numblocks - 1;
+    w->pad = 0;
+    memcpy(iw->strings + iw->stringsize, word, len);
+    iw->stringsize += len;
+    iw->header.total_wordcount += numcoords;
+}
+
+/* Called just before the #WORDMATRIX# line is written */
+void modelindex_writer_wordmatrix(struct modelindex_writer *iw, struct gzwriter *gz) {
+    modelindex_writer_block(iw, gz, 1);
+    iw->header.wordmatrix = gzwriter_tell(gz);
+    iw->header.wordmatrixblock = iw->header.numblocks - 1;
+}
+
+/* CRC-32 of the first MODELINDEX_HEADBYTES of a model file and of its   */
+/* last 8 bytes, the gzip trailer with the CRC-32 and length of the whole */
+/* uncompressed text, so that a model rewritten at the same size is told  */
+/* apart without reading all of it. Returns 0 if the file can't be read   */
+uint32_t modelindex_fingerprint(char *modelfilename) {
+    unsigned char buf[MODELINDEX_HEADBYTES];
+    struct stat st;
+    uint32_t crc;
+    ssize_t n;
+    int fd;
+    if ((fd = open(modelfilename, O_RDONLY)) == -1)
+	return(0);
+    if (fstat(fd, &st) == -1 || (n = pread(fd, buf, st.st_size < MODELINDEX_HEADBYTES ? st.st_size : MODELINDEX_HEADBYTES, 0)) < 0) {
+	close(fd);
+	return(0);
+    }
+    crc = crc32(crc32(0L, Z_NULL, 0), buf, n);
+    if (st.st_size >= 8 && (n = pread(fd, buf, 8, st.st_size - 8)) == 8)
+	crc = crc32(crc, buf, 8);
+    close(fd);
+    return(crc);
+}
+
+/* Write the index once the model file is closed (offsets as returned by */
+/* gzwriter_close); frees the writer                                     */
+void modelindex_writer_close(struct modelindex_writer *iw, char *modelfilename, int64_t *offsets) {
+    struct stat st;
+    FILE *fp;
+    int i;
+    for (i = 0; i < iw->header.numblocks; i++)
+	iw->blocks[i].compressed = offsets[iw->blocks[i].compressed];
+    if (stat(modelfilename, &st) == -1 || (fp = fopen(iw->filename, "wb")) == NULL) {
+	perror(iw->filename);
+	exit(EXIT_FAILURE);
+    }
+    iw->header.modelsize = st.st_size;
+    iw->header.fingerprint = modelindex_fingerprint(modelfilename);
+    fwrite(&iw->header, sizeof(struct modelindex_header), 1, fp);
+    fwrite(iw->blocks, sizeof(struct modelindex_block), iw->header.numblocks, fp);
+    fwrite(iw->words, sizeof(struct modelindex_word), iw->header.numwords, fp);
+    fwrite(iw->strings, 1, iw->stringsize, fp);
+    if (fclose(fp) != 0) {
+	perror(iw->filename);
+	exit(EXIT_FAILURE);
+    }
+    free(iw->filename);
+    free(iw->blocks);
+    free(iw->words);
+    free(iw->strings);
+    free(iw);
+}
+
+/* Rename a model and its index together */
+void modelindex_rename(char *from, char *to) {
+    char *fromidx, *toidx;
+    fromidx = malloc(strlen(from) + 5);
+    toidx = malloc(strlen(to) + 5);
+    sprintf(fromidx, "%s.idx", from);
+    sprintf(toidx, "%s.idx", to);
+    if (rename(from, to) != 0 || rename(fromidx, toidx) != 0) {
+	perror(to);
+	exit(EXIT_FAILURE);
+    }
+    free(fromidx);
+    free(toidx);
+}
+
+/* Maps the index of a text model, NULL if there is none or it doesn't match the model */
+struct modelindex *modelindex_open(char *modelfilename) {
+    struct modelindex *mi;
+    struct stat st, modelst;
+    char *filename, *base;
+    int fd;
+    filename = malloc(strlen(modelfilename) + 5);
+    sprintf(filename, "%s.idx", modelfilename);
+    fd = open(filename, O_RDONLY);
+    free(filename);
+    if (fd == -1)
+	return(NULL);
+    if (fstat(fd, &st) == -1 || stat(modelfilename, &modelst) == -1 || st.st_size < (off_t)sizeof(struct modelindex_header)) {
+	close(fd);
+	return(NULL);
+    }
+    mi = calloc(1, sizeof(struct modelindex));
+    mi->size = st.st_size;
+    mi->map = mmap(NULL, mi->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mi->map == MAP_FAILED) {
+	free(mi);
+	return(NULL);
+    }
+    base = mi->map;
+    mi->header = (struct modelindex_header *) base;
+    if (memcmp(mi->header->magic, MODELINDEX_MAGIC, 8) != 0 || mi->header->byteorder != BINMODEL_BYTEORDER ||
+	mi->header->version != MODELINDEX_VERSION || mi->header->modelsize != (int64_t)modelst.st_size ||
+	mi->header->fingerprint != modelindex_fingerprint(modelfilename)) {
+	fprintf(stderr, "Ignoring word index of %s (stale, or written on a different architecture)\n", modelfilename);
+	munmap(mi->map, mi->size);
+	free(mi);
+	return(NULL);
+    }
+    mi->blocks = (struct modelindex_block *) (base + sizeof(struct modelindex_header));
+    mi->words = (struct modelindex_word *) (mi->blocks + mi->header->numblocks);
+    mi->strings = (char *) (mi->words + mi->header->numwords);
+    if ((mi->fd = open(modelfilename, O_RDONLY)) == -1) {
+	perror(modelfilename);
+	exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&mi->lock, NULL);
+    pthread_cond_init(&mi->loaded, NULL);
+    return(mi);
+}
+
+/* Decompress the model text from uncompressed offset 'offset' (in 'block') */
+/* through the first line that starts with #END#. Returns it NUL-terminated */
+char *modelindex_read(struct modelindex *mi, int block, int64_t offset) {
+    z_stream z;
+    unsigned char in[65536];
+    char *out, *line;
+    size_t outsize, outlen, scan, skip;
+    ssize_t n;
+    off_t pos;
+    int ret;
+    memset(&z, 0, sizeof(z_stream));
+    if (inflateInit2(&z, -15) != Z_OK) {
+	fprintf(stderr, "ERROR: inflateInit2 failed\n");
+	exit(EXIT_FAILURE);
+    }
+    skip = offset - mi->blocks[block].uncompressed;
+    outsize = skip + 65536;
+    out = malloc(outsize + 1);
+    pos = mi->blocks[block].compressed;
+    for (outlen = 0, scan = skip, ret = Z_OK; ; ) {
+	if (z.avail_in == 0) {
+	    if ((n = pread(mi->fd, in, sizeof(in), pos)) <= 0)
+		break;
+	    pos += n;
+	    z.next_in = in;
+	    z.avail_in = n;
+	}
+	if (outlen == outsize) {
+	    outsize *= 2;
+	    out = realloc(out, outsize + 1);
+	}
+	z.next_out = (unsigned char *) out + outlen;
+	z.avail_out = outsize - outlen;
+	ret = inflate(&z, Z_NO_FLUSH);
+	if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+	    break;
+	outlen = outsize - z.avail_out;
+	/* Look for the end line among the complete lines decompressed so far */
+	for (out[outlen] = '\0'; scan < outlen && (line = memchr(out + scan, '\n', outlen - scan)) != NULL; scan = line + 1 - out) {
+	    if (strncmp(out + scan, "#END#", 5) == 0 && scan > skip) {
+		inflateEnd(&z);
+		*line = '\0';
+		memmove(out, out + skip, line - out - skip + 1);
+		return(out);
+	    }
+	}
+	if (ret == Z_STREAM_END)
+	    break;
+    }
+    fprintf(stderr, "File error reading model (word index)\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Line-by-line over a buffer: returns the next line (NUL-terminated in place) or NULL */
+char *modelindex_nextline(char **p) {
+    char *line, *nl;
+    if (**p == '\0')
+	return(NULL);
+    line = *p;
+    if ((nl = strchr(line, '\n')) != NULL) {
+	*nl = '\0';
+	*p = nl + 1;
+    } else {
+	*p = line + strlen(line);
+    }
+    return(line);
+}
+
+/* Reads the section of word wordindex (its index record) into wc_list.  */
+/* The word is claimed under the lock, but read and parsed without it,   */
+/* so threads that look up different words load them in parallel; a      */
+/* thread that needs a word another one is reading waits for it          */
+void modelindex_load_word(int wordindex) {
+    struct modelindex *mi = g_modelindex;
+    struct sparsematrix_handle *smh;
+    struct sparsematrix *sm;
+    char *text, *p, *line, word[1024];
+    double lat, lon, value, feature_weight;
+    int index, x, y, numelem;
+    size_t packedsize;
+    pthread_mutex_lock(&mi->lock);
+    while (wc_list[wordindex].loading)
+	pthread_cond_wait(&mi->loaded, &mi->lock);
+    if (wc_list[wordindex].loaded) { /* Another thread got here first */
+	pthread_mutex_unlock(&mi->lock);
+	return;
+    }
+    wc_list[wordindex].loading = 1;
+    pthread_mutex_unlock(&mi->lock);
+    p = text = modelindex_read(mi, mi->words[wordindex].block, mi->words[wordindex].offset);
+    line = modelindex_nextline(&p);
+    numelem = sscanf(line, "#WORD# %i %1023s %lf", &index, word, &feature_weight);
+    if ((numelem != 2 && numelem != 3) || strcmp(word, wc_list[wordindex].word) != 0) {
+	fprintf(stderr, "File error reading model (word index doesn't match the model)\n");
+	exit(EXIT_FAILURE);
+    }
+    wc_list[wordindex].weight = numelem == 3 ? feature_weight : 1.0;
+    while ((line = modelindex_nextline(&p)) != NULL && line[0] != '#') {
+	if (sscanf(line, "%lg %lg", &lat, &lon) != 2)
+	    break;
+	word_coord_append(wordindex, lat, lon);
+    }
+    if (line != NULL && strncmp("#MATRIX#", line, 8) == 0) {
+	smh = sparsematrix_create();
+	while ((line = modelindex_nextline(&p)) != NULL && line[0] != '#') {
+	    if (sscanf(line, "%i %i %lg", &x, &y, &value) != 3)
+		break;
+	    sparsematrix_add(smh, x, y, value);
+	}
+	sparsematrix_add(smh, -1, -1, 0.0);
+	sm = sparsematrix_close(smh);
+	if (g_quantize) {
+	    wc_list[wordindex].packed = sparsematrix_pack(sm, &packedsize);
+	    free(sm);
+	} else {
+	    wc_list[wordindex].sparsematrix = sm;
+	}
+    }
+    if (line == NULL || strncmp("#END#", line, 5) != 0) {
+	fprintf(stderr, "File error reading model (word '%s')\n", wc_list[wordindex].word);
+	exit(EXIT_FAILURE);
+    }
+    free(text);
+    pthread_mutex_lock(&mi->lock);
+    __atomic_store_n(&wc_list[wordindex].loaded, 1, __ATOMIC_RELEASE);
+    wc_list[wordindex].loading = 0;
+    pthread_cond_broadcast(&mi->loaded);
+    pthread_mutex_unlock(&mi->lock);
+}
+
+/* Registers the indexed words (unloaded) and reads the wordmatrix through the index */
+double *modelindex_read_words(struct modelindex *mi) {
+    char *text, *p, *line;
+    double *wordmatrix, value;
+    int i, x, y;
+    global_wh_train = wordhash_init(2 * mi->header->numwords);
+    if (mi->header->numwords > (int)wc_list_size) {
+	wc_list_size = mi->header->numwords;
+	wc_list = realloc(wc_list, wc_list_size * sizeof(struct wordinfo));
+    }
+    memset(wc_list, 0, wc_list_size * sizeof(struct wordinfo));
+    for (i = 0; i < mi->header->numwords; i++) {
+	wc_list[i].word = mi->strings + mi->words[i].word;
+	wc_list[i].weight = 1.0;
+	wordhash_add(global_wh_train, wc_list[i].word, wordhash_hashf(wc_list[i].word), i);
+    }
+    wc_list_max = mi->header->numwords > 0 ? mi->header->numwords - 1 : 0;
+    g_wordtypes = mi->header->numwords;
+    g_total_wordcount = mi->header->total_wordcount;
+    p = text = modelindex_read(mi, mi->header->wordmatrixblock, mi->header->wordmatrix);
+    line = modelindex_nextline(&p);
+    if (strncmp("#WORDMATRIX#", line, 12) != 0) {
+	fprintf(stderr, "File error reading model (word index doesn't match the model)\n");
+	exit(EXIT_FAILURE);
+    }
+    wordmatrix = matrix_init(0.0);
+    while ((line = modelindex_nextline(&p)) != NULL && line[0] != '#') {
+	if (sscanf(line, "%i %i %lg", &x, &y, &value) == 3)
+	    wordmatrix[x+y*g_longranularity] = value;
+    }
+    free(text);
+    return(wordmatrix);
+}
+
+/* Granularity, p(c) and centroids of a text model. The p(c) mass and the  */
+/* per-cell document counts let --update fold in new documents later; old  */
+/* readers ignore them.                                                     */
+void model_write_header(struct gzwriter *gz, double *tweetsmatrix) {
+    struct sparsematrix *sm;
+    struct textbuf tb = { NULL, 0, 0 };
+    int j;
+    sm = matrix_to_sparsematrix(tweetsmatrix);
+    textbuf_printf(&tb, "#LONGRANULARITY# %i\n", g_longranularity);
+    if (g_tweetmass > 0.0)
+	textbuf_printf(&tb, "#TWEETMATRIX# %.17g\n", g_tweetmass);
+    else
+	textbuf_str(&tb, "#TWEETMATRIX#\n");
+    textbuf_sparsematrix(&tb, sm);
+    textbuf_str(&tb, "#END#\n");
+    free(sm);
+    textbuf_str(&tb, "#CENTROIDS#\n");
+    for (j = 0; j < g_longranularity * g_latgranularity; j++) {
+	textbuf_double(&tb, g_centroids[j].lat);
+	tb.buf[tb.len++] = ' ';
+	textbuf_double(&tb, g_centroids[j].lon);
+	if (g_centroidcounts != NULL) {
+	    tb.buf[tb.len++] = ' ';
+	    textbuf_int(&tb, g_centroidcounts[j]);
+	}
+	textbuf_put(&tb, "\n", 1);
+    }
+    textbuf_str(&tb, "#END#\n");
+    gzwriter_put(gz, tb.buf, tb.len);
+    free(tb.buf);
+}
+
+/* Summed wordmatrix, the last section of a text model */
+void model_write_wordmatrix(struct gzwriter *gz, struct modelindex_writer *iw, double *wordmatrix) {
+    struct sparsematrix *sm;
+    struct textbuf tb = { NULL, 0, 0 };
+    sm = matrix_to_sparsematrix(wordmatrix);
+    textbuf_str(&tb, "#END#\n");
+    gzwriter_put(gz, tb.buf, tb.len);
+    tb.len = 0;
+    modelindex_writer_wordmatrix(iw, gz);
+    textbuf_str(&tb, "#WORDMATRIX#\n");
+    textbuf_sparsematrix(&tb, sm);
+    textbuf_str(&tb, "#END#\n");
+    gzwriter_put(gz, tb.buf, tb.len);
+    free(tb.buf);
+    free(sm);
+}
+
+void geoloc_write_model(char *modelfilename, double *tweetsmatrix, double *wordmatrix) {
+    struct gzwriter *gz;
+    struct textbuf tb = { NULL, 0, 0 };
+    int i;
+    struct sparsematrix *sm;
+    struct modelindex_writer *iw;
+    int64_t *offsets;
+
+    gz = gzwriter_open(modelfilename, g_compress_level);
+    iw = modelindex_writer_open(modelfilename);
+    fprintf(stderr, "Writing p(c) matrix\n");
+    model_write_header(gz, tweetsmatrix);
+    
+    for (i = 0; i <= wc_list_max; i++) {
+	if (wc_list[i].numcoords < g_threshold)
+	    continue;
+	/* print #WORD#, followed by word + lats and lons, and the sparse matrix */
+	sm = g_nomatrix == 0 ? wc_list[i].sparsematrix : NULL;
+	tb.len = 0;
+	textbuf_word(&tb, i, sm, 1);
+	free(sm);
+	modelindex_writer_word(iw, gz, wc_list[i].word, wc_list[i].numcoords);
+	gzwriter_put(gz, tb.buf, tb.len);
+    }
+    free(tb.buf);
+    fprintf(stderr, "Writing (unnormalized) p(c)_w matrix...\n");
+    model_write_wordmatrix(gz, iw, wordmatrix);
+    offsets = gzwriter_close(gz);
+    modelindex_writer_close(iw, modelfilename, offsets);
+    free(offsets);
+}
+
+/* Binary model writer: streams word matrices to disk as they are computed. */
+/* The sizes of all sections except the sparse matrices are known up front, */
+/* so those are laid out at open time and the sparse section is appended;   */
+/* the word records and the summed wordmatrix are filled in at close        */
+struct binmodel_writer {
+    FILE *fp;
+    struct binmodel_header header;
+    struct binmodel_word *words;
+    int *wordindex;           /* wc_list index of each record */
+    int numwords;
+    int nextword;
+    int64_t nextsparse;       /* In entries, or bytes when packed */
+};
+
+#define BINMODEL_ALIGN(X) (((X) + 7) & ~((int64_t)7))
+
+void binmodel_pad(FILE *fp) {
+    static const char zeros[8] = {0};
+    long pos;
+    pos = ftell(fp);
+    if (pos % 8)
+	fwrite(zeros, 1, 8 - pos % 8, fp);
+}
+
+/* Lay out a binary model for the given words (wc_list indices in write     */
+/* order) with coordcounts[i] coordinates each; coordinates and sparse       */
+/* matrices are filled in by binmodel_writer_add_word() in the same order   */
+struct binmodel_writer *binmodel_writer_open(char *modelfilename, double *tweetsmatrix, int *words, int *coordcounts, int numwords) {
+    struct binmodel_writer *bw;
+    int i, j, cells;
+    int32_t *hash;
+    uint32_t slot;
+    int64_t stringsize, numcoords;
+
+    bw = calloc(1, sizeof(struct binmodel_writer));
+    if ((bw->fp = fopen(modelfilename, "wb")) == NULL) {
+	perror(modelfilename);
+	exit(EXIT_FAILURE);
+    }
+    cells = g_longranularity * g_latgranularity;
+    bw->words = calloc(numwords, sizeof(struct binmodel_word));
+    bw->wordindex = malloc(numwords * sizeof(int));
+    for (bw->numwords = 0, stringsize = 0, numcoords = 0; bw->numwords < numwords; ) {
+	i = words[bw->numwords];
+	j = coordcounts[bw->numwords];
+	bw->wordindex[bw->numwords] = i;
+	bw->words[bw->numwords].word = stringsize;
+	bw->words[bw->numwords].coords = numcoords;
+	bw->words[bw->numwords].sparse = -1;
+	bw->words[bw->numwords].weight = 1.0;
+	bw->words[bw->numwords].hash = wordhash_hashf(wc_list[i].word);
+	bw->words[bw->numwords].coordcount = j;
+	bw->words[bw->numwords].count = j;
+	bw->numwords++;
+	stringsize += strlen(wc_list[i].word) + 1;
+	numcoords += j;
+    }
+    memcpy(bw->header.magic, BINMODEL_MAGIC, 8);
+    bw->header.byteorder = BINMODEL_BYTEORDER;
+    bw->header.version = BINMODEL_VERSION;
+    bw->header.flags = g_quantize ? BINMODEL_PACKED : 0;
+    bw->header.longranularity = g_longranularity;
+    bw->header.wordtypes = bw->numwords;
+    bw->header.total_wordcount = (int32_t)numcoords;
+    for (bw->header.hashsize = 128; bw->header.hashsize < 2 * (uint32_t)bw->numwords; bw->header.hashsize *= 2) { }
+    bw->header.tweetsmatrix = BINMODEL_ALIGN(sizeof(struct binmodel_header));
+    bw->header.centroids = bw->header.tweetsmatrix + cells * sizeof(double);
+    bw->header.wordmatrix = bw->header.centroids + cells * sizeof(struct centroids);
+    bw->header.words = bw->header.wordmatrix + cells * sizeof(double);
+    bw->header.hash = bw->header.words + bw->numwords * sizeof(struct binmodel_word);
+    bw->header.strings = BINMODEL_ALIGN(bw->header.hash + bw->header.hashsize * sizeof(int32_t));
+    bw->header.coords = BINMODEL_ALIGN(bw->header.strings + stringsize);
+    bw->header.sparse = bw->header.coords + numcoords * sizeof(struct coordinate);
+
+    /* Everything up to the sparse section except the wordmatrix and word records */
+    fseek(bw->fp, bw->header.tweetsmatrix, SEEK_SET);
+    fwrite(tweetsmatrix, sizeof(double), cells, bw->fp);
+    fwrite(g_centroids, sizeof(struct centroids), cells, bw->fp);
+    hash = malloc(bw->header.hashsize * sizeof(int32_t));
+    memset(hash, 0xff, bw->header.hashsize * sizeof(int32_t));
+    for (i = 0; i < bw->numwords; i++) {
+	for (slot = wordhash_mix(bw->words[i].hash) & (bw->header.hashsize - 1); hash[slot] != -1; slot = (slot + 1) & (bw->header.hashsize - 1)) { }
+	hash[slot] = i;
+    }
+    fseek(bw->fp, bw->header.hash, SEEK_SET);
+    fwrite(hash, sizeof(int32_t), bw->header.hashsize, bw->fp);
+    free(hash);
+    binmodel_pad(bw->fp);
+    for (i = 0; i < bw->numwords; i++)
+	fwrite(wc_list[bw->wordindex[i]].word, 1, strlen(wc_list[bw->wordindex[i]].word) + 1, bw->fp);
+    return(bw);
+}
+
+/* Add the next word (in wc_list order) with its matrix, sm = NULL for --nomatrix */
+void binmodel_writer_add_word(struct binmodel_writer *bw, int wordindex, struct sparsematrix *sm) {
+    struct packedmatrix *pm;
+    size_t size;
+    int j;
+    if (bw->nextword >= bw->numwords || bw->wordindex[bw->nextword] != wordindex) {
+	fprintf(stderr, "ERROR: binary model words written out of order!\n");
+	exit(EXIT_FAILURE);
+    }
+    if (wc_list[wordindex].numcoords != bw->words[bw->nextword].coordcount) {
+	fprintf(stderr, "ERROR: coordinate count of '%s' changed while writing binary model!\n", wc_list[wordindex].word);
+	exit(EXIT_FAILURE);
+    }
+    fseek(bw->fp, bw->header.coords + bw->words[bw->nextword].coords * sizeof(struct coordinate), SEEK_SET);
+    fwrite(wc_list[wordindex].coords, sizeof(struct coordinate), wc_list[wordindex].numcoords, bw->fp);
+    if (sm != NULL && (bw->header.flags & BINMODEL_PACKED)) {
+	pm = sparsematrix_pack(sm, &size);
+	fseek(bw->fp, bw->header.sparse + bw->nextsparse, SEEK_SET);
+	fwrite(pm, 1, size, bw->fp);
+	bw->words[bw->nextword].sparse = bw->nextsparse;
+	bw->words[bw->nextword].nonzeros = pm->nonzeros;
+	bw->nextsparse += size;
+	free(pm);
+    } else if (sm != NULL) {
+	for (j = 0; sm[j].x != -1; j++) { }
+	fseek(bw->fp, bw->header.sparse + bw->nextsparse * sizeof(struct sparsematrix), SEEK_SET);
+	fwrite(sm, sizeof(struct sparsematrix), j + 1, bw->fp);  /* Include sentinel */
+	bw->words[bw->nextword].sparse = bw->nextsparse;
+	bw->words[bw->nextword].nonzeros = j;
+	bw->nextsparse += j + 1;
+    }
+    bw->nextword++;
+}
+
+void binmodel_writer_close(struct binmodel_writer *bw, double *wordmatrix) {
+    bw->header.size = bw->header.sparse + bw->nextsparse * ((bw->header.flags & BINMODEL_PACKED) ? 1 : sizeof(struct sparsematrix));
+    fseek(bw->fp, 0, SEEK_SET);
+    fwrite(&bw->header, sizeof(struct binmodel_header), 1, bw->fp);
+    fseek(bw->fp, bw->header.wordmatrix, SEEK_SET);
+    fwrite(wordmatrix, sizeof(double), g_longranularity * g_latgranularity, bw->fp);
+    fwrite(bw->words, sizeof(struct binmodel_word), bw->numwords, bw->fp);
+    /* Trailing words may have written nothing, so set the size explicitly */
+    if (fflush(bw->fp) != 0 || ftruncate(fileno(bw->fp), bw->header.size) != 0 || fclose(bw->fp) != 0) {
+	perror("Writing binary model");
+	exit(EXIT_FAILURE);
+    }
+    free(bw->words);
+    free(bw->wordindex);
+    free(bw);
+}
+
+/* Whether a model file is in the binary format (otherwise it is gzipped text) */
+int binmodel_is_binary(char *modelfilename) {
+    FILE *fp;
+    char magic[8];
+    int isbin;
+    if ((fp = fopen(modelfilename, "rb")) == NULL)
+	return(0);
+    isbin = fread(magic, 1, 8, fp) == 8 && memcmp(magic, BINMODEL_MAGIC, 8) == 0;
+    fclose(fp);
+    return(isbin);
+}
+
+int binmodel_find(struct binmodel *bm, char *word) {
+    return(binmodel_find_hashed(bm, word, wordhash_hashf(word)));
+}
+
+int binmodel_find_hashed(struct binmodel *bm, char *word, uint32_t hash) {
+    uint32_t mask, slot;
+    int32_t r;
+    mask = bm->header->hashsize - 1;
+    slot = bm->header->version > BINMODEL_VERSION_2 ? wordhash_mix(hash) : hash;
+    for (slot &= mask; (r = bm->hash[slot]) != -1; slot = (slot + 1) & mask) {
+	if (bm->words[r].hash == hash && strcmp(bm->strings + bm->words[r].word, word) == 0)
+	    return(r);
+    }
+    return(-1);
+}
+
+/* Version 1 header in the current layout (no flags: unpacked matrices) */
+void binmodel_header_from_v1(struct binmodel_header *h, struct binmodel_header_v1 *v1) {
+    memcpy(h->magic, v1->magic, 8);
+    h->byteorder = v1->byteorder;
+    h->version = v1->version;
+    h->longranularity = v1->longranularity;
+    h->wordtypes = v1->wordtypes;
+    h->total_wordcount = v1->total_wordcount;
+    h->hashsize = v1->hashsize;
+    h->flags = 0;
+    h->tweetsmatrix = v1->tweetsmatrix;
+    h->centroids = v1->centroids;
+    h->wordmatrix = v1->wordmatrix;
+    h->words = v1->words;
+    h->hash = v1->hash;
+    h->strings = v1->strings;
+    h->coords = v1->coords;
+    h->sparse = v1->sparse;
+    h->size = v1->size;
+}
+
+/* Map a binary model: nothing is parsed or copied, all model data */
+/* (including centroids) points into the shared, read-only mapping */
+int geoloc_read_model_bin(char *modelfilename, double **tm, double **wm) {
+    struct binmodel *bm;
+    struct stat st;
+    int fd;
+    char *base;
+
+    fprintf(stderr, "Mapping binary model from %s...\n", modelfilename);
+    if ((fd = open(modelfilename, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+	perror(modelfilename);
+	return(0);
+    }
+    bm = malloc(sizeof(struct binmodel));
+    bm->size = st.st_size;
+    bm->map = mmap(NULL, bm->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bm->map == MAP_FAILED) {
+	perror(modelfilename);
+	free(bm);
+	return(0);
+    }
+    base = bm->map;
+    bm->header = (struct binmodel_header *) base;
+    if (bm->size >= sizeof(struct binmodel_header_v1) && bm->header->version == BINMODEL_VERSION_1) {
+	binmodel_header_from_v1(&bm->header1, (struct binmodel_header_v1 *) base);
+	bm->header = &bm->header1;
+    }
+    if (bm->size < sizeof(struct binmodel_header) || bm->header->byteorder != BINMODEL_BYTEORDER ||
+	bm->header->version < BINMODEL_VERSION_1 || bm->header->version > BINMODEL_VERSION || bm->header->size != (int64_t)bm->size) {
+	fprintf(stderr, "File error reading model (bad binary header, or model written on a different architecture)\n");
+	munmap(bm->map, bm->size);
+	free(bm);
+	return(0);
+    }
+    g_longranularity = bm->header->longranularity;
+    g_latgranularity = g_longranularity / 2;
+    fprintf(stderr, "Stored model has %i/%i granularity; grid size = %lg° x %lg°\n", g_longranularity, g_latgranularity, (double)360/g_longranularity, (double)360/g_longranularity);
+    bm->words = (struct binmodel_word *) (base + bm->header->words);
+    bm->hash = (int32_t *) (base + bm->header->hash);
+    bm->strings = base + bm->header->strings;
+    bm->coords = (struct coordinate *) (base + bm->header->coords);
+    bm->sparse = (struct sparsematrix *) (base + bm->header->sparse);
+    g_centroids = (struct centroids *) (base + bm->header->centroids);
+    g_wordtypes = bm->header->wordtypes;
+    g_total_wordcount = bm->header->total_wordcount;
+    g_binmodel = bm;
+    fprintf(stderr, "Done...\n");
+    fprintf(stderr, "Number of word types in model: %i\n", g_wordtypes);
+    fprintf(stderr, "Number of word tokens in model: %i\n", g_total_wordcount);
+    *tm = (double *) (base + bm->header->tweetsmatrix);
+    *wm = (double *) (base + bm->header->wordmatrix);
+    return(1);
+}
+
+/* Computes the density matrix of a training word into the scratch grid w */
+/* and adds the word's mass to wordmatrix (unless it is NULL: the caller  */
+/* adds w). Returns the sparse matrix to store, or NULL with --nomatrix   */
+struct sparsematrix *train_word_matrix(int wordindex, double *w, double *wordmatrix, struct stats *st) {
+    struct sparsematrix *sm = NULL;
+    int64_t t, kde = 0;
+    int j;
+    t = stats_clock();
+    matrix_set(w, 0.0); /* Word prior is included only at classification time */
+    word_matrix_from_coords(w, wordindex);
+    if (g_nomatrix == 0) {
+	sm = matrix_to_sparsematrix(w);
+    }
+    if (wordmatrix != NULL)
+	matrix_add(w, wordmatrix); /* Add this word's mass to total */
+    if (g_stats) {
+	stats_lap(&kde, t);
+	st->kde_ns += kde;
+	st->kde_max_ns = kde > st->kde_max_ns ? kde : st->kde_max_ns;
+	st->words++;
+	for (j = 0; sm != NULL && sm[j].x != -1; j++) { }
+	st->nonzeros += j;
+    }
+    return(sm);
+}
+
+/* Serializes one word of a model being trained and releases its matrix; */
+/* for text models, tb holds the word's record (see textbuf_word)          */
+void train_write_word(struct gzwriter *gz, struct binmodel_writer *bw, int i, struct sparsematrix *sm, struct textbuf *tb) {
+    if (i % 5000 == 0)
+	fprintf(stderr, "Calculating p(c|w_i) for i=%i\n", i);
+    if (bw != NULL) {
+	binmodel_writer_add_word(bw, i, sm);
+	free(sm);
+	return;
+    }
+    modelindex_writer_word(g_indexwriter, gz, wc_list[i].word, wc_list[i].numcoords);
+    gzwriter_put(gz, tb->buf, tb->len);
+}
+
+/* Word matrices are independent, so with --threads they are computed by */
+/* a pool of workers, each with its own scratch grid, while the main      */
+/* thread writes finished words strictly in order.  Workers stay at most  */
+/* TRAINWINDOW words ahead of the writer and also format the records of   */
+/* text models, which the gzwriter's own threads then compress.  Each     */
+/* worker then waits for its word's turn to add it to the wordmatrix, so  */
+/* the sum is taken in the same order as with a single thread             */
+#define TRAINWINDOW 4096
+
+struct trainpool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;            /* A word was finished or written */
+    int *words;                     /* wc_list indices of words to compute */
+    int numwords;
+    int next;                       /* Next position to be claimed by a worker */
+    int written;                    /* Positions written so far */
+    struct sparsematrix **results;  /* Ring of TRAINWINDOW finished matrices */
+    struct textbuf *texts;          /* and, for text models, their records  */
+    int format;                     /* Whether workers format the records   */
+    char *done;
+    double *wordmatrix;
+    int summed;                     /* Positions added to wordmatrix so far */
+};
+
+struct trainpool_worker {
+    struct trainpool *pool;
+};
+
+void *trainpool_worker(void *arg) {
+    struct trainpool_worker *worker = arg;
+    struct trainpool *pool = worker->pool;
+    struct sparsematrix *sm;
+    struct textbuf tb;
+    struct stats st;
+    double *w;
+    int pos;
+    memset(&st, 0, sizeof(struct stats));
+    w = matrix_init(0.0);
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->numwords && pool->next >= pool->written + TRAINWINDOW)
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	pos = pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	if (pos >= pool->numwords)
+	    break;
+	sm = train_word_matrix(pool->words[pos], w, NULL, &st);
+	memset(&tb, 0, sizeof(struct textbuf));
+	if (pool->format) {
+	    textbuf_word(&tb, pool->words[pos], sm, 0);
+	    free(sm);
+	    sm = NULL;
+	}
+	pthread_mutex_lock(&pool->lock);
+	while (pool->summed != pos)
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	matrix_add(w, pool->wordmatrix); /* Only the worker whose turn it is writes */
+	pthread_mutex_lock(&pool->lock);
+	pool->summed++;
+	pool->results[pos % TRAINWINDOW] = sm;
+	pool->texts[pos % TRAINWINDOW] = tb;
+	pool->done[pos % TRAINWINDOW] = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+    }
+    if (g_stats)
+	stats_merge(&st);
+    free(w);
+    return(NULL);
+}
+
+/* Compute and write the matrices of words[0..numwords-1] with g_threads workers, */
+/* adding their mass to wordmatrix                                               */
+void train_words_parallel(struct gzwriter *gz, struct binmodel_writer *bw, int *words, int numwords, double *wordmatrix) {
+    struct trainpool pool;
+    struct trainpool_worker *workers;
+    struct sparsematrix *sm;
+    struct textbuf tb;
+    struct stats st;
+    pthread_t *threads;
+    int t, pos;
+    int64_t tw;
+
+    memset(&st, 0, sizeof(struct stats));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.words = words;
+    pool.numwords = numwords;
+    pool.next = 0;
+    pool.written = 0;
+    pool.results = malloc(sizeof(struct sparsematrix *) * TRAINWINDOW);
+    pool.texts = malloc(sizeof(struct textbuf) * TRAINWINDOW);
+    pool.format = bw == NULL;
+    pool.done = calloc(TRAINWINDOW, sizeof(char));
+    pool.wordmatrix = wordmatrix;
+    pool.summed = 0;
+    threads = malloc(sizeof(pthread_t) * g_threads);
+    workers = malloc(sizeof(struct trainpool_worker) * g_threads);
+    for (t = 0; t < g_threads; t++) {
+	workers[t].pool = &pool;
+	if (pthread_create(threads + t, NULL, trainpool_worker, workers + t) != 0) {
+	    fprintf(stderr, "ERROR: could not create thread\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    for (pos = 0; pos < numwords; pos++) {
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.done[pos % TRAINWINDOW])
+	    pthread_cond_wait(&pool.cond, &pool.lock);
+	sm = pool.results[pos % TRAINWINDOW];
+	tb = pool.texts[pos % TRAINWINDOW];
+	pool.done[pos % TRAINWINDOW] = 0;
+	pool.written++;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	tw = stats_clock();
+	train_write_word(gz, bw, words[pos], sm, &tb);
+	free(tb.buf);
+	stats_lap(&st.write_ns, tw);
+    }
+    if (g_stats)
+	stats_merge(&st);
+    for (t = 0; t < g_threads; t++)
+	pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    free(pool.results);
+    free(pool.texts);
+    free(pool.done);
+    free(threads);
+    free(workers);
+}
+
+/* Documents added one at a time to p(c) and to the per-cell centroid sums */
+struct docgrid {
+    struct kde_kernel k;
+    double *lats;
+    double *lons;
+    int *counts;
+};
+
+void docgrid_init(struct docgrid *g) {
+    kde_kernel_init(&g->k, g_sigma, g_sigma, 0.0);
+    g->lats = calloc(g_latgranularity * g_longranularity, sizeof(double));
+    g->lons = calloc(g_latgranularity * g_longranularity, sizeof(double));
+    g->counts = calloc(g_latgranularity * g_longranularity, sizeof(int));
+}
+
+void docgrid_add(struct docgrid *g, double *tweetsmatrix, double lat, double lon) {
+    float flat, flon;
+    int cell;
+    /* Same single precision the in-memory path stores document coordinates in */
+    flat = (float)lat;
+    flon = (float)lon;
+    if (g_nokde)
+	tweetsmatrix[LONTOX(flon)+LATTOY(flat)*g_longranularity] += 1.0;
+    else
+	matrix_kde_add_point(tweetsmatrix, flat, flon, &g->k);
+    cell = LONTOX(flon) + LATTOY(flat) * g_longranularity;
+    g->lats[cell] += flat;
+    g->lons[cell] += flon;
+    g->counts[cell] += 1;
+}
+
+void docgrid_free(struct docgrid *g) {
+    kde_kernel_free(&g->k);
+    free(g->lats);
+    free(g->lons);
+    free(g->counts);
+}
+
+/* Fused ingestion of training documents                                   */
+/* A reader thread decompresses and tokenizes the training set into        */
+/* batches of documents. Two consumers take every batch in turn: a grid    */
+/* thread adds the documents to p(c) and the centroid sums as they arrive, */
+/* and the caller of ingest_next() adds their features to wc_list (or      */
+/* counts or spills them). Both see the documents in corpus order, so the  */
+/* model is the same as from one serial pass, which is what --threads 1    */
+/* still does.                                                             */
+
+#define INGESTBATCHSIZE 4096  /* Documents per batch                  */
+#define INGESTRINGSIZE  4     /* Batches being filled or consumed     */
+
+struct ingestbatch {
+    double *lats;
+    double *lons;
+    int *firstword;           /* Index of each document's first feature, numdocs + 1 entries */
+    size_t *wordoffsets;      /* Offset of each feature in text                              */
+    char *text;               /* The features, NUL-terminated                                */
+    size_t textlen;
+    size_t textsize;
+    int numdocs;
+    int numwords;
+    int wordsize;
+    int64_t seq;              /* Batch number, -1 until the slot is first filled */
+    int refs;                 /* Consumers not yet done with the batch           */
+};
+
+struct ingest {
+    struct docreader *r;
+    struct docgrid *grid;     /* NULL if documents only have their features counted */
+    double *tweetsmatrix;
+    int threaded;
+    int started;
+    struct ingestbatch ring[INGESTRINGSIZE];
+    pthread_t reader;
+    pthread_t gridder;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t numbatches;       /* Set by the reader at end of input, -1 before */
+    struct ingestbatch *cur;  /* Batch the caller is in, and its position     */
+    int64_t nextbatch;
+    int doc;
+    char **words;
+    int wordsarraysize;
+};
+
+/* Tokenize up to INGESTBATCHSIZE documents into b; returns how many */
+int ingestbatch_fill(struct ingestbatch *b, struct docreader *r, char ***words, int *wordsarraysize) {
+    char *line;
+    int i, n;
+    size_t len;
+    b->numdocs = b->numwords = 0;
+    b->textlen = 0;
+    while (b->numdocs < INGESTBATCHSIZE && (line = docreader_next(r)) != NULL) {
+	n = training_parse_line(line, b->lats + b->numdocs, b->lons + b->numdocs, words, wordsarraysize);
+	b->firstword[b->numdocs++] = b->numwords;
+	if (b->numwords + n > b->wordsize) {
+	    while (b->numwords + n > b->wordsize)
+		b->wordsize *= 2;
+	    b->wordoffsets = realloc(b->wordoffsets, sizeof(size_t) * b->wordsize);
+	}
+	for (i = 0; i < n; i++) {
+	    len = strlen((*words)[i]) + 1;
+	    if (b->textlen + len > b->textsize) {
+		while (b->textlen + len > b->textsize)
+		    b->textsize *= 2;
+		b->text = realloc(b->text, b->textsize);
+	    }
+	    memcpy(b->text + b->textlen, (*words)[i], len);
+	    b->wordoffsets[b->numwords++] = b->textlen;
+	    b->textlen += len;
+	}
+	docreader_release(r);
+    }
+    b->firstword[b->numdocs] = b->numwords;
+    return(b->numdocs);
+}
+
+void *ingest_reader(void *arg) {
+    struct ingest *in = (struct ingest *)arg;
+    struct ingestbatch *b;
+    char **words = NULL;
+    int n, wordsarraysize = 0;
+    int64_t seq;
+    for (seq = 0; ; seq++) {
+	b = in->ring + seq % INGESTRINGSIZE;
+	pthread_mutex_lock(&in->lock);
+	while (b->refs > 0)
+	    pthread_cond_wait(&in->cond, &in->lock);
+	pthread_mutex_unlock(&in->lock);
+	n = ingestbatch_fill(b, in->r, &words, &wordsarraysize);
+	pthread_mutex_lock(&in->lock);
+	if (n == 0)
+	    in->numbatches = seq;
+	else {
+	    b->seq = seq;
+	    b->refs = in->grid != NULL ? 2 : 1;
+	}
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->lock);
+	if (n == 0)
+	    break;
+    }
+    free(words);
+    return(NULL);
+}
+
+/* Batch number seq for a consumer, or NULL at end of input */
+struct ingestbatch *ingest_wait(struct ingest *in, int64_t seq) {
+    struct ingestbatch *b;
+    b = in->ring + seq % INGESTRINGSIZE;
+    pthread_mutex_lock(&in->lock);
+    while (b->seq != seq && in->numbatches != seq)
+	pthread_cond_wait(&in->cond, &in->lock);
+    pthread_mutex_unlock(&in->lock);
+    return(b->seq == seq ? b : NULL);
+}
+
+void ingest_done(struct ingest *in, struct ingestbatch *b) {
+    pthread_mutex_lock(&in->lock);
+    if (--b->refs == 0)
+	pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+}
+
+void *ingest_gridder(void *arg) {
+    struct ingest *in = (struct ingest *)arg;
+    struct ingestbatch *b;
+    int64_t seq;
+    int d;
+    for (seq = 0; (b = ingest_wait(in, seq)) != NULL; seq++) {
+	for (d = 0; d < b->numdocs; d++)
+	    docgrid_add(in->grid, in->tweetsmatrix, b->lats[d], b->lons[d]);
+	ingest_done(in, b);
+    }
+    return(NULL);
+}
+
+/* Read filename; if grid is given, every document is also added to it and */
+/* to tweetsmatrix                                                          */
+struct ingest *ingest_open(char *filename, struct docgrid *grid, double *tweetsmatrix) {
+    struct ingest *in;
+    struct ingestbatch *b;
+    int i;
+    in = calloc(1, sizeof(struct ingest));
+    in->r = docreader_open(filename);
+    in->grid = grid;
+    in->tweetsmatrix = tweetsmatrix;
+    in->threaded = g_threads > 1;
+    if (!in->threaded)
+	return(in);
+    for (i = 0; i < INGESTRINGSIZE; i++) {
+	b = in->ring + i;
+	b->lats = malloc(sizeof(double) * INGESTBATCHSIZE);
+	b->lons = malloc(sizeof(double) * INGESTBATCHSIZE);
+	b->firstword = malloc(sizeof(int) * (INGESTBATCHSIZE + 1));
+	b->wordsize = 16 * INGESTBATCHSIZE;
+	b->wordoffsets = malloc(sizeof(size_t) * b->wordsize);
+	b->textsize = 65536;
+	b->text = malloc(b->textsize);
+	b->seq = -1;
+    }
+    in->numbatches = -1;
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+    pthread_create(&in->reader, NULL, ingest_reader, in);
+    if (grid != NULL)
+	pthread_create(&in->gridder, NULL, ingest_gridder, in);
+    return(in);
+}
+
+/* Features of the next document (NULL-terminated in *words, which stay   */
+/* valid until the next call) and its coordinates; -1 at end of input     */
+int ingest_next(struct ingest *in, double *lat, double *lon, char ***words) {
+    struct ingestbatch *b;
+    char *line;
+    int i, n, d;
+    if (!in->threaded) {
+	if (in->started)
+	    docreader_release(in->r);
+	in->started = 1;
+	if ((line = docreader_next(in->r)) == NULL)
+	    return(-1);
+	n = training_parse_line(line, lat, lon, &in->words, &in->wordsarraysize);
+	if (in->grid != NULL)
+	    docgrid_add(in->grid, in->tweetsmatrix, *lat, *lon);
+	*words = in->words;
+	return(n);
+    }
+    if (in->cur != NULL && in->doc == in->cur->numdocs) {
+	ingest_done(in, in->cur);
+	in->cur = NULL;
+	in->nextbatch++;
+    }
+    if (in->cur == NULL) {
+	if ((in->cur = ingest_wait(in, in->nextbatch)) == NULL)
+	    return(-1);
+	in->doc = 0;
+    }
+    b = in->cur;
+    d = in->doc++;
+    n = b->firstword[d + 1] - b->firstword[d];
+    if (n + 1 > in->wordsarraysize) {
+	in->wordsarraysize = n + 1 > 2 * in->wordsarraysize ? n + 1 : 2 * in->wordsarraysize;
+	in->words = realloc(in->words, sizeof(char *) * in->wordsarraysize);
+    }
+    for (i = 0; i < n; i++)
+	in->words[i] = b->text + b->wordoffsets[b->firstword[d] + i];
+    in->words[n] = NULL;
+    *lat = b->lats[d];
+    *lon = b->lons[d];
+    *words = in->words;
+    return(n);
+}
+
+/* Only after ingest_next() has returned -1 */
+void ingest_close(struct ingest *in) {
+    int i;
+    if (in->threaded) {
+	pthread_join(in->reader, NULL);
+	if (in->grid != NULL)
+	    pthread_join(in->gridder, NULL);
+	pthread_mutex_destroy(&in->lock);
+	pthread_cond_destroy(&in->cond);
+	for (i = 0; i < INGESTRINGSIZE; i++) {
+	    free(in->ring[i].lats);
+	    free(in->ring[i].lons);
+	    free(in->ring[i].firstword);
+	    free(in->ring[i].wordoffsets);
+	    free(in->ring[i].text);
+	}
+    }
+    docreader_close(in->r);
+    free(in->words);
+    free(in);
+}
+
+/* Read training data in one pass: features and their coordinates go into */
+/* wc_list, documents onto the p(c) grid and the centroid sums             */
+void training_read(char *filename, double *tweetsmatrix, struct docgrid *grid) {
+    struct ingest *in;
+    char **words;
+    int i, numwords;
+    double lat, lon;
+    
+    global_wh_train = wordhash_init(128);
+    in = ingest_open(filename, grid, tweetsmatrix);
+    while ((numwords = ingest_next(in, &lat, &lon, &words)) != -1) {
+	for (i = 0; i < numwords; i++)
+	    word_coord_add_word(words[i], lat, lon, 1); /* Add word, lat, lon to table */
+    }
+    ingest_close(in);
+}
+
+/* Streaming training (--max-memory)                                        */
+/* Pass one only counts features, so the threshold is known before any     */
+/* coordinates are stored. Pass two puts the documents straight onto the   */
+/* p(c) grid and the centroid sums, and buffers the (word, lat, lon)       */
+/* occurrences of the kept words; a full buffer is sorted by word and      */
+/* spilled to a temporary run. The runs are then merged a batch of words   */
+/* at a time, so only the words currently being estimated are in memory.  */
+
+struct spillrecord {
+    int32_t word;
+    struct coordinate coord;
+};
+
+struct spillrun {
+    FILE *fp;                    /* Temporary file, or NULL if the run is kept in memory */
+    struct spillrecord *records; /* In-memory run (nothing had to be spilled)            */
+    int64_t numrecords;
+    int64_t pos;
+    struct spillrecord cur;
+    int valid;                   /* Whether cur holds a record not yet merged            */
+};
+
+struct spill {
+    struct spillrecord *buf;
+    struct spillrecord *sorted;
+    int64_t bufsize;
+    int64_t numrecords;
+    int64_t *bucket;             /* Counting sort offsets, one per kept word + 1 */
+    int *counts;                 /* Occurrences with coordinates per kept word   */
+    int numwords;
+    int nextword;                /* Next word to merge out of the runs           */
+    struct spillrun *runs;
+    int numruns;
+};
+
+/* Pass one: count feature occurrences and add the words that reach the   */
+/* threshold to wc_list (in order of first occurrence)                    */
+int training_count(char *filename, int **counts) {
+    struct ingest *in;
+    struct wordhash *wh;
+    char **words, **vocab;
+    int i, j, inserted, numwords, *occurrences = NULL, occurrencesize = 0, numtypes = 0, numkept;
+    double lat, lon;
+
+    in = ingest_open(filename, NULL, NULL);
+    wh = wordhash_init(128);
+    while ((numwords = ingest_next(in, &lat, &lon, &words)) != -1) {
+	for (i = 0; i < numwords; i++) {
+	    j = wordhash_find_or_insert(wh, words[i], &inserted);
+	    if (inserted) {
+		if (j >= occurrencesize) {
+		    occurrencesize = occurrencesize == 0 ? 1024 : occurrencesize * 2;
+		    occurrences = realloc(occurrences, sizeof(int) * occurrencesize);
+		}
+		occurrences[j] = 0;
+		numtypes++;
+	    }
+	    if (lat != 0.0 || lon != 0.0)
+		occurrences[j]++;
+	}
+    }
+    ingest_close(in);
+
+    vocab = malloc(sizeof(char *) * (numtypes + 1));
+    for (i = 0; i < wh->tablesize; i++) {
+	if (wh->table[i].value != -1)
+	    vocab[wh->table[i].value] = wh->table[i].word;
+    }
+    global_wh_train = wordhash_init(128);
+    *counts = malloc(sizeof(int) * (numtypes + 1));
+    for (i = 0, numkept = 0; i < numtypes; i++) {
+	if (occurrences[i] >= g_threshold) {
+	    word_coord_add_word(vocab[i], 0.0, 0.0, 1);
+	    (*counts)[numkept++] = occurrences[i];
+	}
+    }
+    fprintf(stderr, "Number of word types in training set: %i (%i at threshold)\n", numtypes, numkept);
+    free(vocab);
+    free(occurrences);
+    wordhash_free(wh);
+    return(numkept);
+}
+
+struct spill *spill_init(int *counts, int numwords) {
+    struct spill *sp;
+    sp = calloc(1, sizeof(struct spill));
+    /* Half the budget buffers occurrences, the other half is the sort target */
+    sp->bufsize = (int64_t)g_max_memory * 1024 * 1024 / (2 * sizeof(struct spillrecord));
+    sp->bufsize = sp->bufsize < 1024 ? 1024 : sp->bufsize;
+    sp->buf = malloc(sizeof(struct spillrecord) * sp->bufsize);
+    sp->sorted = malloc(sizeof(struct spillrecord) * sp->bufsize);
+    sp->bucket = malloc(sizeof(int64_t) * (numwords + 1));
+    if (sp->buf == NULL || sp->sorted == NULL || sp->bucket == NULL) {
+	fprintf(stderr, "Out of memory.\n");
+	exit(EXIT_FAILURE);
+    }
+    sp->counts = counts;
+    sp->numwords = numwords;
+    return(sp);
+}
+
+/* Stable counting sort of the buffer by word; occurrences of a word stay in corpus order */
+void spill_sort(struct spill *sp) {
+    int64_t i;
+    int w;
+    memset(sp->bucket, 0, sizeof(int64_t) * (sp->numwords + 1));
+    for (i = 0; i < sp->numrecords; i++)
+	sp->bucket[sp->buf[i].word + 1]++;
+    for (w = 0; w < sp->numwords; w++)
+	sp->bucket[w + 1] += sp->bucket[w];
+    for (i = 0; i < sp->numrecords; i++)
+	sp->sorted[sp->bucket[sp->buf[i].word]++] = sp->buf[i];
+}
+
+void spill_flush(struct spill *sp) {
+    struct spillrun *run;
+    spill_sort(sp);
+    sp->runs = realloc(sp->runs, sizeof(struct spillrun) * (sp->numruns + 1));
+    run = sp->runs + sp->numruns++;
+    memset(run, 0, sizeof(struct spillrun));
+    if ((run->fp = tmpfile()) == NULL) {
+	perror("Creating temporary run");
+	exit(EXIT_FAILURE);
+    }
+    if (fwrite(sp->sorted, sizeof(struct spillrecord), sp->numrecords, run->fp) != sp->numrecords) {
+	perror("Writing temporary run");
+	exit(EXIT_FAILURE);
+    }
+    run->numrecords = sp->numrecords;
+    fprintf(stderr, "Spilled run %i (%lli occurrences)\n", sp->numruns, (long long)sp->numrecords);
+    sp->numrecords = 0;
+}
+
+void spill_add(struct spill *sp, int word, double lat, double lon) {
+    if (sp->numrecords == sp->bufsize)
+	spill_flush(sp);
+    sp->buf[sp->numrecords].word = word;
+    sp->buf[sp->numrecords].coord.lat = (float)lat;
+    sp->buf[sp->numrecords].coord.lon = (float)lon;
+    sp->numrecords++;
+}
+
+void spillrun_next(struct spillrun *run) {
+    if (run->pos >= run->numrecords) {
+	run->valid = 0;
+	return;
+    }
+    if (run->fp == NULL) {
+	run->cur = run->records[run->pos];
+    } else if (fread(&run->cur, sizeof(struct spillrecord), 1, run->fp) != 1) {
+	perror("Reading temporary run");
+	exit(EXIT_FAILURE);
+    }
+    run->pos++;
+    run->valid = 1;
+}
 
-    fp = gzopen(modelfilename, "w");
-    fprintf(stderr, "Writing p(c) matrix\n");
-    sm = matrix_to_sparsematrix(tweetsmatrix);
-    gzprintf(fp, "#LONGRANULARITY# %i\n", g_longranularity);
-    gzprintf(fp, "#TWEETMATRIX#\n");
-    for (j = 0; sm[j].x != -1; j++)
-	gzprintf(fp, "%i %i %lg\n", sm[j].x, sm[j].y, sm[j].value);
-    gzprintf(fp, "#END#\n");
-    free(sm);
-    gzprintf(fp, "#CENTROIDS#\n");
-    for (j = 0; j < g_longranularity * g_latgranularity; j++) {
-	gzprintf(fp, "%g %g\n", g_centroids[j].lat, g_centroids[j].lon);
+/* All occurrences added: release the buffer and start reading the runs */
+void spill_finish(struct spill *sp) {
+    int r;
+    if (sp->numruns == 0) {
+	spill_sort(sp);
+	sp->runs = calloc(1, sizeof(struct spillrun));
+	sp->runs[0].records = sp->sorted;
+	sp->runs[0].numrecords = sp->numrecords;
+	sp->numruns = 1;
+    } else {
+	if (sp->numrecords > 0)
+	    spill_flush(sp);
+	for (r = 0; r < sp->numruns; r++)
+	    rewind(sp->runs[r].fp);
+	free(sp->sorted);
     }
-    gzprintf(fp, "#END#\n");
-    
-    for (i = 0; i <= wc_list_max; i++) {
-	for (j = 0, cl = wc_list[i].coordinate_list; cl != NULL; cl = cl->next, j++) { }
-	if (j < g_threshold)
-	    continue;
-	/* print #WORD#, followed by word + lats and lons */
-	gzprintf(fp, "#WORD# %i %s %lf\n", i, wc_list[i].word, wc_list[i].weight);
-	for (cl = wc_list[i].coordinate_list; cl != NULL; cl = cl->next) {
-	    gzprintf(fp, "%lg %lg\n", cl->lat, cl->lon);
+    sp->sorted = NULL;
+    free(sp->buf);
+    sp->buf = NULL;
+    free(sp->bucket);
+    sp->bucket = NULL;
+    for (r = 0; r < sp->numruns; r++)
+	spillrun_next(sp->runs + r);
+}
+
+/* Merge the next words out of the runs into wc_list[].coords, stopping    */
+/* before maxcoords coordinates are loaded (but always loading one word).  */
+/* Runs are visited in the order they were written, which keeps each       */
+/* word's coordinates in corpus order.                                     */
+int spill_next_words(struct spill *sp, int *words, int64_t maxcoords) {
+    struct spillrun *run;
+    int64_t total;
+    int n, w, r;
+    for (n = 0, total = 0; sp->nextword < sp->numwords && (n == 0 || total + sp->counts[sp->nextword] <= maxcoords); n++) {
+	w = sp->nextword++;
+	wc_list[w].coordsize = sp->counts[w] > 0 ? sp->counts[w] : 1;
+	wc_list[w].coords = malloc(sizeof(struct coordinate) * wc_list[w].coordsize);
+	for (r = 0; r < sp->numruns; r++) {
+	    for (run = sp->runs + r; run->valid && run->cur.word == w; spillrun_next(run))
+		word_coord_append(w, run->cur.coord.lat, run->cur.coord.lon);
 	}
+	total += wc_list[w].numcoords;
+	words[n] = w;
+    }
+    return(n);
+}
 
-	sm = wc_list[i].sparsematrix;
-	/* print sparse matrix                            */
-	if (g_nomatrix == 0) {
-	    gzprintf(fp, "#MATRIX#\n");
-	    for (j = 0; sm[j].x != -1; j++) {
-		gzprintf(fp, "%i %i %lg\n", sm[j].x, sm[j].y, sm[j].value);
+void spill_free(struct spill *sp) {
+    int r;
+    for (r = 0; r < sp->numruns; r++) {
+	if (sp->runs[r].fp != NULL)
+	    fclose(sp->runs[r].fp);
+	free(sp->runs[r].records);
+    }
+    free(sp->runs);
+    free(sp);
+}
+
+/* Pass two: p(c) and centroids go straight onto the grid, word occurrences into the spill */
+struct spill *training_spill(char *filename, int *counts, int numwords, double *tweetsmatrix) {
+    struct ingest *in;
+    struct spill *sp;
+    struct docgrid grid;
+    char **words;
+    int i, w, n;
+    double lat, lon;
+
+    sp = spill_init(counts, numwords);
+    docgrid_init(&grid);
+    in = ingest_open(filename, &grid, tweetsmatrix);
+    while ((n = ingest_next(in, &lat, &lon, &words)) != -1) {
+	if (lat != 0.0 || lon != 0.0) {
+	    for (i = 0; i < n; i++) {
+		if ((w = wordhash_find(global_wh_train, words[i])) != -1)
+		    spill_add(sp, w, lat, lon);
 	    }
-	    free(sm);
 	}
-	gzprintf(fp, "#END#\n");
     }
-    gzprintf(fp, "#END#\n");
-    fprintf(stderr, "Writing (unnormalized) p(c)_w matrix...\n");
-    sm = matrix_to_sparsematrix(wordmatrix);
-    /* Print summed wordmatrix */
-    gzprintf(fp, "#WORDMATRIX#\n");
-    for (j = 0; sm[j].x != -1; j++) {
-	gzprintf(fp, "%i %i %lg\n", sm[j].x, sm[j].y, sm[j].value);
+    ingest_close(in);
+    centroids_from_sums(grid.lats, grid.lons, grid.counts);
+    docgrid_free(&grid);
+    spill_finish(sp);
+    return(sp);
+}
+
+void train_words(struct gzwriter *gz, struct binmodel_writer *bw, int *words, int numwords, double *wordmatrix) {
+    struct sparsematrix *sm;
+    struct textbuf tb = { NULL, 0, 0 };
+    struct stats st;
+    double *w;
+    int i;
+    int64_t t;
+    if (g_threads > 1) {
+	train_words_parallel(gz, bw, words, numwords, wordmatrix);
+	return;
     }
-    gzprintf(fp, "#END#\n");
-    free(sm);
-    gzclose(fp);
+    memset(&st, 0, sizeof(struct stats));
+    w = matrix_init(0.0);
+    for (i = 0; i < numwords; i++) {
+	sm = train_word_matrix(words[i], w, wordmatrix, &st);
+	t = stats_clock();
+	if (bw == NULL) {
+	    tb.len = 0;
+	    textbuf_word(&tb, words[i], sm, 0);
+	    free(sm);
+	    sm = NULL;
+	}
+	train_write_word(gz, bw, words[i], sm, &tb);
+	stats_lap(&st.write_ns, t);
+    }
+    if (g_stats)
+	stats_merge(&st);
+    free(tb.buf);
+    free(w);
 }
 
 int geoloc_train_model(char *trainingfilename, char *modelfilename, char *stopwordsfilename, double **tm, double **wm) {
-    int i, j;
-    gzFile fp;
-    double *tweetsmatrix, *wordmatrix, *w;
-    struct sparsematrix *sm;
-    struct coordinate_list *cl;
+    int i, j, n, *words, *coordcounts, numwords;
+    struct gzwriter *gz = NULL;
+    double *tweetsmatrix, *wordmatrix;
+    struct binmodel_writer *bw = NULL;
+    struct spill *sp = NULL;
+    struct docgrid grid;
+    struct stat st;
+    char *indexfilename;
+    int64_t t, *offsets;
 
+    t = stats_clock();
     if (stopwordsfilename != NULL)
 	read_stopwords(stopwordsfilename);
     
@@ -1193,123 +5556,812 @@ int geoloc_train_model(char *trainingfilename, char *modelfilename, char *stopwo
     } else {	
 	fprintf(stderr, "Using KDE\n");
     }
-    fprintf(stderr, "Reading document features/coordinates from training set: '%s'...\n", trainingfilename);
-    training_read(trainingfilename);
-    
-    fp = gzopen(modelfilename, "w");
-    if(fp == NULL)
-	exit(EXIT_FAILURE);
-    
     tweetsmatrix = matrix_init(g_tweetprior); /* Tweet prior must be precalculated into matrix since we normalize */
-    fprintf(stderr, "Calculating p(c) matrix...\n");
-    if (g_nokde) {
-	matrix_nokde_from_coords(tweetsmatrix, g_tweetcoords_head); /* Matrix for p(c) (prior for tweet origin) */
+    if (g_max_memory > 0) {
+	if (strcmp(trainingfilename, "-") == 0) {
+	    fprintf(stderr, "--max-memory reads the training set twice, so it can't be read from stdin\n");
+	    exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "Counting document features in training set: '%s'...\n", trainingfilename);
+	numwords = training_count(trainingfilename, &coordcounts);
+	fprintf(stderr, "Calculating p(c) matrix and buffering features (%li MB)...\n", g_max_memory);
+	sp = training_spill(trainingfilename, coordcounts, numwords, tweetsmatrix);
+	words = malloc(sizeof(int) * (numwords + 1));
+	for (i = 0; i < numwords; i++)
+	    words[i] = i;
     } else {
-	matrix_kde_from_coords(tweetsmatrix, g_tweetcoords_head, g_sigma, g_sigma, 0.0); /* Matrix for p(c) (prior for tweet origin) */
+	fprintf(stderr, "Reading document features/coordinates and calculating p(c) matrix from training set: '%s'...\n", trainingfilename);
+	docgrid_init(&grid); /* Matrix for p(c) (prior for tweet origin) and the centroids, as documents are read */
+	training_read(trainingfilename, tweetsmatrix, &grid);
+	centroids_from_sums(grid.lats, grid.lons, grid.counts);
+	docgrid_free(&grid);
+	fprintf(stderr, "Number of word types in training set: %i\n", wc_list_max);
+	words = malloc(sizeof(int) * (wc_list_max + 1));
+	coordcounts = malloc(sizeof(int) * (wc_list_max + 1));
+	for (i = 0, numwords = 0; i <= wc_list_max; i++) {
+	    if (wc_list[i].numcoords >= g_threshold) {
+		words[numwords] = i;
+		coordcounts[numwords++] = wc_list[i].numcoords;
+	    }
+	}
     }
+    g_tweetmass = matrix_sum(tweetsmatrix);
     matrix_normalize(tweetsmatrix);
-    fprintf(stderr, "Writing p(c) matrix\n");
-    sm = matrix_to_sparsematrix(tweetsmatrix);
-    gzprintf(fp, "#LONGRANULARITY# %i\n", g_longranularity);
-    gzprintf(fp, "#TWEETMATRIX#\n");
-    for (j = 0; sm[j].x != -1; j++)
-	gzprintf(fp, "%i %i %lg\n", sm[j].x, sm[j].y, sm[j].value);
-    gzprintf(fp, "#END#\n");
-    free(sm);
     
-    find_centroids(g_tweetcoords_head);
-    gzprintf(fp, "#CENTROIDS#\n");
-    for (j = 0; j < g_longranularity * g_latgranularity; j++) {
-	gzprintf(fp, "%g %g\n", g_centroids[j].lat, g_centroids[j].lon);
+    if (g_model_format == MODEL_FORMAT_TEXT) {
+	gz = gzwriter_open(modelfilename, g_compress_level);
+	fprintf(stderr, "Writing p(c) matrix\n");
+	g_indexwriter = modelindex_writer_open(modelfilename);
+	model_write_header(gz, tweetsmatrix);
+    } else {
+	fprintf(stderr, "Writing p(c) matrix and centroids (binary)\n");
+	bw = binmodel_writer_open(modelfilename, tweetsmatrix, words, coordcounts, numwords);
     }
-    gzprintf(fp, "#END#\n");
     free(g_centroids);
+    free(g_centroidcounts);
+    g_centroidcounts = NULL;
     
-    fprintf(stderr, "Number of word types in training set: %i\n", wc_list_max);
     wordmatrix = matrix_init(0.0);
-    
+    stats_lap(&g_stats_total.read_ns, t);
     fprintf(stderr, "Calculating p(c)_w matrix...\n");
-    w = matrix_init(0.0);
-    for (i = 0; i <= wc_list_max; i++) {
-	for (j = 0, cl = wc_list[i].coordinate_list; cl != NULL; cl = cl->next, j++) { }
-	if (j < g_threshold)
+    if (sp != NULL) {
+	/* Estimate as many words at a time as the coordinate budget allows */
+	for (i = 0; (n = spill_next_words(sp, words + i, (int64_t)g_max_memory * 1024 * 1024 / (2 * sizeof(struct coordinate)))) > 0; i += n) {
+	    train_words(gz, bw, words + i, n, wordmatrix);
+	    for (j = i; j < i + n; j++) {
+		free(wc_list[words[j]].coords);
+		wc_list[words[j]].coords = NULL;
+		wc_list[words[j]].numcoords = wc_list[words[j]].coordsize = 0;
+	    }
+	}
+	spill_free(sp);
+    } else {
+	train_words(gz, bw, words, numwords, wordmatrix);
+    }
+    free(words);
+    free(coordcounts);
+    fprintf(stderr, "Writing (unnormalized) p(c)_w matrix...\n");
+    if (bw != NULL) {
+	binmodel_writer_close(bw, wordmatrix);
+    } else {
+	model_write_wordmatrix(gz, g_indexwriter, wordmatrix);
+	offsets = gzwriter_close(gz);
+	modelindex_writer_close(g_indexwriter, modelfilename, offsets);
+	free(offsets);
+	g_indexwriter = NULL;
+    }
+    fprintf(stderr, "Wrote model to '%s'.\n", modelfilename);
+    if (g_stats) {
+	if (stat(modelfilename, &st) == 0)
+	    g_stats_bytes_written += st.st_size;
+	indexfilename = malloc(strlen(modelfilename) + 5);
+	sprintf(indexfilename, "%s.idx", modelfilename);
+	if (bw == NULL && stat(indexfilename, &st) == 0)
+	    g_stats_bytes_written += st.st_size;
+	free(indexfilename);
+    }
+    *tm = tweetsmatrix;
+    *wm = wordmatrix;
+    return(1);
+}
+
+/* Incremental update (--update): fold new training documents into a text */
+/* model. Densities are sums over points, so p(c), the centroids and the   */
+/* summed wordmatrix only get the new points added, and only the words     */
+/* that occur in the new documents have their matrices recomputed.        */
+int geoloc_update_model(char *trainingfilename, char *modelfilename, char *stopwordsfilename, double **tm, double **wm) {
+    struct ingest *in;
+    struct docgrid grid;
+    char **words, *tmpfilename;
+    int i, cell, n, numwords, numoldwords, numdocs, numupdated, numadded, old, *oldnumcoords;
+    double lat, lon, *tweetsmatrix, *wordmatrix, *w, *d;
+
+    if (binmodel_is_binary(modelfilename)) {
+	fprintf(stderr, "Updating requires a text model (binary models are read-only)\n");
+	exit(EXIT_FAILURE);
+    }
+    if (stopwordsfilename != NULL)
+	read_stopwords(stopwordsfilename);
+    if (geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, NULL) == 0)
+	exit(EXIT_FAILURE);
+    if (g_tweetmass <= 0.0 || g_centroidcounts == NULL) {
+	fprintf(stderr, "Model '%s' has no document counts (written by an older geoloc); retrain it to use --update\n", modelfilename);
+	exit(EXIT_FAILURE);
+    }
+    numoldwords = g_wordtypes;
+    oldnumcoords = malloc(sizeof(int) * (numoldwords + 1));
+    for (i = 0; i < numoldwords; i++)
+	oldnumcoords[i] = wc_list[i].numcoords;
+    if (numoldwords > 0) { /* Keep storing word matrices only if the model has them */
+	for (i = 0, g_nomatrix = 1; i < numoldwords; i++) {
+	    if (wc_list[i].sparsematrix != NULL)
+		g_nomatrix = 0;
+	}
+    }
+
+    fprintf(stderr, "Reading new documents from '%s'...\n", trainingfilename);
+    for (cell = 0; cell < g_longranularity * g_latgranularity; cell++)
+	tweetsmatrix[cell] *= g_tweetmass;
+    docgrid_init(&grid);
+    in = ingest_open(trainingfilename, &grid, tweetsmatrix);
+    for (numdocs = 0; (numwords = ingest_next(in, &lat, &lon, &words)) != -1; numdocs++) {
+	for (i = 0; i < numwords; i++)
+	    word_coord_add_word(words[i], lat, lon, 1);
+    }
+    ingest_close(in);
+    g_tweetmass = matrix_sum(tweetsmatrix);
+    matrix_normalize(tweetsmatrix);
+    for (cell = 0; cell < g_longranularity * g_latgranularity; cell++) {
+	if (grid.counts[cell] == 0)
 	    continue;
-	matrix_set(w, 0.0); /* Word prior is included only at classification time */
-	if (i % 5000 == 0)
-	    fprintf(stderr, "Calculating p(c|w_i) for i=%i\n", i);
+	n = g_centroidcounts[cell] + grid.counts[cell];
+	g_centroids[cell].lat = (g_centroids[cell].lat * g_centroidcounts[cell] + grid.lats[cell]) / n;
+	g_centroids[cell].lon = (g_centroids[cell].lon * g_centroidcounts[cell] + grid.lons[cell]) / n;
+	g_centroidcounts[cell] = n;
+    }
+    docgrid_free(&grid);
 
-	if (g_nokde) {
-	    matrix_nokde_from_coords(w, wc_list[i].coordinate_list);
+    fprintf(stderr, "Updating p(c)_w matrices...\n");
+    d = matrix_init(0.0);
+    for (i = 0, numupdated = 0, numadded = 0; i <= wc_list_max; i++) {
+	old = i < numoldwords ? oldnumcoords[i] : 0;
+	if (wc_list[i].numcoords == old)
+	    continue;
+	if (i >= numoldwords) {
+	    if (wc_list[i].numcoords < g_threshold) { /* Still too rare to be modeled */
+		free(wc_list[i].coords);
+		wc_list[i].coords = NULL;
+		wc_list[i].numcoords = wc_list[i].coordsize = 0;
+		continue;
+	    }
+	    wc_list[i].weight = 1.0;
+	    numadded++;
 	} else {
-	    matrix_kde_from_coords(w, wc_list[i].coordinate_list, g_sigma, g_sigma, 0.0);
+	    numupdated++;
 	}
+	/* Density of just the new occurrences */
+	matrix_set(d, 0.0);
+	if (g_nokde)
+	    matrix_nokde_from_coords(d, wc_list[i].coords + old, wc_list[i].numcoords - old);
+	else
+	    matrix_kde_from_coords(d, wc_list[i].coords + old, wc_list[i].numcoords - old, g_sigma, g_sigma, 0.0);
+	matrix_add(d, wordmatrix);
 	if (g_nomatrix == 0) {
-	    sm = matrix_to_sparsematrix(w);
+	    if (wc_list[i].sparsematrix != NULL) {
+		w = sparsematrix_to_matrix(wc_list[i].sparsematrix);
+		free(wc_list[i].sparsematrix);
+		matrix_add(d, w);
+	    } else {
+		w = matrix_copy(d);
+	    }
+	    wc_list[i].sparsematrix = matrix_to_sparsematrix(w);
+	    free(w);
 	}
+    }
+    free(d);
+    free(oldnumcoords);
+    fprintf(stderr, "Read %i documents: updated %i words, added %i new words\n", numdocs, numupdated, numadded);
+
+    /* Every word left with coordinates is in the model now, whatever the threshold */
+    g_threshold = 1;
+    tmpfilename = malloc(strlen(modelfilename) + 5);
+    sprintf(tmpfilename, "%s.tmp", modelfilename);
+    geoloc_write_model(tmpfilename, tweetsmatrix, wordmatrix);
+    modelindex_rename(tmpfilename, modelfilename);
+    free(tmpfilename);
+    fprintf(stderr, "Wrote updated model to '%s'.\n", modelfilename);
+    *tm = tweetsmatrix;
+    *wm = wordmatrix;
+    return(1);
+}
 
-	/* print #WORD#, followed by word + lats and lons */
-	gzprintf(fp, "#WORD# %i %s\n", i, wc_list[i].word);
-	for (cl = wc_list[i].coordinate_list; cl != NULL; cl = cl->next) {
-	    gzprintf(fp, "%lg %lg\n", cl->lat, cl->lon);
+/* Model compaction (--compact): a copy of a text model without the features */
+/* that are rare (--threshold), weighted down (--min-weight, e.g. by --tune)  */
+/* or spread over much of the grid (--max-entropy), and without the matrix   */
+/* entries that hold less than --mass-epsilon of their word's mass. What is  */
+/* removed is taken off the summed wordmatrix, so KL and --unk see the       */
+/* smaller model consistently. p(c) and the centroids are kept as they are.  */
+
+/* Entropy of a word's mass over the cells, as a fraction of the entropy of */
+/* a uniform distribution over the grid                                     */
+double sparsematrix_entropy(struct sparsematrix *sm) {
+    double mass, p, h;
+    int j;
+    for (j = 0, mass = 0.0; sm[j].x != -1; j++)
+	mass += sm[j].value;
+    if (mass <= 0.0)
+	return(0.0);
+    for (j = 0, h = 0.0; sm[j].x != -1; j++) {
+	if ((p = sm[j].value / mass) > 0.0)
+	    h -= p * log(p);
+    }
+    return(h / log(g_longranularity * g_latgranularity));
+}
+
+int geoloc_compact_model(char *modelfilename, char *outfilename, double **tm, double **wm) {
+    double *tweetsmatrix, *wordmatrix, *w, mass;
+    struct sparsematrix *sm;
+    struct stat st;
+    int i, j, k, c, drop, hasmatrices, numwords = 0, bycount = 0, byweight = 0, byentropy = 0;
+    long nonzeros = 0, keptnonzeros = 0;
+    off_t oldsize;
+    char *tmpfilename;
+
+    if (binmodel_is_binary(modelfilename)) {
+	fprintf(stderr, "Compacting requires a text model (binary models are read-only)\n");
+	exit(EXIT_FAILURE);
+    }
+    oldsize = stat(modelfilename, &st) == 0 ? st.st_size : 0;
+    if (geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, NULL) == 0)
+	exit(EXIT_FAILURE);
+    for (i = 0, hasmatrices = 0; i <= wc_list_max; i++) {
+	if (wc_list[i].sparsematrix != NULL)
+	    hasmatrices = 1;
+    }
+    g_nomatrix = !hasmatrices;
+    if (!hasmatrices && g_mass_epsilon > 0.0)
+	fprintf(stderr, "Model has no word matrices: --mass-epsilon has no effect\n");
+
+    for (i = 0; i <= wc_list_max; i++) {
+	if (wc_list[i].numcoords == 0)
+	    continue;
+	numwords++;
+	sm = wc_list[i].sparsematrix;
+	w = NULL;
+	drop = 1;
+	if (wc_list[i].numcoords < g_threshold) {
+	    bycount++;
+	} else if (g_min_weight >= 0.0 && wc_list[i].weight <= g_min_weight) {
+	    byweight++;
+	} else {
+	    drop = 0;
 	}
-	/* print sparse matrix                            */
-	if (g_nomatrix == 0) {
-	    gzprintf(fp, "#MATRIX#\n");
-	    for (j = 0; sm[j].x != -1; j++) {
-		gzprintf(fp, "%i %i %lg\n", sm[j].x, sm[j].y, sm[j].value);
+	/* Without stored matrices the density is computed from the coordinates */
+	if (sm == NULL && (drop || g_max_entropy < 1.0)) {
+	    w = word_get_matrix(i);
+	    sm = matrix_to_sparsematrix(w);
+	}
+	if (!drop && g_max_entropy < 1.0 && sparsematrix_entropy(sm) > g_max_entropy) {
+	    byentropy++;
+	    drop = 1;
+	}
+	for (j = 0; sm != NULL && sm[j].x != -1; j++) { }
+	nonzeros += w == NULL ? j : 0;
+	if (drop) {
+	    /* Take the word's mass off the summed wordmatrix */
+	    if (w != NULL) {
+		for (c = 0; c < g_longranularity * g_latgranularity; c++)
+		    wordmatrix[c] -= w[c];
+	    } else {
+		for (j = 0; sm[j].x != -1; j++)
+		    wordmatrix[sm[j].x + sm[j].y * g_longranularity] -= sm[j].value;
 	    }
+	    free(wc_list[i].coords);
+	    wc_list[i].coords = NULL;
+	    wc_list[i].numcoords = wc_list[i].coordsize = 0;
+	    free(wc_list[i].sparsematrix);
+	    wc_list[i].sparsematrix = NULL;
+	} else if (w == NULL && sm != NULL) {
+	    for (j = 0, mass = 0.0; sm[j].x != -1; j++)
+		mass += sm[j].value;
+	    for (j = 0, k = 0; sm[j].x != -1; j++) {
+		if (sm[j].value < g_mass_epsilon * mass)
+		    wordmatrix[sm[j].x + sm[j].y * g_longranularity] -= sm[j].value;
+		else
+		    sm[k++] = sm[j];
+	    }
+	    sm[k] = sm[j];
+	    keptnonzeros += k;
+	}
+	if (w != NULL) {
+	    free(w);
 	    free(sm);
 	}
-	gzprintf(fp, "#END#\n");
-	matrix_add(w, wordmatrix); /* Add this word's mass to total */
     }
-    gzprintf(fp, "#END#\n");
-    fprintf(stderr, "Writing (unnormalized) p(c)_w matrix...\n");
-    sm = matrix_to_sparsematrix(wordmatrix);
-    /* Print summed wordmatrix */
-    gzprintf(fp, "#WORDMATRIX#\n");
-    for (j = 0; sm[j].x != -1; j++) {
-	gzprintf(fp, "%i %i %lg\n", sm[j].x, sm[j].y, sm[j].value);
+    /* Rounding (matrices are stored as floats) must not leave negative mass */
+    for (c = 0; c < g_longranularity * g_latgranularity; c++) {
+	if (wordmatrix[c] < 0.0)
+	    wordmatrix[c] = 0.0;
     }
-    gzprintf(fp, "#END#\n");
-    free(sm);
-    gzclose(fp);
-    fprintf(stderr, "Wrote model to '%s'.\n", modelfilename);
+    fprintf(stderr, "Kept %i of %i features (dropped %i by count, %i by weight, %i by entropy)\n",
+	    numwords - bycount - byweight - byentropy, numwords, bycount, byweight, byentropy);
+    if (hasmatrices)
+	fprintf(stderr, "Kept %li of %li matrix entries\n", keptnonzeros, nonzeros);
+
+    g_threshold = 1;
+    tmpfilename = malloc(strlen(outfilename) + 5);
+    sprintf(tmpfilename, "%s.tmp", outfilename);
+    geoloc_write_model(tmpfilename, tweetsmatrix, wordmatrix);
+    modelindex_rename(tmpfilename, outfilename);
+    free(tmpfilename);
+    fprintf(stderr, "Wrote compacted model to '%s' (%lld bytes, was %lld).\n", outfilename,
+	    stat(outfilename, &st) == 0 ? (long long) st.st_size : 0LL, (long long) oldsize);
     *tm = tweetsmatrix;
     *wm = wordmatrix;
     return(1);
 }
 
+/* Ensembles of models (--ensemble)                                         */
+/* Everything that belongs to one loaded model (grid size, vocabulary, word */
+/* matrices, centroids and the classifiers' caches) lives in globals, which */
+/* the grid macros, the classifiers and the on-demand word readers use. A   */
+/* model context is a saved copy of them, so one process can hold several   */
+/* models and make one current between batches, while no worker runs.      */
+/* Each batch of documents is tokenized once, and its distinct tokens are   */
+/* hashed once and looked up once per model. The models then score the     */
+/* batch in turn, from the coarsest grid to the finest, each only over      */
+/* candidate cells: the coarsest model over its live cells, keeping its     */
+/* --ensemble-beam best, and each finer one over its live cells whose       */
+/* centers lie in the cells the previous one kept, keeping the best of      */
+/* those. With the product rule (product of experts), a cell's score is the */
+/* sum of the log scores of the cells containing it in all models so far.   */
+/* With the cascade rule, only the finer model's own score counts.          */
+
+#define ENSEMBLE_PRODUCT 0
+#define ENSEMBLE_CASCADE 1
+
+struct modelcontext {
+    char *filename;
+    int order;                              /* Position on the command line */
+    int longranularity;
+    int latgranularity;
+    double *tweetsmatrix;
+    double *wordmatrix;
+    struct wordinfo *wc_list;
+    unsigned int wc_list_size;
+    unsigned int wc_list_max;
+    struct wordhash *wh;
+    unsigned int wordtypes;
+    int total_wordcount;
+    struct centroids *centroids;
+    int *centroidcounts;
+    double tweetmass;
+    struct binmodel *binmodel;
+    struct modelindex *modelindex;
+    struct cellcache cellcache;
+    struct pyramid pyramid;
+    struct matrixcache_entry **matrixcache;
+};
+
+struct ensemble {
+    struct modelcontext *models;            /* Coarse to fine */
+    int nummodels;
+    int maxcells;                           /* Cells of the finest grid */
+    int level;                              /* Model the batch is being scored by */
+    int beam;
+    int rule;
+    struct wordhash *vocab;                 /* Distinct tokens of the batch, */
+    char **tokens;                          /* their hashes and their word   */
+    unsigned int *tokenhash;                /* index in the current model    */
+    int *wordindex;
+    int numtokens;
+    int tokensize;
+    int *doctokens;                         /* Tokens of document d are         */
+    int *docstart;                          /* doctokens[docstart[d]..[d+1])    */
+    int doctokensize;
+    int **childstart;                       /* Per model after the first: its cells under */
+    int **children;                         /* each cell of the previous model            */
+    int size;                               /* Documents the beams have room for */
+    int *cells[2];                          /* Per document, the beam of the current and  */
+    double *scores[2];                      /* of the previous model                       */
+    int *numbeam[2];
+    int64_t *latency;                       /* Per document, summed over the models (--stats) */
+};
+
+int g_ensemble_beam = 16;                   /* Cells kept per model (--ensemble-beam) */
+int g_ensemble_rule = ENSEMBLE_PRODUCT;
+
+void model_context_save(struct modelcontext *ctx, double *tweetsmatrix, double *wordmatrix) {
+    ctx->longranularity = g_longranularity;
+    ctx->latgranularity = g_latgranularity;
+    ctx->tweetsmatrix = tweetsmatrix;
+    ctx->wordmatrix = wordmatrix;
+    ctx->wc_list = wc_list;
+    ctx->wc_list_size = wc_list_size;
+    ctx->wc_list_max = wc_list_max;
+    ctx->wh = global_wh_train;
+    ctx->wordtypes = g_wordtypes;
+    ctx->total_wordcount = g_total_wordcount;
+    ctx->centroids = g_centroids;
+    ctx->centroidcounts = g_centroidcounts;
+    ctx->tweetmass = g_tweetmass;
+    ctx->binmodel = g_binmodel;
+    ctx->modelindex = g_modelindex;
+    ctx->cellcache = g_cellcache;
+    ctx->pyramid = g_pyramid;
+    ctx->matrixcache = g_matrixcache.byword;
+}
+
+/* Make ctx the model the classifiers see. Only between batches: the */
+/* contexts of models in use have to be saved back first             */
+void model_context_use(struct modelcontext *ctx) {
+    g_longranularity = ctx->longranularity;
+    g_latgranularity = ctx->latgranularity;
+    wc_list = ctx->wc_list;
+    wc_list_size = ctx->wc_list_size;
+    wc_list_max = ctx->wc_list_max;
+    global_wh_train = ctx->wh;
+    g_wordtypes = ctx->wordtypes;
+    g_total_wordcount = ctx->total_wordcount;
+    g_centroids = ctx->centroids;
+    g_centroidcounts = ctx->centroidcounts;
+    g_tweetmass = ctx->tweetmass;
+    g_binmodel = ctx->binmodel;
+    g_modelindex = ctx->modelindex;
+    g_cellcache = ctx->cellcache;
+    g_pyramid = ctx->pyramid;
+    g_matrixcache.byword = ctx->matrixcache;
+}
+
+/* Empty model state, for loading the next model */
+void model_context_reset() {
+    wc_list_size = 1024;
+    wc_list = calloc(wc_list_size, sizeof(struct wordinfo));
+    wc_list_max = 0;
+    global_wh_train = NULL;
+    g_wordtypes = 0;
+    g_total_wordcount = 0;
+    g_centroids = NULL;
+    g_centroidcounts = NULL;
+    g_tweetmass = 0.0;
+    g_binmodel = NULL;
+    g_modelindex = NULL;
+    memset(&g_cellcache, 0, sizeof(struct cellcache));
+    memset(&g_pyramid, 0, sizeof(struct pyramid));
+    g_matrixcache.byword = NULL;
+}
+
+int compare_modelcontext(const void *a, const void *b) {
+    const struct modelcontext *ma = (const struct modelcontext *) a;
+    const struct modelcontext *mb = (const struct modelcontext *) b;
+    if (ma->longranularity != mb->longranularity)
+	return(ma->longranularity - mb->longranularity);
+    return(ma->order - mb->order);
+}
+
+/* For each cell of fine, the cell of coarse that its center is in, */
+/* inverted into lists of children per cell of coarse               */
+void ensemble_children(struct modelcontext *coarse, struct modelcontext *fine, int **childstart, int **children) {
+    int c, x, y, numcoarse, numfine, *parent, *pos;
+    double lat, lon;
+    numcoarse = coarse->longranularity * coarse->latgranularity;
+    numfine = fine->longranularity * fine->latgranularity;
+    parent = malloc(sizeof(int) * numfine);
+    *childstart = calloc(numcoarse + 1, sizeof(int));
+    *children = malloc(sizeof(int) * numfine);
+    for (c = 0; c < numfine; c++) {
+	lat = ((c / fine->longranularity) + 0.5) * 360.0 / fine->longranularity - 90.0;
+	lon = ((c % fine->longranularity) + 0.5) * 360.0 / fine->longranularity - 180.0;
+	x = (int)(coarse->longranularity / 360.0 * (lon + 180.0));
+	y = (int)(coarse->longranularity / 360.0 * (lat + 90.0));
+	x = x >= coarse->longranularity ? coarse->longranularity - 1 : x;
+	y = y >= coarse->latgranularity ? coarse->latgranularity - 1 : y;
+	parent[c] = x + y * coarse->longranularity;
+	(*childstart)[parent[c] + 1]++;
+    }
+    for (c = 0; c < numcoarse; c++)
+	(*childstart)[c + 1] += (*childstart)[c];
+    pos = malloc(sizeof(int) * numcoarse);
+    memcpy(pos, *childstart, sizeof(int) * numcoarse);
+    for (c = 0; c < numfine; c++)
+	(*children)[pos[parent[c]]++] = c;
+    free(pos);
+    free(parent);
+}
+
+/* Load the model to classify with and the comma-separated others, and */
+/* leave the finest one current                                        */
+struct ensemble *ensemble_open(char *modelfilename, char *others, char *docfilename, double **tm, double **wm) {
+    struct ensemble *ens;
+    struct wordhash *iwh = NULL;
+    char *list, *tok;
+    int i;
+    ens = calloc(1, sizeof(struct ensemble));
+    ens->models = calloc(1, sizeof(struct modelcontext));
+    ens->models[0].filename = modelfilename;
+    list = strdup(others);
+    for (ens->nummodels = 1, tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ","), ens->nummodels++) {
+	ens->models = realloc(ens->models, sizeof(struct modelcontext) * (ens->nummodels + 1));
+	memset(ens->models + ens->nummodels, 0, sizeof(struct modelcontext));
+	ens->models[ens->nummodels].filename = strdup(tok);
+    }
+    free(list);
+    for (i = 0; i < ens->nummodels; i++) {
+	if (i > 0) {
+	    model_context_save(ens->models + i - 1, *tm, *wm);
+	    model_context_reset();
+	}
+	g_modelindex = binmodel_is_binary(ens->models[i].filename) ? NULL : modelindex_open(ens->models[i].filename);
+	/* Words needed by models without an index, read once for all of them */
+	if (iwh == NULL && g_modelindex == NULL && !binmodel_is_binary(ens->models[i].filename) && strcmp(docfilename, "-") != 0)
+	    iwh = geoloc_index_words(docfilename);
+	geoloc_read_model(ens->models[i].filename, tm, wm, iwh);
+	cellcache_update(*tm, *wm);
+	ens->models[i].order = i;
+    }
+    model_context_save(ens->models + ens->nummodels - 1, *tm, *wm);
+    if (iwh != NULL)
+	wordhash_free(iwh);
+    qsort(ens->models, ens->nummodels, sizeof(struct modelcontext), compare_modelcontext);
+    ens->childstart = calloc(ens->nummodels, sizeof(int *));
+    ens->children = calloc(ens->nummodels, sizeof(int *));
+    for (i = 1; i < ens->nummodels; i++)
+	ensemble_children(ens->models + i - 1, ens->models + i, ens->childstart + i, ens->children + i);
+    ens->maxcells = ens->models[ens->nummodels - 1].longranularity * ens->models[ens->nummodels - 1].latgranularity;
+    ens->beam = g_ensemble_beam;
+    ens->rule = g_ensemble_rule;
+    fprintf(stderr, "Ensemble of %i models:", ens->nummodels);
+    for (i = 0; i < ens->nummodels; i++)
+	fprintf(stderr, " %s (%i)", ens->models[i].filename, ens->models[i].longranularity);
+    fprintf(stderr, "\n");
+    model_context_use(ens->models + ens->nummodels - 1);
+    *tm = ens->models[ens->nummodels - 1].tweetsmatrix;
+    *wm = ens->models[ens->nummodels - 1].wordmatrix;
+    return(ens);
+}
+
+/* Called by the workers: scores document doc with the current model over */
+/* its candidate cells, and keeps the best of them as its beam             */
+void ensemble_score(struct ensemble *ens, int doc, struct classify_scratch *scratch) {
+    struct sparsematrix *sm;
+    int i, j, b, k, c, f, n, nf, numcand, wordindex, count, tofree, cur, prev, *cells, *prevcells, *cand;
+    double weight, weightsum, logcount, logcountsum, ratio, mass, offset, logprior, p, *sum, *prevscores;
+    struct stats *st = &scratch->stats;
+    int64_t t;
+
+    if (scratch->candidate == NULL) {
+	scratch->candidate = calloc(ens->maxcells, 1);
+	scratch->candsum = malloc(sizeof(double) * ens->maxcells);
+	scratch->candcells = malloc(sizeof(int) * ens->maxcells);
+	scratch->candbase = malloc(sizeof(double) * ens->maxcells);
+    }
+    cur = ens->level & 1;
+    prev = cur ^ 1;
+    logprior = g_cellcache.logprior;
+    sum = scratch->candsum;
+
+    /* The candidates: live cells, or the live children of the previous beam */
+    if (ens->level == 0) {
+	cand = g_cellcache.livecells;
+	numcand = g_cellcache.numlive;
+    } else {
+	cand = scratch->candcells;
+	prevcells = ens->cells[prev] + doc * ens->beam;
+	prevscores = ens->scores[prev] + doc * ens->beam;
+	for (b = 0, numcand = 0; b < ens->numbeam[prev][doc]; b++) {
+	    for (j = ens->childstart[ens->level][prevcells[b]]; j < ens->childstart[ens->level][prevcells[b] + 1]; j++) {
+		c = ens->children[ens->level][j];
+		if (g_cellcache.liveindex[c] == -1)
+		    continue;
+		scratch->candbase[numcand] = ens->rule == ENSEMBLE_PRODUCT ? prevscores[b] : 0.0;
+		cand[numcand++] = c;
+	    }
+	}
+    }
+    for (k = 0; k < numcand; k++) {
+	c = cand[k];
+	scratch->candidate[c] = 1;
+	sum[c] = g_kullback_leibler ? 0.0 : g_cellcache.logtweets[c];
+    }
+
+    /* The features, as the single-model classifiers take them */
+    t = stats_clock();
+    n = ens->docstart[doc + 1] - ens->docstart[doc];
+    if (g_kullback_leibler)
+	kl_features_begin(scratch, n);
+    else
+	classify_scratch_features(scratch, n);
+    for (i = 0, nf = 0, weightsum = 0.0, logcountsum = 0.0; i < n; i++) {
+	wordindex = ens->wordindex[ens->doctokens[ens->docstart[doc] + i]];
+	word_load(wordindex);
+	st->lookups++;
+	if (wordindex == -1)
+	    st->lookup_misses++;
+	if (g_kullback_leibler) {
+	    if (wordindex != -1)
+		nf = kl_features_add(scratch, wordindex, nf);
+	    continue;
+	}
+	if (wordindex == -1 && !g_unk)
+	    continue;
+	if ((weight = wordindex != -1 ? word_get_weight(wordindex) : 1.0) == 0)
+	    continue;
+	weightsum += weight;
+	if (g_complement_nb)
+	    logcountsum += weight * log((wordindex != -1 ? word_get_count(wordindex) : 0) + g_wordprior);
+	if (wordindex == -1)
+	    continue; /* Unknown word: only the baseline */
+	scratch->featureword[nf] = wordindex;
+	scratch->featureweight[nf++] = weight;
+    }
+    t = stats_lap(&st->lookup_ns, t);
+
+    /* Their log-deltas in the candidate cells */
+    for (f = 0, mass = 0.0, offset = 0.0; f < nf; f++) {
+	wordindex = scratch->featureword[f];
+	if (g_kullback_leibler) {
+	    ratio = (double) scratch->featuren[f] / nf;
+	    mass += ratio;
+	    offset += ratio * log(ratio);
+	    weight = ratio;
+	} else {
+	    weight = scratch->featureweight[f];
+	}
+	count = g_complement_nb ? word_get_count(wordindex) : 0;
+	logcount = g_complement_nb ? log(count + g_wordprior) : 0.0;
+	sm = word_get_sparsematrix(wordindex, &tofree);
+	t = stats_lap(&st->decode_ns, t);
+	if (sm == NULL)
+	    continue;
+	for (j = 0; sm[j].x != -1; j++) {
+	    c = sm[j].x + sm[j].y * g_longranularity;
+	    if (!scratch->candidate[c])
+		continue;
+	    if (g_complement_nb)
+		sum[c] -= weight * (log(count - sm[j].value + g_wordprior) - logcount);
+	    else
+		sum[c] += weight * (log(sm[j].value + g_wordprior) - logprior);
+	}
+	st->decodes++;
+	st->decoded_nonzeros += j;
+	word_release_sparsematrix(wordindex, sm, tofree);
+	t = stats_lap(&st->score_ns, t);
+    }
+
+    /* The baselines, and the beam */
+    cells = ens->cells[cur] + doc * ens->beam;
+    for (k = 0, n = 0; k < numcand; k++) {
+	c = cand[k];
+	scratch->candidate[c] = 0;
+	if (g_kullback_leibler)
+	    p = sum[c] - (mass * (g_cellcache.kl_log_c_iw[c] - logprior) + offset);
+	else if (g_complement_nb)
+	    p = sum[c] - (logcountsum - weightsum * g_cellcache.cnb_baseline[c]);
+	else
+	    p = sum[c] + weightsum * g_cellcache.nb_baseline[c];
+	n = beam_insert(cells, ens->scores[cur] + doc * ens->beam, n, ens->beam, c, (ens->level > 0 ? scratch->candbase[k] : 0.0) + p);
+    }
+    ens->numbeam[cur][doc] = n;
+    stats_lap(&st->argmax_ns, t);
+}
+
+/* A document counts once for --stats, with the time all models took */
+void ensemble_scored(struct ensemble *ens, int doc, int64_t ns, struct classify_scratch *scratch) {
+    ens->latency[doc] = ens->level == 0 ? ns : ens->latency[doc] + ns;
+    if (ens->level == ens->nummodels - 1)
+	stats_document(&scratch->stats, ens->latency[doc]);
+}
+
+/* The batch's distinct tokens, and the tokens of each document */
+void ensemble_tokens(struct ensemble *ens, struct docbatch *batch) {
+    char **w;
+    unsigned int hash;
+    int d, id, n;
+    if (ens->vocab != NULL)
+	wordhash_free(ens->vocab);
+    ens->vocab = wordhash_init(1024);
+    ens->docstart = realloc(ens->docstart, sizeof(int) * (batch->size + 1));
+    for (d = 0, n = 0, ens->numtokens = 0; d < batch->numdocs; d++) {
+	ens->docstart[d] = n;
+	for (w = batch->docs[d].words; *w != NULL; w++) {
+	    hash = wordhash_hashf(*w);
+	    if ((id = wordhash_find_hashed(ens->vocab, *w, hash)) == -1) {
+		if (ens->numtokens == ens->tokensize) {
+		    ens->tokensize = ens->tokensize == 0 ? 1024 : ens->tokensize * 2;
+		    ens->tokens = realloc(ens->tokens, sizeof(char *) * ens->tokensize);
+		    ens->tokenhash = realloc(ens->tokenhash, sizeof(unsigned int) * ens->tokensize);
+		    ens->wordindex = realloc(ens->wordindex, sizeof(int) * ens->tokensize);
+		}
+		id = ens->numtokens++;
+		wordhash_add(ens->vocab, *w, hash, id);
+		ens->tokens[id] = *w;
+		ens->tokenhash[id] = hash;
+	    }
+	    if (n == ens->doctokensize) {
+		ens->doctokensize = n == 0 ? 4096 : n * 2;
+		ens->doctokens = realloc(ens->doctokens, sizeof(int) * ens->doctokensize);
+	    }
+	    ens->doctokens[n++] = id;
+	}
+    }
+    ens->docstart[d] = n;
+}
+
+/* Score the batch with every model, coarse to fine; the cells are those */
+/* of the finest model, which is current again afterwards                */
+void ensemble_classify(struct docbatch *batch) {
+    struct ensemble *ens = g_ensemble;
+    int d, i, last;
+    int64_t t;
+    if (ens->size < batch->size) {
+	ens->size = batch->size;
+	for (i = 0; i < 2; i++) {
+	    ens->cells[i] = realloc(ens->cells[i], sizeof(int) * ens->size * ens->beam);
+	    ens->scores[i] = realloc(ens->scores[i], sizeof(double) * ens->size * ens->beam);
+	    ens->numbeam[i] = realloc(ens->numbeam[i], sizeof(int) * ens->size);
+	}
+	ens->latency = realloc(ens->latency, sizeof(int64_t) * ens->size);
+    }
+    /* Workers aren't running, so the first thread's counters are free to use */
+    t = stats_clock();
+    ensemble_tokens(ens, batch);
+    t = stats_lap(&batch->scratch[0]->stats.tokenize_ns, t);
+    for (ens->level = 0; ens->level < ens->nummodels; ens->level++) {
+	model_context_use(ens->models + ens->level);
+	for (i = 0; i < ens->numtokens; i++)
+	    ens->wordindex[i] = word_lookup_hashed(ens->tokens[i], ens->tokenhash[i]);
+	t = stats_lap(&batch->scratch[0]->stats.lookup_ns, t);
+	batch->tweetsmatrix = ens->models[ens->level].tweetsmatrix;
+	batch->wordmatrix = ens->models[ens->level].wordmatrix;
+	batch->next = 0;
+	docbatch_run(batch);
+	/* Matrices read on demand while scoring belong to the model */
+	model_context_save(ens->models + ens->level, batch->tweetsmatrix, batch->wordmatrix);
+	t = stats_clock();
+    }
+    last = (ens->nummodels - 1) & 1;
+    for (d = 0; d < batch->numdocs; d++)
+	batch->docs[d].cell = ens->numbeam[last][d] > 0 ? ens->cells[last][d * ens->beam] : 0;
+}
+
 int main(int argc, char **argv) {
-    int opt, option_index = 0, mode = MODE_CLASSIFY, modelspec = 0;
-    double *tweetsmatrix, *wordmatrix;
-    char *modelfilename, *stopwords = NULL;
+    int opt, option_index = 0, mode = MODE_CLASSIFY, modelspec = 0, port = 0, numpriors = 0, numsigmas = 0, sweepclassifiers = SWEEP_NB | SWEEP_KL;
+    double *tweetsmatrix, *wordmatrix, *priors = NULL, *sigmas = NULL;
+    char *modelfilename = NULL, *stopwords = NULL, *socketpath = NULL, *ensemblefiles = NULL, *tok;
     struct wordhash *iwh;
-    struct devtraindata *dev_data, *train_data;
+    struct devtraindata *tune_data, *heldout_data;
+    int64_t t;
+    static char *modenames[] = { "train", "classify", "eval", "tune", "serve", "update", "sweep", "compact" };
 
     static struct option long_options[] =
 	{
 	    {"longranularity",    required_argument, 0, 'l'},
 	    {"help",                  no_argument  , 0, 'h'},
 	    {"train",                 no_argument  , 0, 'r'},
+	    {"update",                no_argument  , 0, 'R'},
 	    {"unk",                   no_argument  , 0, 'u'},
 	    {"kullback-leibler",      no_argument  , 0, 'k'},
 	    {"stopwords",       required_argument  , 0, 's'},
 	    {"sigma",           required_argument  , 0, 'S'},
 	    {"eval",                  no_argument  , 0, 'e'},
+	    {"sweep",           optional_argument  , 0, 'W'},
 	    {"nokde",                 no_argument  , 0, 'n'},
+	    {"kde-direct",            no_argument  , 0, 'G'},
 	    {"classify",              no_argument  , 0, 'C'},
 	    {"centroid",              no_argument  , 0, 'c'},
-	    {"print-matrix",          no_argument  , 0, 'M'},
+	    {"print-matrix",    optional_argument  , 0, 'M'},
 	    {"nomatrix",              no_argument  , 0, 'N'},
 	    {"tune",                  no_argument  , 0, 'T'},
 	    {"modelfile",       required_argument  , 0, 'm'},
 	    {"prior",           required_argument  , 0, 'p'},
 	    {"threshold",       required_argument  , 0, 'x'},
+	    {"model-format",    required_argument  , 0, 'F'},
+	    {"serve",                 no_argument  , 0, 'D'},
+	    {"socket",          required_argument  , 0, 'U'},
+	    {"port",            required_argument  , 0, 'P'},
+	    {"print-topk",      required_argument  , 0, 'K'},
+	    {"threads",         required_argument  , 0, 't'},
+	    {"max-memory",      required_argument  , 0, 'X'},
+	    {"coarse-to-fine",  required_argument  , 0, 'H'},
+	    {"batch",           required_argument  , 0, 'B'},
+	    {"matrix-cache",    required_argument  , 0, 'Z'},
+	    {"quantize",              no_argument  , 0, 'Q'},
+	    {"epochs",          required_argument  , 0, 'E'},
+	    {"stats",           optional_argument  , 0, 'I'},
+	    {"tune-rate",       required_argument  , 0, 'L'},
+	    {"compress-level",  required_argument  , 0, 'z'},
+	    {"compact",               no_argument  , 0, 'O'},
+	    {"min-weight",      required_argument  , 0, 'w'},
+	    {"max-entropy",     required_argument  , 0, 'y'},
+	    {"mass-epsilon",    required_argument  , 0, 'j'},
+	    {"ensemble",        required_argument  , 0, 'a'},
+	    {"ensemble-rule",   required_argument  , 0, 'g'},
+	    {"ensemble-beam",   required_argument  , 0, 'b'},
+	    {"float32",         optional_argument  , 0, 'f'},
 	    {0, 0, 0, 0}
 	};
     
-    while ((opt = getopt_long(argc, argv, "l:hruks:S:enCdcMTNm:p:x:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "l:hrRuks:S:eW::nCdcM::TNm:p:x:F:DU:P:K:t:X:H:B:Z:QE:L:I::z:Ow:y:j:a:g:b:f::G", long_options, &option_index)) != -1) {
 	switch(opt) {
 	case 'h':
 	    printf("%s\n%s", versionstring, helpstring);
@@ -1317,6 +6369,21 @@ int main(int argc, char **argv) {
 	case 'e':
 	    mode = MODE_EVAL;
 	    break;
+	case 'W':
+	    mode = MODE_SWEEP;
+	    if (optarg == NULL)
+		break;
+	    for (sweepclassifiers = 0, tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (strcmp(tok, "nb") == 0) {
+		    sweepclassifiers |= SWEEP_NB;
+		} else if (strcmp(tok, "kl") == 0) {
+		    sweepclassifiers |= SWEEP_KL;
+		} else {
+		    fprintf(stderr, "Unknown classifier '%s' for --sweep (use 'nb' and/or 'kl')\n", tok);
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
 	case 'C':
 	    mode = MODE_CLASSIFY;
 	    break;
@@ -1326,19 +6393,117 @@ int main(int argc, char **argv) {
 	case 'r':
 	    mode = MODE_TRAIN;
 	    break;
+	case 'R':
+	    mode = MODE_UPDATE;
+	    break;
 	case 'T':
 	    mode = MODE_TUNE;
 	    break;
+	case 'D':
+	    mode = MODE_SERVE;
+	    break;
+	case 'O':
+	    mode = MODE_COMPACT;
+	    break;
+	case 'w':
+	    g_min_weight = strtod(optarg, NULL);
+	    break;
+	case 'y':
+	    g_max_entropy = strtod(optarg, NULL);
+	    break;
+	case 'j':
+	    g_mass_epsilon = strtod(optarg, NULL);
+	    break;
+	case 'a':
+	    ensemblefiles = strdup(optarg);
+	    break;
+	case 'g':
+	    if (strcmp(optarg, "product") == 0) {
+		g_ensemble_rule = ENSEMBLE_PRODUCT;
+	    } else if (strcmp(optarg, "cascade") == 0) {
+		g_ensemble_rule = ENSEMBLE_CASCADE;
+	    } else {
+		fprintf(stderr, "Unknown ensemble rule '%s' (use 'product' or 'cascade')\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'b':
+	    g_ensemble_beam = atoi(optarg);
+	    break;
+	case 'f':
+	    g_float32 = 1;
+	    if (optarg == NULL)
+		simd_init();
+	    else if (strcmp(optarg, "scalar") != 0) {
+		fprintf(stderr, "Unknown --float32 kernels '%s' (use 'scalar' or nothing)\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'U':
+	    socketpath = strdup(optarg);
+	    break;
+	case 'P':
+	    port = atoi(optarg);
+	    break;
+	case 'K':
+	    g_print_topk = atoi(optarg);
+	    break;
+	case 't':
+	    g_threads = atoi(optarg);
+	    g_threads = g_threads < 1 ? 1 : g_threads;
+	    break;
+	case 'X':
+	    g_max_memory = atol(optarg);
+	    break;
+	case 'H':
+	    g_coarse_to_fine = atoi(optarg);
+	    break;
+	case 'B':
+	    g_batch = atoi(optarg);
+	    break;
+	case 'Z':
+	    g_matrix_cache = atol(optarg);
+	    break;
+	case 'Q':
+	    g_quantize = 1;
+	    break;
+	case 'E':
+	    g_tune_epochs = atoi(optarg);
+	    break;
+	case 'I':
+	    g_stats = 1;
+	    g_stats_interval = optarg != NULL ? strtod(optarg, NULL) : 0.0;
+	    break;
+	case 'L':
+	    g_tune_rate = strtod(optarg, NULL);
+	    break;
+	case 'z':
+	    g_compress_level = atoi(optarg);
+	    if (g_compress_level < 0 || g_compress_level > 9) {
+		fprintf(stderr, "--compress-level must be between 0 and 9\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
 	case 'm':
 	    modelfilename = strdup(optarg);
 	    modelspec = 1;
 	    break;
 	case 'M':
-	    g_print_matrix = 1;
+	    if (optarg == NULL || strcmp(optarg, "text") == 0) {
+		g_print_matrix = PRINT_MATRIX_TEXT;
+	    } else if (strcmp(optarg, "binary") == 0) {
+		g_print_matrix = PRINT_MATRIX_BINARY;
+	    } else {
+		fprintf(stderr, "Unknown matrix format '%s' (use 'text' or 'binary')\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
 	    break;
 	case 'N':
 	    g_nomatrix = 1;
 	    break;
+	case 'G':
+	    g_kde_direct = 1;
+	    break;
 	case 'n':
 	    g_nokde = 1;
 	    break;
@@ -1356,27 +6521,65 @@ int main(int argc, char **argv) {
 	    g_latgranularity = g_longranularity/2;	   
 	    break;
 	case 'p':
-	    g_wordprior = strtod(optarg, NULL);
+	    numpriors = parse_number_list(optarg, &priors);
+	    g_wordprior = priors[0];
 	    break;
 	case 'S':
-	    g_sigma = strtod(optarg, NULL);
+	    numsigmas = parse_number_list(optarg, &sigmas);
+	    g_sigma = sigmas[0];
 	    break;
 	case 'x': 
 	    g_threshold = atoi(optarg);
 	    break;
+	case 'F':
+	    if (strcmp(optarg, "bin") == 0) {
+		g_model_format = MODEL_FORMAT_BIN;
+	    } else if (strcmp(optarg, "text") == 0) {
+		g_model_format = MODEL_FORMAT_TEXT;
+	    } else {
+		fprintf(stderr, "Unknown model format '%s' (use 'text' or 'bin')\n", optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
 	}
     }
 
     argc -= optind;
     argv += optind;
 
-    if (argc == 0) {
+    if (argc == 0 && mode != MODE_SERVE) {
 	fprintf(stderr, "No document file specified. See geoloc --help\n");
 	exit(EXIT_FAILURE);
     }
+    if (g_quantize && (mode == MODE_TUNE || mode == MODE_UPDATE || mode == MODE_COMPACT || (mode == MODE_TRAIN && g_model_format != MODEL_FORMAT_BIN))) {
+	fprintf(stderr, "--quantize applies to classification, and to training binary models (--model-format=bin)\n");
+	exit(EXIT_FAILURE);
+    }
+    if (mode != MODE_SWEEP && (numpriors > 1 || numsigmas > 1)) {
+	fprintf(stderr, "Lists of --prior or --sigma values need --sweep\n");
+	exit(EXIT_FAILURE);
+    }
+    if (mode == MODE_SWEEP && numsigmas > 0 && (g_nokde || g_coarse_to_fine > 0)) {
+	fprintf(stderr, "--sweep over --sigma needs KDE word matrices and can't be combined with --coarse-to-fine\n");
+	exit(EXIT_FAILURE);
+    }
+    if (g_print_matrix && g_print_topk > 0) {
+	fprintf(stderr, "Use either --print-matrix or --print-topk\n");
+	exit(EXIT_FAILURE);
+    }
+    if (ensemblefiles != NULL && (mode != MODE_CLASSIFY && mode != MODE_EVAL)) {
+	fprintf(stderr, "--ensemble applies to --classify and --eval\n");
+	exit(EXIT_FAILURE);
+    }
+    if (ensemblefiles != NULL && (g_print_matrix || g_print_topk > 0 || g_coarse_to_fine > 0 || g_float32 || g_ensemble_beam < 1)) {
+	fprintf(stderr, "--ensemble needs an --ensemble-beam of at least 1, and can't be combined with --print-matrix, --print-topk, --coarse-to-fine or --float32\n");
+	exit(EXIT_FAILURE);
+    }
+    halftofloat_init();
+    g_stats_start_ns = stats_clock();
     if (modelspec == 0) {
 	modelfilename = malloc(sizeof(char) * 20);
-	snprintf(modelfilename, 20, "%s%i.gz", "model", g_longranularity);
+	snprintf(modelfilename, 20, "%s%i.%s", "model", g_longranularity, g_model_format == MODEL_FORMAT_BIN ? "bin" : "gz");
     }
     
     wc_list_size = 1024;
@@ -1387,21 +6590,78 @@ int main(int argc, char **argv) {
 	fprintf(stderr, "Using %i/%i granularity; grid size = %lg° x %lg°\n", g_longranularity, g_latgranularity, (double)360/g_longranularity, (double)360/g_longranularity);
 	geoloc_train_model(argv[0], modelfilename, stopwords, &tweetsmatrix, &wordmatrix);
 	break;
+    case MODE_UPDATE:
+	geoloc_update_model(argv[0], modelfilename, stopwords, &tweetsmatrix, &wordmatrix);
+	break;
+    case MODE_COMPACT:
+	geoloc_compact_model(modelfilename, argv[0], &tweetsmatrix, &wordmatrix);
+	break;
     case MODE_EVAL:
-	iwh = geoloc_index_words(argv[0]); /* Get an index of words needed from model */
-	geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, iwh);
+	t = stats_clock();
+	if (ensemblefiles != NULL) {
+	    g_ensemble = ensemble_open(modelfilename, ensemblefiles, argv[0], &tweetsmatrix, &wordmatrix);
+	    stats_lap(&g_stats_load_ns, t);
+	} else {
+	    g_modelindex = binmodel_is_binary(modelfilename) ? NULL : modelindex_open(modelfilename);
+	    /* Get an index of words needed from model (stdin can only be read once), unless words are read on demand */
+	    iwh = strcmp(argv[0], "-") == 0 || g_modelindex != NULL ? NULL : geoloc_index_words(argv[0]);
+	    geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, iwh);
+	    stats_lap(&g_stats_load_ns, t);
+	    cellcache_update(tweetsmatrix, wordmatrix);
+	}
 	test_evaluate(argv[0], tweetsmatrix, wordmatrix);
+	matrixcache_report();
 	break;
-    case MODE_CLASSIFY:
-	iwh = geoloc_index_words(argv[0]); /* Get an index of words needed from model */
+    case MODE_SWEEP:
+	t = stats_clock();
+	g_modelindex = binmodel_is_binary(modelfilename) ? NULL : modelindex_open(modelfilename);
+	/* Re-estimating for another sigma needs every word's coordinates */
+	iwh = numsigmas > 0 || strcmp(argv[0], "-") == 0 || g_modelindex != NULL ? NULL : geoloc_index_words(argv[0]);
 	geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, iwh);
+	stats_lap(&g_stats_load_ns, t);
+	if (numpriors == 0)
+	    numpriors = parse_number_list("0.01", &priors);
+	geoloc_sweep(argv[0], tweetsmatrix, wordmatrix, priors, numpriors, sigmas, numsigmas, sweepclassifiers);
+	matrixcache_report();
+	break;
+    case MODE_CLASSIFY:
+	t = stats_clock();
+	if (ensemblefiles != NULL) {
+	    g_ensemble = ensemble_open(modelfilename, ensemblefiles, argv[0], &tweetsmatrix, &wordmatrix);
+	    stats_lap(&g_stats_load_ns, t);
+	} else {
+	    g_modelindex = binmodel_is_binary(modelfilename) ? NULL : modelindex_open(modelfilename);
+	    /* Get an index of words needed from model (stdin can only be read once), unless words are read on demand */
+	    iwh = strcmp(argv[0], "-") == 0 || g_modelindex != NULL ? NULL : geoloc_index_words(argv[0]);
+	    geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, iwh);
+	    stats_lap(&g_stats_load_ns, t);
+	    cellcache_update(tweetsmatrix, wordmatrix);
+	}
 	test_classify(argv[0], tweetsmatrix, wordmatrix);
+	matrixcache_report();
+	break;
+    case MODE_SERVE:
+	t = stats_clock();
+	g_modelindex = binmodel_is_binary(modelfilename) ? NULL : modelindex_open(modelfilename);
+	geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, NULL); /* Vocabulary is not known up front */
+	stats_lap(&g_stats_load_ns, t);
+	cellcache_update(tweetsmatrix, wordmatrix);
+	geoloc_serve(socketpath, port, tweetsmatrix, wordmatrix);
 	break;
     case MODE_TUNE:
+	if (binmodel_is_binary(modelfilename)) {
+	    fprintf(stderr, "Tuning requires a text model (binary models are read-only)\n");
+	    exit(EXIT_FAILURE);
+	}
+	t = stats_clock();
 	geoloc_read_model(modelfilename, &tweetsmatrix, &wordmatrix, NULL);
-	dev_data = geoloc_read_data(argv[0]);
-	train_data = geoloc_read_data(argv[1]);
-	geoloc_tune(tweetsmatrix, wordmatrix, dev_data, train_data);
+	stats_lap(&g_stats_load_ns, t);
+	cellcache_update(tweetsmatrix, wordmatrix);
+	tune_data = geoloc_read_data(argv[0]);
+	heldout_data = argc > 1 ? geoloc_read_data(argv[1]) : NULL;
+	geoloc_tune(modelfilename, tweetsmatrix, wordmatrix, tune_data, heldout_data);
 	break;
     }
+    if (g_stats)
+	stats_report(modenames[mode]);
 }
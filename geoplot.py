@@ -105,6 +105,7 @@ parser.add_argument('-s', '--states', action='store_true', help='Plot state boun
 parser.add_argument('-c', '--contour', action='store_true', help='Plot contours instead of grid')
 parser.add_argument('-o', '--output', help='Output file; extension specifies format')
 parser.add_argument('-a', '--open_after', action='store_true', help='Open created file')
+parser.add_argument('-b', '--binary', action='store_true', help='Read --print-matrix=binary output (plots the first document)')
 args = parser.parse_args()
 
 if args.us:
@@ -117,9 +118,17 @@ else:
     parser.exit(message='Please specify the map type (us or world or europe)')
 
 rvb = make_rvb_colormap()
-data = np.loadtxt(sys.stdin, delimiter='\t')
-longranularity = data.shape[1]
-latgranularity = int(longranularity/2)
+if args.binary:
+    # Frame: b'GLMX', int32 longranularity, latgranularity, cell, then float32 cells
+    buf = sys.stdin.buffer.read()
+    if buf[:4] != b'GLMX':
+        parser.exit(message='Not --print-matrix=binary output\n')
+    longranularity, latgranularity, cell = np.frombuffer(buf, dtype='<i4', count=3, offset=4)
+    data = np.frombuffer(buf, dtype='<f4', count=longranularity * latgranularity, offset=16).reshape(latgranularity, longranularity)
+else:
+    data = np.loadtxt(sys.stdin, delimiter='\t')
+    longranularity = data.shape[1]
+    latgranularity = int(longranularity/2)
 lcenterskip = (180/longranularity)
 
 ax = plt.axes(projection=PROJECTIONS[args.proj]())
@@ -1,11 +1,62 @@
-function GeoLoc(map) {
+/*
+ * Naive Bayes geolocation in the browser, for models converted by model2json.py.
+ *
+ * Models are either a model.json with one JSON file per word (words/WORD.json), or,
+ * with --format=shards, a model.bin with the p(c) and p(c)_w grids and binary shards
+ * (shards/N.bin) that hold the packed matrices of the words whose hash is N modulo
+ * the number of shards. Either way each word's matrix is kept as the typed arrays
+ * of its nonzero cells, and scoring only walks those.
+ *
+ * new GeoLoc(map, {worker: 'geoloc.js'}) loads the model and classifies in a Web
+ * Worker running this same file, so the page stays responsive.
+ */
+function GeoLoc(map, options) {
+    options = options || {};
     this.map = map;
     this.marker = null;
     this.layer = null;
     this.model = null;
     this.modelPath = null;
+    this.ready = null;
     this.wordPrior = 0.01;
     this.unk = 0.0;
+    this.words = new Map();   // Word -> promise of its matrix (null if unknown)
+    this.shards = new Map();  // Shard number -> promise of the parsed shard
+    this.baseline = null;     // Per-cell log(prior) - log(p(c)_w + prior), see getBaseline
+    this.worker = null;
+    this.requests = new Map();
+    this.nextRequest = 0;
+    if (options.worker) {
+        this.worker = new Worker(options.worker);
+        this.worker.onmessage = event => {
+            const resolve = this.requests.get(event.data.id);
+            this.requests.delete(event.data.id);
+            resolve(event.data.result);
+        };
+    }
+}
+
+GeoLoc.SHARD_VERSION = 1;
+GeoLoc.SHARD_MAGIC = 0x48534c47;  // 'GLSH'
+GeoLoc.MODEL_MAGIC = 0x424d4c47;  // 'GLMB'
+GeoLoc.littleEndian = new Uint8Array(new Uint16Array([1]).buffer)[0] === 1;
+
+/* Half-precision values of the shards (nonnegative, as in geoloc --quantize) */
+GeoLoc.halfToFloat = (function() {
+    let table = new Float32Array(32768);
+    for (let h = 0; h < 32768; h++) {
+        table[h] = (h >> 10) === 0 ? h * Math.pow(2, -24) : ((h & 0x3ff) | 0x400) * Math.pow(2, (h >> 10) - 25);
+    }
+    return table;
+})();
+
+/* 32-bit FNV-1a of the UTF-8 bytes of the word, as in model2json.py */
+GeoLoc.hash = function(bytes) {
+    let h = 0x811c9dc5;
+    for (let i = 0; i < bytes.length; i++) {
+        h = Math.imul(h ^ bytes[i], 0x01000193) >>> 0;
+    }
+    return h;
 }
 
 GeoLoc.prototype.yToMidLat = function(y) {
@@ -24,59 +75,267 @@ GeoLoc.prototype.cellToX = function(cell) {
     return cell % this.model.granularity;
 }
 
-GeoLoc.prototype.sparseMatrixToMatrix = function(sparseMatrix) {
+GeoLoc.prototype.numCells = function() {
+    return this.model.granularity * this.model.granularity / 2;
+}
+
+/* A word's matrix from its JSON file, as cells and values */
+GeoLoc.prototype.wordFromJSON = function(data) {
     const granularity = this.model.granularity;
-    let matrix = new Array(granularity * granularity / 2);
-    matrix.fill(0.0);
-    sparseMatrix.forEach(element => {
-        matrix[element.x + element.y * granularity] = element.value;
+    const matrix = data.matrix || [];
+    let word = {
+        cells: new Int32Array(matrix.length),
+        values: new Float32Array(matrix.length),
+        weight: data.weight === undefined ? 1.0 : data.weight
+    };
+    matrix.forEach((element, j) => {
+        word.cells[j] = element.x + element.y * granularity;
+        word.values[j] = element.value;
     });
-    return matrix;
+    return word;
+}
+
+/* Cells with more than the minimum prior, the only ones a best cell can be in */
+GeoLoc.prototype.prepareModel = function() {
+    const tweetsmatrix = this.model.tweetsmatrix;
+    let cMin = Infinity, numLive = 0;
+    for (let c = 0; c < tweetsmatrix.length; c++) {
+        cMin = Math.min(cMin, tweetsmatrix[c]);
+    }
+    this.model.logTweets = new Float64Array(tweetsmatrix.length);
+    for (let c = 0; c < tweetsmatrix.length; c++) {
+        this.model.logTweets[c] = Math.log(tweetsmatrix[c]);
+        numLive += tweetsmatrix[c] !== cMin ? 1 : 0;
+    }
+    this.model.liveCells = new Int32Array(numLive);
+    for (let c = 0, k = 0; c < tweetsmatrix.length; c++) {
+        if (tweetsmatrix[c] !== cMin) {
+            this.model.liveCells[k++] = c;
+        }
+    }
+    this.baseline = null;
+}
+
+GeoLoc.prototype.fetchBuffer = function(url) {
+    return fetch(url).then(response => response.status === 200 ? response.arrayBuffer() : null);
+}
+
+/* The grids of a sharded model */
+GeoLoc.prototype.parseModelBin = function(buffer) {
+    const header = new Uint32Array(buffer, 0, 4);
+    if (!GeoLoc.littleEndian || header[0] !== GeoLoc.MODEL_MAGIC || header[1] !== GeoLoc.SHARD_VERSION) {
+        throw new Error('Unsupported model.bin');
+    }
+    const cells = header[2];
+    this.model.tweetsmatrix = new Float32Array(buffer, 16, cells);
+    this.model.wordmatrix = new Float32Array(buffer, 16 + 4 * cells, cells);
+    this.model.centroids = new Float32Array(buffer, 16 + 8 * cells, 2 * cells);
+}
+
+/* Reads model.json (and model.bin); with metadataOnly just what plotting needs */
+GeoLoc.prototype.fetchModel = function(metadataOnly) {
+    return fetch(this.modelPath + 'model.json')
+        .then(response => {
+            if (response.status !== 200) {
+                throw new Error('Could not fetch model: ' + response.statusText);
+            }
+            return response.json();
+        })
+        .then(data => {
+            this.model = data;
+            if (metadataOnly) {
+                return this.model;
+            }
+            if (data.format === 'shards') {
+                return this.fetchBuffer(this.modelPath + 'model.bin').then(buffer => {
+                    if (buffer === null) {
+                        throw new Error('Could not fetch model.bin');
+                    }
+                    this.parseModelBin(buffer);
+                    this.prepareModel();
+                    return this.model;
+                });
+            }
+            let centroids = new Float32Array(2 * data.centroids.length);
+            data.centroids.forEach((centroid, cell) => {
+                centroids[2 * cell] = centroid[0];
+                centroids[2 * cell + 1] = centroid[1];
+            });
+            this.model.tweetsmatrix = Float32Array.from(data.tweetsmatrix, value => value || 0.0);
+            this.model.centroids = centroids;
+            let wordmatrix = new Float32Array(this.numCells());
+            data.wordmatrix.forEach(element => {
+                wordmatrix[element.x + element.y * data.granularity] = element.value;
+            });
+            this.model.wordmatrix = wordmatrix;
+            this.prepareModel();
+            return this.model;
+        })
+        .catch(reason => this.fetchErrorHandler(reason.message || reason));
+}
+
+GeoLoc.prototype.loadModel = function(path) {
+    this.modelPath = path;
+    this.words = new Map();
+    this.shards = new Map();
+    if (this.worker) {
+        /* The worker resolves paths against its own script, so pass it an absolute one */
+        this.worker.postMessage({type: 'load', path: new URL(path, self.location.href).href});
+    }
+    this.ready = this.fetchModel(this.worker !== null);
+    return this.ready;
+}
+
+/* Index of a shard:                                                         */
+/* header uint32 [magic, version, numwords, strings offset], then per word   */
+/* uint32 [hash, name offset, name length, data offset, numruns, nonzeros]   */
+/* and float32 [scale, weight], sorted by hash                               */
+GeoLoc.prototype.parseShard = function(buffer) {
+    const header = new Uint32Array(buffer, 0, 4);
+    if (!GeoLoc.littleEndian || header[0] !== GeoLoc.SHARD_MAGIC || header[1] !== GeoLoc.SHARD_VERSION) {
+        throw new Error('Unsupported shard');
+    }
+    return {
+        buffer: buffer,
+        bytes: new Uint8Array(buffer),
+        numWords: header[2],
+        stringsOffset: header[3],
+        index: new Uint32Array(buffer, 16, 8 * header[2]),
+        floats: new Float32Array(buffer, 16, 8 * header[2])
+    };
+}
+
+GeoLoc.prototype.fetchShard = function(n) {
+    if (!this.shards.has(n)) {
+        this.shards.set(n, this.fetchBuffer(this.modelPath + 'shards/' + n + '.bin')
+            .then(buffer => buffer === null ? null : this.parseShard(buffer)));
+    }
+    return this.shards.get(n);
+}
+
+/* Binary search of the shard's index, then unpack the runs of the word's matrix */
+GeoLoc.prototype.shardWord = function(shard, name, hash) {
+    const index = shard.index;
+    let lo = 0, hi = shard.numWords;
+    while (lo < hi) {
+        const mid = (lo + hi) >>> 1;
+        if (index[8 * mid] < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (let i = lo; i < shard.numWords && index[8 * i] === hash; i++) {
+        const offset = shard.stringsOffset + index[8 * i + 1];
+        if (index[8 * i + 2] !== name.length || !name.every((b, k) => shard.bytes[offset + k] === b)) {
+            continue;
+        }
+        const granularity = this.model.granularity;
+        const numRuns = index[8 * i + 4], nonzeros = index[8 * i + 5], scale = shard.floats[8 * i + 6];
+        const runs = new Uint16Array(shard.buffer, index[8 * i + 3], 3 * numRuns);
+        const values = new Uint16Array(shard.buffer, index[8 * i + 3] + 6 * numRuns, nonzeros);
+        let word = {cells: new Int32Array(nonzeros), values: new Float32Array(nonzeros), weight: shard.floats[8 * i + 7]};
+        for (let r = 0, j = 0; r < numRuns; r++) {
+            for (let k = 0; k < runs[3 * r + 2]; k++, j++) {
+                word.cells[j] = runs[3 * r] + (runs[3 * r + 1] + k) * granularity;
+                word.values[j] = GeoLoc.halfToFloat[values[j]] * scale;
+            }
+        }
+        return word;
+    }
+    return null;
+}
+
+GeoLoc.prototype.fetchWord = function(word) {
+    if (this.model.format === 'shards') {
+        const name = new TextEncoder().encode(word);
+        const hash = GeoLoc.hash(name);
+        return this.fetchShard(hash % this.model.shards)
+            .then(shard => shard === null ? null : this.shardWord(shard, name, hash));
+    }
+    return fetch(this.modelPath + 'words/' + word + '.json')
+        .then(response => response.status === 200 ? response.json() : null)
+        .then(data => data === null ? null : this.wordFromJSON(data));
+}
+
+/* Each word is fetched once; data is [[word, matrix or null], ...] in text order */
+GeoLoc.prototype.loadWords = function(words, callback) {
+    return Promise.all(
+        words.map(word => {
+            if (!this.words.has(word)) {
+                this.words.set(word, word === '' ? Promise.resolve(null) : this.fetchWord(word)
+                    .catch(error => {
+                        this.fetchErrorHandler('Remote error: ' + error);
+                        return null;
+                    }));
+            }
+            return this.words.get(word).then(data => [word, data]);
+        })
+    ).then(data => {
+        if (callback) {
+            if (GeoLoc.noWordsFound(data)) {
+                console.warn('No words found!');
+            } else {
+                callback(data);
+            }
+        }
+        return data;
+    });
+};
+
+/* log(prior) - log(p(c)_w + prior) for every cell, recomputed when the prior changes */
+GeoLoc.prototype.getBaseline = function() {
+    if (this.baseline === null || this.baselinePrior !== this.wordPrior || this.baselineUnk !== this.unk) {
+        const wordmatrix = this.model.wordmatrix;
+        const logPrior = Math.log(this.wordPrior);
+        /* p(c)_w + prior (includes UNK) */
+        const priorMass = this.wordPrior * (this.model.wordtypes + 1.0 + this.unk);
+        this.baseline = new Float64Array(wordmatrix.length);
+        for (let c = 0; c < wordmatrix.length; c++) {
+            this.baseline[c] = logPrior - Math.log(wordmatrix[c] + priorMass);
+        }
+        this.baselinePrior = this.wordPrior;
+        this.baselineUnk = this.unk;
+    }
+    return this.baseline;
 }
 
 /*
  * Naive Bayes:
  * p(c_i) * mass(c_i, w_1)/mass(c_i)_w * ... * mass(c_i, w_n)/mass(c_i)_w
+ *
+ * Every word adds the baseline log(prior) - log(p(c)_w + prior) to all cells, so
+ * only the weights are summed here, and the nonzero cells get the difference.
  */
 GeoLoc.prototype.classifyNaiveBayes = function(data, outputMatrix) {
-    const granularity = this.model.granularity;
-
-    /* Shortcut to speed up classification: we don't consider cells that have the minimum prior.
-       This, unless we want to output the whole distribution. */
-    const cMin = Math.min(...this.model.tweetsmatrix);
+    const baseline = this.getBaseline();
+    const logPrior = Math.log(this.wordPrior);
 
-    /* Need to get tweetmatrix in logspace */
-    let totalMatrix = this.model.tweetsmatrix.map(value => Math.log(value));
+    /* tweetmatrix in logspace */
+    let totalMatrix = new Float64Array(this.model.logTweets);
+    let weightSum = 0.0;
 
     data.forEach(element => {
         let wordData = element[1];  // Word is in element[0]
-        if (wordData === null) {
+        if (wordData === null || wordData.weight === 0) {
             return;  // Unknown word
         }
-
-        let tmpWordMatrix = this.sparseMatrixToMatrix(wordData.matrix);
-
-        /* Find argmax c p(c_i) * mass(c_i|w_1)/mass(c_i)_w * ...* mass(c_i|w_n)/mass(c_i)_w */
-        for (var c = 0, cn = granularity * granularity / 2; c < cn; c++) {
-            if (this.model.tweetsmatrix[c] === cMin && !outputMatrix) {
-                continue;
-            }
-
-            var p = tmpWordMatrix[c] + this.wordPrior;
-            /* p(c)_w + prior (includes UNK) */
-            var cIw = Math.log(this.model.wordmatrix[c] + this.wordPrior * (this.model.wordtypes + 1.0 + this.unk));
-            p = Math.log(p) - cIw;
-            totalMatrix[c] += p;
+        const weight = wordData.weight, cells = wordData.cells, values = wordData.values;
+        weightSum += weight;
+        for (let j = 0; j < cells.length; j++) {
+            totalMatrix[cells[j]] += weight * (Math.log(values[j] + this.wordPrior) - logPrior);
         }
     });
 
-    for (var c = 0, cn = granularity * granularity / 2, pMax = -Infinity, maxIndex = 0; c < cn; c++) {
-        if (this.model.tweetsmatrix[c] === cMin && !outputMatrix) {
-            continue;
-        }
-
-        if (totalMatrix[c] > pMax) {
-            pMax = totalMatrix[c];
+    /* Shortcut to speed up classification: we don't consider cells that have the minimum prior.
+       This, unless we want to output the whole distribution. */
+    const live = this.model.liveCells, numCells = outputMatrix ? totalMatrix.length : live.length;
+    let pMax = -Infinity, maxIndex = 0;
+    for (let k = 0; k < numCells; k++) {
+        const c = outputMatrix ? k : live[k];
+        const p = totalMatrix[c] += weightSum * baseline[c];
+        if (p > pMax) {
+            pMax = p;
             maxIndex = c;
         }
     }
@@ -87,6 +346,30 @@ GeoLoc.prototype.classifyNaiveBayes = function(data, outputMatrix) {
     };
 }
 
+/* Promise of {cell, centroid, matrix} for the words, or null if none is known */
+GeoLoc.prototype.classify = function(words, outputMatrix) {
+    outputMatrix = outputMatrix || false;
+    if (this.worker) {
+        const id = this.nextRequest++;
+        return new Promise(resolve => {
+            this.requests.set(id, resolve);
+            this.worker.postMessage({type: 'classify', id: id, words: words, outputMatrix: outputMatrix,
+                                     wordPrior: this.wordPrior, unk: this.unk});
+        });
+    }
+    return this.ready
+        .then(() => this.loadWords(words))
+        .then(data => {
+            if (GeoLoc.noWordsFound(data)) {
+                console.warn('No words found!');
+                return null;
+            }
+            let found = this.classifyNaiveBayes(data, outputMatrix);
+            found.centroid = [this.model.centroids[2 * found.cell], this.model.centroids[2 * found.cell + 1]];
+            return found;
+        });
+}
+
 GeoLoc.prototype.matrixToConsole = function(matrix) {
     let rows = [];
     for (var y = 0, yn = this.model.granularity / 2; y < yn; y++) {
@@ -99,27 +382,45 @@ GeoLoc.prototype.matrixToConsole = function(matrix) {
     console.log(rows.join('\n'));
 }
 
+/* Loops rather than Math.max(...matrix), which overflows the stack on fine grids */
 GeoLoc.prototype.matrixNormalizeLog = function(matrix) {
-    const max = Math.max(...matrix);
-    matrix = matrix.map(value => Math.exp(value - max));
-    const sum = matrix.reduce((acc, value) => acc + value, 0.0);
-    matrix = matrix.map(value => value / sum);
-    return matrix;
+    let max = -Infinity, sum = 0.0;
+    for (let c = 0; c < matrix.length; c++) {
+        max = Math.max(max, matrix[c]);
+    }
+    let normalized = new Float64Array(matrix.length);
+    for (let c = 0; c < matrix.length; c++) {
+        normalized[c] = Math.exp(matrix[c] - max);
+        sum += normalized[c];
+    }
+    for (let c = 0; c < matrix.length; c++) {
+        normalized[c] /= sum;
+    }
+    return normalized;
 }
 
 GeoLoc.prototype.matrixNormalize0To1 = function(matrix) {
-    const min = Math.min(...matrix);
-    const max = Math.max(...matrix);
+    let min = Infinity, max = -Infinity;
+    for (let c = 0; c < matrix.length; c++) {
+        min = Math.min(min, matrix[c]);
+        max = Math.max(max, matrix[c]);
+    }
     const range = max - min;
     return matrix.map(value => (value - min) / range);
 }
 
-GeoLoc.prototype.matrixToGeoJSON = function(matrix) {
+/* Cells as polygons; with minValue, only the cells above it */
+GeoLoc.prototype.matrixToGeoJSON = function(matrix, minValue) {
     const halfCell = this.xToMidLon(this.model.granularity / 2);
-    let features = matrix.map((value, cell) => {
+    let features = [];
+    for (let cell = 0; cell < matrix.length; cell++) {
+        const value = matrix[cell];
+        if (minValue !== undefined && !(value > minValue)) {
+            continue;
+        }
         const midLon = this.xToMidLon(this.cellToX(cell));
         const midLat = this.yToMidLat(this.cellToY(cell));
-        return {
+        features.push({
             type: 'Feature',
             geometry: {
                 type: 'Polygon',
@@ -134,8 +435,8 @@ GeoLoc.prototype.matrixToGeoJSON = function(matrix) {
             properties: {
                 value: value
             }
-        };
-    });
+        });
+    }
     return {
         type: 'FeatureCollection',
         features: features
@@ -161,25 +462,11 @@ GeoLoc.noWordsFound = function(data) {
 }
 
 GeoLoc.prototype.fetchErrorHandler = function(msg) {
-    alert(msg);
-}
-
-GeoLoc.prototype.loadModel = function(path) {
-    this.modelPath = path;
-    fetch(this.modelPath + 'model.json')
-        .then(response => {
-            if (response.status === 200) {
-                return response.json();
-            } else {
-                this.fetchErrorHandler('Could not fetch model: ' + response.statusText);
-            }
-        }, reason => {
-            alert(reason);
-        })
-        .then(data => {
-            this.model = data;
-            this.model.wordmatrix = this.sparseMatrixToMatrix(this.model.wordmatrix);
-        });
+    if (typeof alert === 'function') {
+        alert(msg);
+    } else {
+        console.error(msg);
+    }
 }
 
 GeoLoc.prototype.reset = function() {
@@ -195,35 +482,22 @@ GeoLoc.prototype.reset = function() {
     }
 }
 
-GeoLoc.prototype.loadWords = function(words, callback) {
-    Promise.all(
-        words.map(word => fetch(this.modelPath + 'words/' + word + '.json')
-            .then(response => response.status === 200 ? response.json() : null)
-            .then(data => [word, data])
-            .catch(error => GeoLoc.fetchErrorHandler('Remote error: ' + error))
-    )).then(data => {
-        if (GeoLoc.noWordsFound(data)) {
-            console.warn('No words found!');
-            return;
-        }
-        callback(data);
-    });
-};
-
 GeoLoc.prototype.locateAsPoint = function(text, useCentroids) {
     useCentroids = useCentroids || false;
-    words = GeoLoc.prepareWords(text);
+    const words = GeoLoc.prepareWords(text);
     if (!words || words.length === 0) {
         return;
     }
 
-    this.loadWords(words, data => {
-        let found = this.classifyNaiveBayes(data);
+    this.classify(words).then(found => {
+        if (found === null) {
+            return;
+        }
         let lat = null,
             lon = null;
         if (useCentroids) {
-            lat = this.model.centroids[found.cell][0];
-            lon = this.model.centroids[found.cell][1];
+            lat = found.centroid[0];
+            lon = found.centroid[1];
         } else {
             lat = this.yToMidLat(this.cellToY(found.cell));
             lon = this.xToMidLon(this.cellToX(found.cell));
@@ -241,17 +515,20 @@ GeoLoc.prototype.getColor = function(value) {
 }
 
 GeoLoc.prototype.locateAsGrid = function(text) {
-    words = GeoLoc.prepareWords(text);
+    const words = GeoLoc.prepareWords(text);
     if (!words || words.length === 0) {
         return;
     }
 
-    this.loadWords(words, data => {
-        let found = this.classifyNaiveBayes(data, true);
+    this.classify(words, true).then(found => {
+        if (found === null) {
+            return;
+        }
         let matrix = this.matrixNormalizeLog(found.matrix);
         //this.matrixToConsole(matrix);
         matrix = this.matrixNormalize0To1(matrix);
-        this.layer = L.geoJSON(this.matrixToGeoJSON(matrix), {
+        /* Cells at or below 0.33 are transparent, so they aren't drawn at all */
+        this.layer = L.geoJSON(this.matrixToGeoJSON(matrix, 0.33), {
             style: (feature) => {
                 return {
                     opacity: 0,
@@ -262,3 +539,20 @@ GeoLoc.prototype.locateAsGrid = function(text) {
         }).addTo(this.map);
     });
 }
+
+/* Running as the Web Worker of a GeoLoc created with {worker: ...} */
+if (typeof WorkerGlobalScope !== 'undefined' && self instanceof WorkerGlobalScope) {
+    const workerGeoLoc = new GeoLoc(null);
+    self.onmessage = event => {
+        const message = event.data;
+        if (message.type === 'load') {
+            workerGeoLoc.loadModel(message.path);
+        } else if (message.type === 'classify') {
+            workerGeoLoc.wordPrior = message.wordPrior;
+            workerGeoLoc.unk = message.unk;
+            workerGeoLoc.classify(message.words, message.outputMatrix).then(found => {
+                self.postMessage({id: message.id, result: found}, found ? [found.matrix.buffer] : []);
+            });
+        }
+    };
+}
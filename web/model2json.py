@@ -1,5 +1,5 @@
 #!/usr/bin/env python3
-"""Convert geoloc model to JSON format"""
+"""Convert geoloc model to JSON format, or to binary shards (--format=shards)"""
 import re
 import sys
 import logging
@@ -8,6 +8,8 @@ import gzip
 import os
 import json
 import platform
+import struct
+from array import array
 from enum import Enum, auto
 
 
@@ -25,6 +27,9 @@ parser = argparse.ArgumentParser(description=sys.modules[__name__].__doc__)
 parser.add_argument('--coords', action='store_true', help='Add coords to output files')
 parser.add_argument('--weight', action='store_true', help='Add weight to output files')
 parser.add_argument('--word_id', action='store_true', help='Add word id to output files')
+parser.add_argument('--format', choices=['json', 'shards'], default='json',
+                    help='One JSON file per word (default), or hash-bucketed binary shards')
+parser.add_argument('--shards', type=int, default=256, help='Number of shards with --format=shards')
 parser.add_argument('model_file', help='Geoloc model file')
 parser.add_argument('output_dir', help='Model output dir')
 args = parser.parse_args()
@@ -36,6 +41,97 @@ def log_unknown_line(l: str):
     logging.error('Unknown line: {}'.format(l))
 
 
+# Binary shards (--format=shards), all little-endian:
+#
+#   model.json    granularity, wordtypes, format, shards, version
+#   model.bin     'GLMB', uint32 version, uint32 cells, uint32 pad,
+#                 float32 tweetsmatrix[cells], float32 wordmatrix[cells],
+#                 float32 centroids[2 * cells] (lat, lon)
+#   shards/N.bin  words whose FNV-1a hash (of the UTF-8 word) is N modulo shards:
+#                 'GLSH', uint32 version, uint32 numwords, uint32 strings offset,
+#                 index of numwords entries sorted by hash, each 8 x 4 bytes:
+#                   uint32 hash, name offset, name length, data offset,
+#                   numruns, nonzeros, float32 scale, float32 weight
+#                 then the UTF-8 names, then per word (2-byte aligned)
+#                   uint16 runs[numruns][3] (x, y of the first cell, length)
+#                   uint16 values[nonzeros] (half floats, scaled by 'scale')
+#
+# The matrices are packed like geoloc --quantize: runs of cells down a column
+# and half-precision values relative to the word's largest value.
+
+SHARD_VERSION = 1
+
+
+def fnv1a(data: bytes) -> int:
+    h = 0x811c9dc5
+    for b in data:
+        h = ((h ^ b) * 0x01000193) & 0xffffffff
+    return h
+
+
+class ShardWriter:
+    def __init__(self, output_dir: str, numshards: int):
+        self.output_dir = output_dir
+        self.numshards = numshards
+        self.words = [[] for _ in range(numshards)]  # (hash, name, weight, scale, runs, values)
+        os.makedirs(os.path.join(output_dir, 'shards'), mode=0o755, exist_ok=True)
+
+    def add(self, word: str, weight: float, matrix: list):
+        name = word.encode('utf-8')
+        h = fnv1a(name)
+        scale = max((v for _, _, v in matrix), default=0.0) or 1.0
+        runs = array('H')
+        values = array('H')
+        for j, (x, y, v) in enumerate(matrix):
+            if j == 0 or x != matrix[j - 1][0] or y != matrix[j - 1][1] + 1:
+                runs.extend((x, y, 0))
+            runs[-1] += 1
+            values.frombytes(struct.pack('<e', v / scale))
+        self.words[h % self.numshards].append((h, name, weight, scale, runs, values))
+
+    def close(self) -> int:
+        total = 0
+        for n, words in enumerate(self.words):
+            words.sort(key=lambda w: (w[0], w[1]))
+            strings = b''.join(w[1] for w in words)
+            stringsoffset = 16 + 32 * len(words)
+            dataoffset = stringsoffset + len(strings)
+            dataoffset += dataoffset % 2
+            index, data = [], bytearray()
+            nameoffset = 0
+            for h, name, weight, scale, runs, values in words:
+                index.append(struct.pack('<6I2f', h, nameoffset, len(name), dataoffset + len(data),
+                                         len(runs) // 3, len(values), scale, weight))
+                nameoffset += len(name)
+                if sys.byteorder != 'little':
+                    runs.byteswap()
+                    values.byteswap()
+                data += runs.tobytes() + values.tobytes()
+            with open(os.path.join(self.output_dir, 'shards', '{}.bin'.format(n)), 'wb') as shard:
+                shard.write(struct.pack('<4s3I', b'GLSH', SHARD_VERSION, len(words), stringsoffset))
+                shard.write(b''.join(index))
+                shard.write(strings)
+                shard.write(b'\0' * ((stringsoffset + len(strings)) % 2))
+                shard.write(data)
+                total += shard.tell()
+        return total
+
+
+def write_model_bin(output_dir: str, properties: dict):
+    cells = properties['granularity'] * properties['granularity'] // 2
+    tweetsmatrix = array('f', (v or 0.0 for v in properties['tweetsmatrix']))
+    wordmatrix = array('f', [0.0] * cells)
+    for element in properties['wordmatrix']:
+        wordmatrix[element['x'] + element['y'] * properties['granularity']] = element['value']
+    centroids = array('f', (v for c in properties['centroids'] for v in c))
+    if sys.byteorder != 'little':
+        for a in (tweetsmatrix, wordmatrix, centroids):
+            a.byteswap()
+    with open(os.path.join(output_dir, 'model.bin'), 'wb') as model_bin:
+        model_bin.write(struct.pack('<4s3I', b'GLMB', SHARD_VERSION, cells, 0))
+        model_bin.write(tweetsmatrix.tobytes() + wordmatrix.tobytes() + centroids.tobytes())
+
+
 def word_is_saveable(word: str) -> bool:
     if '*' in word or '?' in word or '\\' in word or '/' in word:
         return False
@@ -54,9 +150,13 @@ with gzip.open(args.model_file, 'rt', encoding='utf-8') as model:
     index = 0
     model_properties = {'wordtypes': 0}
     word_properties = {}
+    shard_writer = ShardWriter(args.output_dir, args.shards) if args.format == 'shards' else None
 
     def save_word(word: str, properties: dict):
-        if word_is_saveable(word):
+        if shard_writer is not None:
+            matrix = [(e['x'], e['y'], e['value']) for e in properties.get('matrix', [])]
+            shard_writer.add(word, properties.get('weight', 1.0), matrix)
+        elif word_is_saveable(word):
             word_file_name = os.path.join(args.output_dir, 'words', '{word}.json'.format(word=word))
             with open(word_file_name, 'w', encoding='utf-8') as word_file:
                 json.dump(properties, word_file, ensure_ascii=False)
@@ -68,7 +168,8 @@ with gzip.open(args.model_file, 'rt', encoding='utf-8') as model:
         return {}
 
     logging.info('Starting conversion')
-    os.makedirs(os.path.join(args.output_dir, 'words'), mode=0o755, exist_ok=True)
+    if shard_writer is None:
+        os.makedirs(os.path.join(args.output_dir, 'words'), mode=0o755, exist_ok=True)
     for line in model:
         if mode == Mode.NONE:
             if line.startswith('#LONGRANULARITY#'):
@@ -87,7 +188,7 @@ with gzip.open(args.model_file, 'rt', encoding='utf-8') as model:
                 tokens = line.split(' ')
                 word = tokens[2].rstrip()
                 word_properties = make_word_properties(word)
-                if args.weight:
+                if args.weight or shard_writer is not None:
                     weight = float(tokens[3]) if len(tokens) == 4 else 1.0
                     word_properties['weight'] = weight
                 if args.word_id:
@@ -161,7 +262,7 @@ with gzip.open(args.model_file, 'rt', encoding='utf-8') as model:
                 tokens = line.split(' ')
                 word = tokens[2].rstrip()
                 word_properties = make_word_properties(word)
-                if args.weight:
+                if args.weight or shard_writer is not None:
                     weight = float(tokens[3]) if len(tokens) == 4 else 1.0
                     word_properties['weight'] = weight
                 if args.word_id:
@@ -188,6 +289,12 @@ with gzip.open(args.model_file, 'rt', encoding='utf-8') as model:
                 mode = Mode.NONE
             else:
                 log_unknown_line(line)
+    if shard_writer is not None:
+        size = shard_writer.close()
+        write_model_bin(args.output_dir, model_properties)
+        logging.info('Wrote {} shards with {} words ({} bytes)'.format(args.shards, model_properties['wordtypes'], size))
+        model_properties = {key: model_properties[key] for key in ('granularity', 'wordtypes')}
+        model_properties.update({'format': 'shards', 'shards': args.shards, 'version': SHARD_VERSION})
     with open(os.path.join(args.output_dir, 'model.json'), 'w', encoding='utf-8') as model_file:
         json.dump(model_properties, model_file)
     logging.info('Finished conversion')
@@ -16,24 +16,41 @@
 
 /* Hash functions for words                          */
 /* Stores word in hash and generates a running value */
-/* Uses a linear probing table and rehashes          */
-/* when table occupancy reaches 0.5                  */
+/* Uses a linear probing table (size a power of two) */
+/* and rehashes when table occupancy reaches 0.5     */
+/* Each slot keeps the word's hash, so most probes   */
+/* are rejected without touching the key, and keys   */
+/* are copied into a bump arena owned by the hash    */
 /* MH 20140205                                       */
 
+#define WORDHASH_ARENA_CHUNK 65536
+
+struct wordhash_arena {
+    struct wordhash_arena *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
 struct wordhash {
     struct wordhash_table *table;
-    unsigned int tablesize;
+    unsigned int tablesize;               /* Always a power of two */
     unsigned int occupancy;
+    struct wordhash_arena *arena;
 };
 
 struct wordhash_table {
     char *word;
+    unsigned int hash;                    /* wordhash_hashf(word) */
     int value;
 };
 
-struct wordhash *wordhash_init(int tablesize);        /* Initialize hash with tablesize entries             */
+struct wordhash *wordhash_init(int tablesize);        /* Initialize hash with (at least) tablesize entries  */
+unsigned int wordhash_hashf(char *word);              /* Hash of word (also stored in binary models!)       */
 int wordhash_insert(struct wordhash *wh, char *word); /* Insert word into hash, value automatically generated */
 int wordhash_find(struct wordhash *wh, char *word);   /* Find value for word, -1 = not found                  */
+int wordhash_find_hashed(struct wordhash *wh, char *word, unsigned int hash); /* Same, hash precomputed      */
+int wordhash_find_or_insert(struct wordhash *wh, char *word, int *inserted);  /* Find, or insert if missing  */
 void wordhash_free(struct wordhash *wh);              /* Release memory                                     */
 void wordhash_set_value(struct wordhash *wh, char *word, int value);
 void wordhash_inc_value(struct wordhash *wh, char *word);
@@ -49,61 +66,92 @@ unsigned int wordhash_hashf(char *word) { /* djb2 */
     return hash;
 }
 
-int wordhash_find(struct wordhash *wh, char *word) {
+/* djb2 is weak in its low bits, so mix before masking (binary models too) */
+static inline unsigned int wordhash_mix(unsigned int hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    return(hash);
+}
+
+static inline unsigned int wordhash_slot(struct wordhash *wh, unsigned int hash) {
+    return(wordhash_mix(hash) & (wh->tablesize - 1));
+}
+
+char *wordhash_arena_strdup(struct wordhash *wh, char *word) {
+    struct wordhash_arena *a;
+    size_t len, size;
+    len = strlen(word) + 1;
+    if (wh->arena == NULL || wh->arena->used + len > wh->arena->size) {
+	size = len > WORDHASH_ARENA_CHUNK ? len : WORDHASH_ARENA_CHUNK;
+	if ((a = malloc(sizeof(struct wordhash_arena) + size)) == NULL)
+	    exit(1);
+	a->used = 0;
+	a->size = size;
+	a->next = wh->arena;
+	wh->arena = a;
+    }
+    a = wh->arena;
+    memcpy(a->data + a->used, word, len);
+    a->used += len;
+    return(a->data + a->used - len);
+}
+
+int wordhash_find_hashed(struct wordhash *wh, char *word, unsigned int hash) {
     struct wordhash_table *table;
-    unsigned int hash, j;
+    unsigned int slot, mask;
     table = wh->table;
-    hash = wordhash_hashf(word) % wh->tablesize;
-    for (j = 0; j < wh->tablesize; j++) {
-	if ((table + hash)->value == - 1)
-	    return -1;
-	if (strcmp((table+hash)->word, word) == 0) {
-	    return((table + hash)->value);
-	}
-	hash++;
-	if (hash >= wh->tablesize)
-	    hash -= wh->tablesize;
+    mask = wh->tablesize - 1;
+    for (slot = wordhash_slot(wh, hash); table[slot].value != -1; slot = (slot + 1) & mask) {
+	if (table[slot].hash == hash && strcmp(table[slot].word, word) == 0)
+	    return(table[slot].value);
     }
     return -1;
 }
 
-void wordhash_insert_with_value(struct wordhash *wh, char *word, int value) {
+int wordhash_find(struct wordhash *wh, char *word) {
+    return(wordhash_find_hashed(wh, word, wordhash_hashf(word)));
+}
+
+/* Place an entry known not to be in the table (key already owned by the hash) */
+void wordhash_place(struct wordhash *wh, char *word, unsigned int hash, int value) {
     struct wordhash_table *table;
-    unsigned int hash;
+    unsigned int slot, mask;
     table = wh->table;
-    hash = wordhash_hashf(word) % wh->tablesize;
-    for (;;) {
-	if ((table + hash)->value == -1) {
-	    (table + hash)->value = value;
-	    (table + hash)->word = word;
-	    break;
-	}
-	hash++;
-	if (hash >= wh->tablesize)
-	    hash -= wh->tablesize;
-    }
+    mask = wh->tablesize - 1;
+    for (slot = wordhash_slot(wh, hash); table[slot].value != -1; slot = (slot + 1) & mask) { }
+    table[slot].word = word;
+    table[slot].hash = hash;
+    table[slot].value = value;
 }
 
 void wordhash_rehash(struct wordhash *wh) {
-    int i;
-    unsigned int newtablesize, oldtablesize;
+    unsigned int i, oldtablesize;
     struct wordhash_table *oldtable;
-    newtablesize = wh->tablesize * 2;
     oldtablesize = wh->tablesize;
     oldtable = wh->table;
-    wh->table = (struct wordhash_table *) malloc(sizeof(struct wordhash_table) * newtablesize);
-    wh->tablesize = newtablesize;
-    for (i = 0; i < newtablesize; i++) {
+    wh->tablesize = oldtablesize * 2;
+    wh->table = (struct wordhash_table *) malloc(sizeof(struct wordhash_table) * wh->tablesize);
+    for (i = 0; i < wh->tablesize; i++) {
 	(wh->table+i)->value = -1;
     }
     for (i = 0; i < oldtablesize; i++) {
-	if ((oldtable+i)-> value != -1) {
-	    wordhash_insert_with_value(wh, (oldtable+i)->word, (oldtable+i)->value);
+	if ((oldtable+i)->value != -1) {
+	    wordhash_place(wh, (oldtable+i)->word, (oldtable+i)->hash, (oldtable+i)->value);
 	}
     }
     free(oldtable);
 }
 
+/* Add a new word (not yet in the table) with value */
+void wordhash_add(struct wordhash *wh, char *word, unsigned int hash, int value) {
+    wordhash_place(wh, wordhash_arena_strdup(wh, word), hash, value);
+    wh->occupancy = wh->occupancy + 1;
+    if (wh->occupancy > wh->tablesize / 2) {
+	wordhash_rehash(wh);
+    }
+}
+
 void wordhash_inc_value(struct wordhash *wh, char *word) {
     int currvalue;
     if ((currvalue = wordhash_find(wh, word)) == -1) {
@@ -115,59 +163,44 @@ void wordhash_inc_value(struct wordhash *wh, char *word) {
 
 void wordhash_set_value(struct wordhash *wh, char *word, int value) {
     struct wordhash_table *table;
-    unsigned int hash, j;
+    unsigned int hash, slot, mask;
     table = wh->table;
-    hash = wordhash_hashf(word) % wh->tablesize;
-    for (j = 0; j < wh->tablesize; j++) {
-	if ((table + hash)->value == - 1) {
-	    (table + hash)->value = value;
-	    (table + hash)->word = strdup(word);
-	    wh->occupancy = wh->occupancy + 1;
-	    if (wh->occupancy > wh->tablesize / 2) {
-		wordhash_rehash(wh);
-	    }
+    mask = wh->tablesize - 1;
+    hash = wordhash_hashf(word);
+    for (slot = wordhash_slot(wh, hash); table[slot].value != -1; slot = (slot + 1) & mask) {
+	if (table[slot].hash == hash && strcmp(table[slot].word, word) == 0) {
+	    table[slot].value = value;
 	    return;
 	}
-	if (strcmp((table+hash)->word, word) == 0) {
-	    (table + hash)->value = value;
-	    return;
-	}
-	hash++;
-	if (hash >= wh->tablesize)
-	    hash -= wh->tablesize;
     }
-    exit(1);
+    wordhash_add(wh, word, hash, value);
 }
 
-
-
 int wordhash_insert(struct wordhash *wh, char *word) {
-    struct wordhash_table *table;
+    wordhash_add(wh, word, wordhash_hashf(word), wh->occupancy);
+    return(wh->occupancy - 1);
+}
+
+int wordhash_find_or_insert(struct wordhash *wh, char *word, int *inserted) {
     unsigned int hash;
-    table = wh->table;
-    hash = wordhash_hashf(word) % wh->tablesize;
-    for (;;) {
-	if ((table + hash)->value == - 1) {
-	    (table + hash)->value = wh->occupancy;
-	    (table + hash)->word = strdup(word);
-	    wh->occupancy = wh->occupancy + 1;
-	    if (wh->occupancy > wh->tablesize / 2) {
-		wordhash_rehash(wh);
-	    }
-	    return(wh->occupancy - 1);
-	}
-	hash++;
-	if (hash >= wh->tablesize)
-	    hash -= wh->tablesize;
+    int value;
+    hash = wordhash_hashf(word);
+    if ((value = wordhash_find_hashed(wh, word, hash)) != -1) {
+	*inserted = 0;
+	return(value);
     }
+    *inserted = 1;
+    wordhash_add(wh, word, hash, wh->occupancy);
+    return(wh->occupancy - 1);
 }
 
 struct wordhash *wordhash_init(int tablesize) {
     struct wordhash *wh;
-    int i;
+    unsigned int i;
     wh = (struct wordhash *) malloc(sizeof(struct wordhash));
-    wh->tablesize = tablesize;
+    for (wh->tablesize = 2; wh->tablesize < (unsigned int)tablesize; wh->tablesize *= 2) { }
     wh->occupancy = 0;
+    wh->arena = NULL;
     wh->table = (struct wordhash_table *) malloc(sizeof(struct wordhash_table) * wh->tablesize);
     for (i = 0; i < wh->tablesize; i++) {
 	(wh->table+i)->value = -1;
@@ -176,16 +209,13 @@ struct wordhash *wordhash_init(int tablesize) {
 }
 
 void wordhash_free(struct wordhash *wh) {
-    unsigned int i;
+    struct wordhash_arena *a, *next;
     if (wh != NULL) {
-	if (wh->table != NULL) {
-	    for (i = 0; i < wh->tablesize; i++) {
-		if ((wh->table+i)->value != -1) {
-		    free((wh->table+i)->word);
-		}
-	    }
-	    free(wh->table);
+	for (a = wh->arena; a != NULL; a = next) {
+	    next = a->next;
+	    free(a);
 	}
+	free(wh->table);
 	free(wh);
     }
 }